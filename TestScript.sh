@@ -5,12 +5,10 @@ set -x
 # STUDENT PARAMETERS
 # change where your logging file is so it can be deleted
 LOGGING_FILE=test.logg
-CHECKPOINT_POSITION_FILE=loggingFileStatus.txt
-SWAP_SAPCE_OBJECTS = ss_objects.txt
+CHECKPOINT_MANIFEST_FILE=checkpoint.manifest
 
 ## GLOBAL PARAMETERS
 TREE_DIRECTORY=tmpdir
-TREE_DIRECTORY_BACKUP=tmpdir_backup
 INPUT_FILE_NAME=test_inputs.txt
 OUTPUT_FILE_NAME=output_test.txt
 OUTPUT_FILE_NAME_RESUME=RESUMED_output_test.txt
@@ -25,9 +23,9 @@ WAIT_KILL_TIME=5
 
 mkdir -p $TREE_DIRECTORY
 # delete everything inside
-rm -f $TREE_DIRECTORY/* $TREE_DIRECTORY_BACKUP/*
+rm -f $TREE_DIRECTORY/*
 # remove the logging file: STUDENTS CHANGE THIS
-rm $LOGGING_FILE $CHECKPOINT_POSITION_FILE $SWAP_SAPCE_OBJECTS
+rm $LOGGING_FILE $CHECKPOINT_MANIFEST_FILE
 
 ####
 #### TEST FOR CRASH AND RECOVERY
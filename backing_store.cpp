@@ -7,6 +7,30 @@
 #include <fstream>
 #include <cstdlib> 
 #include <unistd.h> 
+#include <fcntl.h>
+#include <dirent.h>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <system_error>
+
+//default asynchronous interface: do the work synchronously.
+std::future<std::iostream *> backing_store::get_async(uint64_t obj_id, uint64_t version) {
+  std::promise<std::iostream *> result;
+  result.set_value(get(obj_id, version));
+  return result.get_future();
+}
+
+void backing_store::put_batch(std::vector<std::iostream *> &batch) {
+  for (auto it = batch.begin(); it != batch.end(); ++it)
+    put(*it);
+}
 
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
@@ -25,6 +49,7 @@ void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t versi
   dummy.flush();
 
   assert(dummy.good());
+  unsynced.push_back(filename);
   //return id;
 }
 
@@ -32,7 +57,8 @@ void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t versi
 //delete the file associated with an specific version of a node
 void one_file_per_object_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
   std::string filename = get_filename(obj_id, version);
-  assert(unlink(filename.c_str()) == 0);
+  int res = unlink(filename.c_str());
+  assert(res == 0);
 }
 
 //return filestream corresponding to an item. Needed for deserialization.
@@ -50,12 +76,12 @@ std::iostream * one_file_per_object_backing_store::get(uint64_t obj_id, uint64_t
   return ios;
 }
 
-//push changes from iostream and close.
+//push changes from iostream and close.  New files are synced later
+//by sync().
 void one_file_per_object_backing_store::put(std::iostream *ios)
 {
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
-  fsync(fb->fd());
 
   delete ios;
   delete fb;
@@ -68,3 +94,825 @@ std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uin
   return root + "/" + std::to_string(obj_id) + "_" + std::to_string(version);
 
 }
+
+//sync every file allocated since the last sync, then the directory
+//so that their names are durable too.  Files that were deallocated
+//in the meantime are skipped.  Throws std::system_error if any sync
+//fails; the files stay listed, so the next sync() tries them again.
+void one_file_per_object_backing_store::sync(void) {
+  for (auto it = unsynced.begin(); it != unsynced.end(); ++it) {
+    int fd = open(it->c_str(), O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+      continue;
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "open " + *it);
+    int res = fsync(fd);
+    int error = errno;
+    close(fd);
+    if (res != 0)
+      throw std::system_error(error, std::generic_category(), "fsync " + *it);
+  }
+
+  int dir_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0)
+    throw std::system_error(errno, std::generic_category(), "open " + root);
+  int res = fsync(dir_fd);
+  int error = errno;
+  close(dir_fd);
+  if (res != 0)
+    throw std::system_error(error, std::generic_category(), "fsync " + root);
+  unsynced.clear();
+}
+
+//delete every "<obj_id>_<version>" file that versions does not list.
+void one_file_per_object_backing_store::retain_only(const std::set<std::pair<uint64_t, uint64_t>> &versions) {
+  DIR* dir = opendir(root.c_str());
+  assert(dir != nullptr);
+
+  std::vector<std::string> dropped;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    uint64_t obj_id, version;
+    char rest;
+    if (entry->d_type == DT_REG &&
+        sscanf(entry->d_name, "%" SCNu64 "_%" SCNu64 "%c", &obj_id, &version, &rest) == 2 &&
+        versions.count(std::make_pair(obj_id, version)) == 0)
+      dropped.push_back(root + "/" + entry->d_name);
+  }
+  closedir(dir);
+
+  for (auto it = dropped.begin(); it != dropped.end(); ++it)
+    unlink(it->c_str());
+  unsynced.clear();
+}
+
+uint64_t one_file_per_object_backing_store::get_version_bytes(uint64_t obj_id, uint64_t version) {
+  struct stat st;
+  if (stat(get_filename(obj_id, version).c_str(), &st) != 0)
+    return 0;
+  return st.st_size;
+}
+
+//the size of every "<obj_id>_<version>" file
+uint64_t one_file_per_object_backing_store::get_disk_bytes(void) {
+  DIR* dir = opendir(root.c_str());
+  assert(dir != nullptr);
+
+  uint64_t bytes = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    uint64_t obj_id, version;
+    char rest;
+    if (entry->d_type == DT_REG &&
+        sscanf(entry->d_name, "%" SCNu64 "_%" SCNu64 "%c", &obj_id, &version, &rest) == 2)
+      bytes += get_version_bytes(obj_id, version);
+  }
+  closedir(dir);
+  return bytes;
+}
+
+
+/////////////////////////////////////////////////////
+// Implementation of the single_file_backing_store //
+/////////////////////////////////////////////////////
+
+// The stream handed out by get().  It buffers the whole version in
+// memory and remembers which version it belongs to, so that put() knows
+// where to write it.
+class extent_stream : public std::stringstream {
+public:
+  extent_stream(uint64_t id, uint64_t v)
+    : std::stringstream(std::ios::in | std::ios::out | std::ios::binary),
+      obj_id(id),
+      version(v)
+  {}
+
+  uint64_t obj_id;
+  uint64_t version;
+};
+
+static uint64_t round_up_to_block(uint64_t length) {
+  if (length == 0)
+    length = 1;
+  return (length + SINGLE_FILE_BLOCK_SIZE - 1) / SINGLE_FILE_BLOCK_SIZE * SINGLE_FILE_BLOCK_SIZE;
+}
+
+//pread/pwrite all of buf, retrying on EINTR and short counts.  A
+//failure throws std::system_error; hitting the end of the file while
+//reading is reported as EIO.
+static void pread_fully(int fd, char *buf, uint64_t length, uint64_t offset, const char *what) {
+  while (length > 0) {
+    ssize_t nread = pread(fd, buf, length, offset);
+    if (nread < 0 && errno == EINTR)
+      continue;
+    if (nread <= 0)
+      throw std::system_error(nread < 0 ? errno : EIO, std::generic_category(), what);
+    buf += nread;
+    length -= nread;
+    offset += nread;
+  }
+}
+
+static void pwrite_fully(int fd, const char *buf, uint64_t length, uint64_t offset, const char *what) {
+  while (length > 0) {
+    ssize_t written = pwrite(fd, buf, length, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      throw std::system_error(written < 0 ? errno : EIO, std::generic_category(), what);
+    buf += written;
+    length -= written;
+    offset += written;
+  }
+}
+
+single_file_backing_store::single_file_backing_store(std::string rt)
+  : root(rt)
+{
+  open_store();
+}
+
+single_file_backing_store::~single_file_backing_store(void) {
+  close_store();
+}
+
+//open (or create) the data file and the map, then rebuild the
+//extent table and the free list from the map.
+void single_file_backing_store::open_store(void) {
+  std::string data_path = root + "/" + SINGLE_FILE_DATA_NAME;
+  data_fd = open(data_path.c_str(), O_RDWR | O_CREAT, 0644);
+  assert(data_fd >= 0);
+
+  struct stat st;
+  int res = fstat(data_fd, &st);
+  assert(res == 0);
+  file_capacity = st.st_size;
+
+  replay_map();
+
+  std::string map_path = root + "/" + SINGLE_FILE_MAP_NAME;
+  map_fd = open(map_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  assert(map_fd >= 0);
+}
+
+void single_file_backing_store::close_store(void) {
+  if (map_fd >= 0) {
+    fdatasync(map_fd);
+    close(map_fd);
+  }
+  if (data_fd >= 0)
+    close(data_fd);
+  map_fd = -1;
+  data_fd = -1;
+  extents.clear();
+  free_extents.clear();
+  file_end = 0;
+  file_capacity = 0;
+  live_bytes = 0;
+}
+
+//replay the map journal, then compact it into one alloc record per
+//live version so that it does not grow across runs.
+void single_file_backing_store::replay_map(void) {
+  std::string map_path = root + "/" + SINGLE_FILE_MAP_NAME;
+  std::ifstream map_file(map_path);
+  std::string line;
+  while (std::getline(map_file, line)) {
+    // a record without its newline was torn by a crash
+    if (map_file.eof())
+      break;
+    std::istringstream iss(line);
+    std::string op;
+    uint64_t obj_id, version;
+    iss >> op >> obj_id >> version;
+    if (op == "alloc") {
+      extent e;
+      iss >> e.offset >> e.length;
+      e.is_written = true;
+      extents[std::make_pair(obj_id, version)] = e;
+    } else if (op == "free") {
+      extents.erase(std::make_pair(obj_id, version));
+    }
+  }
+  map_file.close();
+
+  // Everything between the live extents is free.
+  std::map<uint64_t, uint64_t> used;
+  for (auto it = extents.begin(); it != extents.end(); ++it) {
+    used[it->second.offset] = round_up_to_block(it->second.length);
+    live_bytes += it->second.length;
+  }
+  file_end = 0;
+  for (auto it = used.begin(); it != used.end(); ++it) {
+    if (it->first > file_end)
+      free_extents[file_end] = it->first - file_end;
+    file_end = it->first + it->second;
+  }
+  if (file_end > file_capacity)
+    file_capacity = file_end;
+
+  // Like the checkpoint manifest, the compacted map is synced before
+  // it is renamed over the journal, and the rename is synced, so a
+  // crash leaves either the old journal or the whole new map.
+  std::stringstream compacted;
+  for (auto it = extents.begin(); it != extents.end(); ++it) {
+    compacted << "alloc " << it->first.first << " " << it->first.second << " "
+              << it->second.offset << " " << it->second.length << std::endl;
+  }
+  std::string contents = compacted.str();
+  std::string tmp_path = map_path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  ssize_t written = write(fd, contents.data(), contents.size());
+  assert(written == (ssize_t)contents.size());
+  fsync(fd);
+  close(fd);
+  int res = rename(tmp_path.c_str(), map_path.c_str());
+  assert(res == 0);
+
+  int dir_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  assert(dir_fd >= 0);
+  fsync(dir_fd);
+  close(dir_fd);
+}
+
+void single_file_backing_store::append_map_record(const std::string &record) {
+  const char *buf = record.data();
+  uint64_t length = record.size();
+  while (length > 0) {
+    ssize_t written = write(map_fd, buf, length);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      throw std::system_error(written < 0 ? errno : EIO, std::generic_category(), "write " SINGLE_FILE_MAP_NAME);
+    buf += written;
+    length -= written;
+  }
+}
+
+//first-fit allocation from the free list.  If nothing fits, the
+//extent is carved from the end of the file, which is preallocated in
+//SINGLE_FILE_PREALLOCATE_SIZE chunks.
+uint64_t single_file_backing_store::allocate_extent(uint64_t length) {
+  for (auto it = free_extents.begin(); it != free_extents.end(); ++it) {
+    if (it->second >= length) {
+      uint64_t offset = it->first;
+      uint64_t remaining = it->second - length;
+      free_extents.erase(it);
+      if (remaining > 0)
+        free_extents[offset + length] = remaining;
+      return offset;
+    }
+  }
+
+  uint64_t offset = file_end;
+  file_end += length;
+  if (file_end > file_capacity) {
+    uint64_t new_capacity = file_capacity;
+    while (new_capacity < file_end)
+      new_capacity += SINGLE_FILE_PREALLOCATE_SIZE;
+    int res = posix_fallocate(data_fd, file_capacity, new_capacity - file_capacity);
+    assert(res == 0);
+    file_capacity = new_capacity;
+  }
+  return offset;
+}
+
+//return an extent to the free list, merging it with its neighbours.
+void single_file_backing_store::free_extent(uint64_t offset, uint64_t length) {
+  auto next = free_extents.lower_bound(offset);
+  if (next != free_extents.end() && offset + length == next->first) {
+    length += next->second;
+    next = free_extents.erase(next);
+  }
+  if (next != free_extents.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += length;
+      return;
+    }
+  }
+  free_extents[offset] = length;
+}
+
+//register a new version.  No space is taken until the version is
+//written by put(), since only then is its size known.
+void single_file_backing_store::allocate(uint64_t obj_id, uint64_t version) {
+  extent e;
+  e.offset = 0;
+  e.length = 0;
+  e.is_written = false;
+  assert(extents.count(std::make_pair(obj_id, version)) == 0);
+  extents[std::make_pair(obj_id, version)] = e;
+}
+
+//put the extent of a version on the free list
+void single_file_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
+  auto it = extents.find(std::make_pair(obj_id, version));
+  assert(it != extents.end());
+  if (it->second.is_written) {
+    free_extent(it->second.offset, round_up_to_block(it->second.length));
+    live_bytes -= it->second.length;
+    append_map_record("free " + std::to_string(obj_id) + " " + std::to_string(version) + "\n");
+  }
+  extents.erase(it);
+}
+
+//create the stream for a version, without reading anything yet.
+extent_stream * single_file_backing_store::new_stream(uint64_t obj_id, uint64_t version, extent *&e) {
+  auto it = extents.find(std::make_pair(obj_id, version));
+  assert(it != extents.end());
+  e = &it->second;
+  return new extent_stream(obj_id, version);
+}
+
+//return a stream over a version.  Written versions are read in full.
+std::iostream * single_file_backing_store::get(uint64_t obj_id, uint64_t version) {
+  extent *e;
+  extent_stream *ios = new_stream(obj_id, version, e);
+  if (e->is_written) {
+    std::string buffer(e->length, '\0');
+    try {
+      pread_fully(data_fd, &buffer[0], buffer.size(), e->offset, "pread " SINGLE_FILE_DATA_NAME);
+    } catch (...) {
+      delete ios;
+      throw;
+    }
+    ios->str(buffer);
+  }
+  ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
+  assert(ios->good());
+
+  return ios;
+}
+
+void single_file_backing_store::put(std::iostream *ios)
+{
+  std::vector<std::iostream *> batch(1, ios);
+  put_batch(batch);
+}
+
+//write every freshly allocated version in the batch to its own extent
+//and record it in the map.  Streams over versions that were already
+//written are only released.
+void single_file_backing_store::put_batch(std::vector<std::iostream *> &batch)
+{
+  std::vector<extent_write> writes;
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    extent_stream *es = static_cast<extent_stream *>(*it);
+    auto e = extents.find(std::make_pair(es->obj_id, es->version));
+    assert(e != extents.end());
+    if (!e->second.is_written) {
+      extent_write w;
+      w.stream = es;
+      w.buffer = es->str();
+      w.offset = allocate_extent(round_up_to_block(w.buffer.size()));
+      writes.push_back(w);
+    }
+  }
+
+  //on failure nothing was recorded: hand the extents back and release
+  //the batch before passing the error on
+  if (!writes.empty()) {
+    try {
+      write_extents(writes);
+    } catch (...) {
+      for (auto it = writes.begin(); it != writes.end(); ++it)
+        free_extent(it->offset, round_up_to_block(it->buffer.size()));
+      for (auto it = batch.begin(); it != batch.end(); ++it)
+        delete static_cast<extent_stream *>(*it);
+      throw;
+    }
+  }
+
+  for (auto it = writes.begin(); it != writes.end(); ++it) {
+    extent &e = extents[std::make_pair(it->stream->obj_id, it->stream->version)];
+    e.offset = it->offset;
+    e.length = it->buffer.size();
+    e.is_written = true;
+    live_bytes += e.length;
+    append_map_record("alloc " + std::to_string(it->stream->obj_id) + " " + std::to_string(it->stream->version) + " "
+                      + std::to_string(e.offset) + " " + std::to_string(e.length) + "\n");
+  }
+
+  for (auto it = batch.begin(); it != batch.end(); ++it)
+    delete static_cast<extent_stream *>(*it);
+}
+
+void single_file_backing_store::write_extents(std::vector<extent_write> &writes) {
+  for (auto it = writes.begin(); it != writes.end(); ++it) {
+    pwrite_fully(data_fd, it->buffer.data(), it->buffer.size(), it->offset, "pwrite " SINGLE_FILE_DATA_NAME);
+  }
+}
+
+void single_file_backing_store::sync(void) {
+  if (fdatasync(data_fd) != 0)
+    throw std::system_error(errno, std::generic_category(), "fdatasync " SINGLE_FILE_DATA_NAME);
+  if (fdatasync(map_fd) != 0)
+    throw std::system_error(errno, std::generic_category(), "fdatasync " SINGLE_FILE_MAP_NAME);
+}
+
+uint64_t single_file_backing_store::get_version_bytes(uint64_t obj_id, uint64_t version) {
+  auto it = extents.find(std::make_pair(obj_id, version));
+  if (it == extents.end() || !it->second.is_written)
+    return 0;
+  return it->second.length;
+}
+
+//all versions live in the same file
+std::string single_file_backing_store::get_filename(uint64_t obj_id, uint64_t version) {
+  return root + "/" + SINGLE_FILE_DATA_NAME;
+}
+
+//free every version the checkpoint does not list, e.g. the versions
+//written after it by a run that crashed.  The free records are synced
+//before any of the space can be handed out again.
+void single_file_backing_store::retain_only(const std::set<std::pair<uint64_t, uint64_t>> &versions) {
+  std::vector<std::pair<uint64_t, uint64_t>> dropped;
+  for (auto it = extents.begin(); it != extents.end(); ++it)
+    if (versions.count(it->first) == 0)
+      dropped.push_back(it->first);
+  for (auto it = dropped.begin(); it != dropped.end(); ++it)
+    deallocate(it->first, it->second);
+  for (auto it = versions.begin(); it != versions.end(); ++it)
+    assert(extents.count(*it) > 0 && extents[*it].is_written);
+  if (fdatasync(map_fd) != 0)
+    throw std::system_error(errno, std::generic_category(), "fdatasync " SINGLE_FILE_MAP_NAME);
+}
+
+
+////////////////////////////////////////////
+// I/O engines used by async_backing_store //
+////////////////////////////////////////////
+
+// Minimal io_uring ring driven through the raw syscalls.  The calling
+// thread fills and submits SQEs; a reaper thread waits for CQEs and
+// runs the completion callbacks.  user_data 0 is the shutdown marker.
+class io_uring_engine : public io_engine {
+public:
+  io_uring_engine(void) {}
+
+  bool setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, ASYNC_IO_QUEUE_DEPTH, &params);
+    if (ring_fd < 0)
+      return false;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED || !supports_ops()) {
+      unmap();
+      close(ring_fd);
+      ring_fd = -1;
+      return false;
+    }
+
+    char *sq = (char *)sq_ptr;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ptr;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    queue_depth = params.sq_entries;
+
+    reaper = std::thread(&io_uring_engine::reap, this);
+    return true;
+  }
+
+  ~io_uring_engine(void) {
+    if (ring_fd < 0)
+      return;
+    std::vector<io_request *> stop(1, (io_request *)NULL);
+    submit(stop);
+    reaper.join();
+    unmap();
+    close(ring_fd);
+  }
+
+  //queue every request and enter the kernel once (more often only if
+  //the batch is larger than the ring).
+  void submit(std::vector<io_request *> &batch) {
+    std::unique_lock<std::mutex> lock(mtx);
+    unsigned queued = 0;
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+      if (in_flight + queued == queue_depth) {
+        enter(queued);
+        queued = 0;
+        room.wait(lock, [this] { return in_flight < queue_depth; });
+      }
+      unsigned tail = *sq_tail;
+      unsigned index = tail & sq_mask;
+      struct io_uring_sqe *sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      io_request *req = *it;
+      if (req == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = 0;
+      } else {
+        sqe->fd = req->fd;
+        sqe->user_data = (uint64_t)req;
+        if (req->opcode == ASYNC_IO_FSYNC) {
+          sqe->opcode = IORING_OP_FSYNC;
+          sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else {
+          sqe->opcode = req->opcode == ASYNC_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+          sqe->addr = (uint64_t)req->buf;
+          sqe->len = req->length;
+          sqe->off = req->offset;
+        }
+      }
+      sq_array[index] = index;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      queued++;
+    }
+    enter(queued);
+  }
+
+private:
+  //kernels from 5.1 to 5.5 set up a ring but have no READ and WRITE
+  //opcodes.  Those kernels have no probe either, so a failed probe
+  //means they are missing too.
+  bool supports_ops(void) {
+    const unsigned ops_len = 256;
+    std::vector<char> space(sizeof(struct io_uring_probe) + ops_len * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)&space[0];
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops_len) < 0)
+      return false;
+    unsigned needed[] = { IORING_OP_NOP, IORING_OP_FSYNC, IORING_OP_READ, IORING_OP_WRITE };
+    for (unsigned op : needed)
+      if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    return true;
+  }
+
+  void unmap(void) {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED)
+      munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED)
+      munmap(sq_ptr, sq_size);
+  }
+
+  // requires mtx
+  void enter(unsigned count) {
+    if (count == 0)
+      return;
+    in_flight += count;
+    while (count > 0) {
+      int ret = syscall(__NR_io_uring_enter, ring_fd, count, 0, 0, NULL, 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      assert(ret > 0);
+      count -= ret;
+    }
+  }
+
+  void reap(void) {
+    bool stopping = false;
+    while (!stopping) {
+      int ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      assert(ret >= 0 || errno == EINTR);
+      unsigned head = *cq_head;
+      unsigned completed = 0;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+        io_request *req = (io_request *)cqe->user_data;
+        int64_t res = cqe->res;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        completed++;
+        if (req == NULL) {
+          stopping = true;
+          continue;
+        }
+        req->on_complete(res);
+        delete req;
+      }
+      if (completed > 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_flight -= completed;
+        room.notify_all();
+      }
+    }
+  }
+
+  int ring_fd = -1;
+  void *sq_ptr = MAP_FAILED;
+  void *cq_ptr = MAP_FAILED;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  size_t sqes_size = 0;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+  struct io_uring_cqe *cqes;
+  unsigned queue_depth = 0;
+  unsigned in_flight = 0;
+
+  std::mutex mtx;
+  std::condition_variable room;
+  std::thread reaper;
+};
+
+// Fallback for kernels without io_uring: a fixed pool of threads
+// doing the syscalls.
+class thread_pool_engine : public io_engine {
+public:
+  thread_pool_engine(void) {
+    for (int i = 0; i < ASYNC_IO_THREADS; i++)
+      workers.push_back(std::thread(&thread_pool_engine::work, this));
+  }
+
+  ~thread_pool_engine(void) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto it = workers.begin(); it != workers.end(); ++it)
+      it->join();
+  }
+
+  void submit(std::vector<io_request *> &batch) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      queue.insert(queue.end(), batch.begin(), batch.end());
+    }
+    ready.notify_all();
+  }
+
+private:
+  void work(void) {
+    while (true) {
+      io_request *req;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        ready.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+          return;
+        req = queue.front();
+        queue.pop_front();
+      }
+      int64_t res;
+      if (req->opcode == ASYNC_IO_READ)
+        res = pread(req->fd, req->buf, req->length, req->offset);
+      else if (req->opcode == ASYNC_IO_WRITE)
+        res = pwrite(req->fd, req->buf, req->length, req->offset);
+      else
+        res = fdatasync(req->fd);
+      //report errors the way io_uring does
+      if (res < 0)
+        res = -errno;
+      req->on_complete(res);
+      delete req;
+    }
+  }
+
+  std::mutex mtx;
+  std::condition_variable ready;
+  std::deque<io_request *> queue;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+};
+
+///////////////////////////////////////////////
+// Implementation of the async_backing_store //
+///////////////////////////////////////////////
+
+//the error for a completion that returned res: -errno, or a short
+//count, which is reported as EIO.
+static std::system_error io_error(int64_t res, const char *what) {
+  return std::system_error(res < 0 ? (int)-res : EIO, std::generic_category(), what);
+}
+
+async_backing_store::async_backing_store(std::string rt, bool try_io_uring)
+  : single_file_backing_store(rt),
+    engine(NULL),
+    using_io_uring(false)
+{
+  if (try_io_uring) {
+    io_uring_engine *ring = new io_uring_engine();
+    if (ring->setup()) {
+      engine = ring;
+      using_io_uring = true;
+    } else {
+      delete ring;
+    }
+  }
+  if (engine == NULL)
+    engine = new thread_pool_engine();
+}
+
+async_backing_store::~async_backing_store(void) {
+  delete engine;
+}
+
+std::iostream * async_backing_store::get(uint64_t obj_id, uint64_t version) {
+  return get_async(obj_id, version).get();
+}
+
+//queue the read of a version.  The future becomes ready once the
+//engine has filled the stream.
+std::future<std::iostream *> async_backing_store::get_async(uint64_t obj_id, uint64_t version) {
+  extent *e;
+  extent_stream *ios = new_stream(obj_id, version, e);
+  ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
+
+  std::shared_ptr<std::promise<std::iostream *>> result = std::make_shared<std::promise<std::iostream *>>();
+  std::future<std::iostream *> future = result->get_future();
+  if (!e->is_written) {
+    result->set_value(ios);
+    return future;
+  }
+
+  std::shared_ptr<std::string> buffer = std::make_shared<std::string>(e->length, '\0');
+  io_request *req = new io_request;
+  req->opcode = ASYNC_IO_READ;
+  req->fd = data_fd;
+  req->buf = &(*buffer)[0];
+  req->length = e->length;
+  req->offset = e->offset;
+  req->on_complete = [ios, buffer, result](int64_t res) {
+    if (res != (int64_t)buffer->size()) {
+      delete ios;
+      result->set_exception(std::make_exception_ptr(io_error(res, "async read")));
+      return;
+    }
+    ios->str(*buffer);
+    result->set_value(ios);
+  };
+  std::vector<io_request *> batch(1, req);
+  engine->submit(batch);
+  return future;
+}
+
+//submit all writes as one batch and wait for them.
+void async_backing_store::write_extents(std::vector<extent_write> &writes) {
+  std::vector<std::future<int64_t>> done;
+  std::vector<io_request *> batch;
+  for (auto it = writes.begin(); it != writes.end(); ++it) {
+    std::shared_ptr<std::promise<int64_t>> result = std::make_shared<std::promise<int64_t>>();
+    done.push_back(result->get_future());
+    io_request *req = new io_request;
+    req->opcode = ASYNC_IO_WRITE;
+    req->fd = data_fd;
+    req->buf = &it->buffer[0];
+    req->length = it->buffer.size();
+    req->offset = it->offset;
+    req->on_complete = [result](int64_t res) { result->set_value(res); };
+    batch.push_back(req);
+  }
+  engine->submit(batch);
+  //wait for every write before reporting any of them
+  int64_t failed = 0;
+  for (size_t i = 0; i < done.size(); i++) {
+    int64_t written = done[i].get();
+    if (written != (int64_t)writes[i].buffer.size() && failed == 0)
+      failed = written < 0 ? written : -EIO;
+  }
+  if (failed != 0)
+    throw io_error(failed, "async write");
+}
+
+//sync the data file and the map through the engine.
+void async_backing_store::sync(void) {
+  std::vector<std::future<int64_t>> done;
+  std::vector<io_request *> batch;
+  int fds[] = { data_fd, map_fd };
+  for (int fd : fds) {
+    std::shared_ptr<std::promise<int64_t>> synced = std::make_shared<std::promise<int64_t>>();
+    done.push_back(synced->get_future());
+    io_request *req = new io_request;
+    req->opcode = ASYNC_IO_FSYNC;
+    req->fd = fd;
+    req->buf = NULL;
+    req->length = 0;
+    req->offset = 0;
+    req->on_complete = [synced](int64_t res) { synced->set_value(res); };
+    batch.push_back(req);
+  }
+  engine->submit(batch);
+  int64_t failed = 0;
+  for (size_t i = 0; i < done.size(); i++) {
+    int64_t res = done[i].get();
+    if (res != 0 && failed == 0)
+      failed = res;
+  }
+  if (failed != 0)
+    throw io_error(failed, "async sync");
+}
@@ -8,6 +8,17 @@
 #include <cstddef>
 #include <iostream>
 #include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 
 class backing_store {
 public:
@@ -16,6 +27,32 @@ public:
   virtual std::iostream * get(uint64_t obj_id, uint64_t version) = 0;
   virtual void            put(std::iostream *ios) = 0;
   virtual std::string get_filename(uint64_t obj_id, uint64_t version) = 0;
+
+  // put() does not make a version durable, sync() makes every version
+  // put so far durable.  swap_space syncs once per checkpoint.  A
+  // failed sync throws std::system_error.
+  virtual void sync(void) = 0;
+  // Drop every version that is not in versions.  Recovery uses this
+  // to return the store to the checkpoint that listed versions.
+  virtual void retain_only(const std::set<std::pair<uint64_t, uint64_t>> &versions) = 0;
+
+  // Space accounting: the bytes one version takes, and the bytes the
+  // store takes on disk, dead space included.
+  virtual uint64_t get_version_bytes(uint64_t obj_id, uint64_t version) = 0;
+  virtual uint64_t get_disk_bytes(void) = 0;
+
+  // Asynchronous interface.  get_async() starts reading a version and
+  // returns a future for the stream get() would have returned.
+  // put_batch() puts several streams at once, so a store can submit
+  // the writes together and sync once.  The defaults below simply
+  // call get() and put().  reads_asynchronously() tells whether
+  // get_async() returns before the read is done; if not, starting a
+  // read early only moves the wait.
+  virtual std::future<std::iostream *> get_async(uint64_t obj_id, uint64_t version);
+  virtual void put_batch(std::vector<std::iostream *> &batch);
+  virtual bool reads_asynchronously(void) { return false; }
+
+  virtual ~backing_store(void) {};
 };
 
 class one_file_per_object_backing_store: public backing_store {
@@ -26,9 +63,147 @@ public:
   std::iostream * get(uint64_t obj_id, uint64_t version);
   void            put(std::iostream *ios);
   std::string get_filename(uint64_t obj_id, uint64_t version);
-  
+  void sync(void);
+  void retain_only(const std::set<std::pair<uint64_t, uint64_t>> &versions);
+  uint64_t get_version_bytes(uint64_t obj_id, uint64_t version);
+  uint64_t get_disk_bytes(void);
+
 private:
   std::string	root;
+
+  // files written since the last sync()
+  std::vector<std::string> unsynced;
+};
+
+// Keeps every object version in a single preallocated data file
+// (root/store.dat).  Space is handed out in block-aligned extents by
+// an in-memory allocator, and deallocated extents go onto a free list
+// where they are coalesced and reused.  The allocation map is
+// persisted as an append-only journal (root/store.map) of
+// "alloc id version offset length" and "free id version" records,
+// which is replayed when the store is opened.  Neither file is synced
+// until sync(), so after a crash the journal may end in a torn record,
+// which is ignored.
+//
+// Versions are write-once: the first put() after allocate() writes
+// the version, every later get()/put() pair on it is a read.
+#define SINGLE_FILE_DATA_NAME "store.dat"
+#define SINGLE_FILE_MAP_NAME "store.map"
+#define SINGLE_FILE_BLOCK_SIZE (512ULL)
+#define SINGLE_FILE_PREALLOCATE_SIZE (16ULL << 20)
+
+class extent_stream;
+
+class single_file_backing_store: public backing_store {
+public:
+  single_file_backing_store(std::string rt);
+  ~single_file_backing_store(void);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  void put_batch(std::vector<std::iostream *> &batch);
+  std::string get_filename(uint64_t obj_id, uint64_t version);
+  void sync(void);
+  void retain_only(const std::set<std::pair<uint64_t, uint64_t>> &versions);
+  uint64_t get_version_bytes(uint64_t obj_id, uint64_t version);
+  // the extents handed out, free ones between them included; the data
+  // file is preallocated beyond them
+  uint64_t get_disk_bytes(void) { return file_end; }
+
+  uint64_t get_live_bytes(void) const { return live_bytes; }
+  uint64_t get_file_size(void) const { return file_capacity; }
+
+protected:
+  class extent {
+  public:
+    uint64_t offset;
+    uint64_t length;
+    bool is_written;
+  };
+
+  // A version waiting to be written by put_batch()
+  class extent_write {
+  public:
+    extent_stream *stream;
+    std::string buffer;
+    uint64_t offset;
+  };
+
+  // Write every buffer at its offset.  Overridden by stores that do
+  // the I/O asynchronously.
+  virtual void write_extents(std::vector<extent_write> &writes);
+
+  void open_store(void);
+  void close_store(void);
+  void replay_map(void);
+  void append_map_record(const std::string &record);
+  uint64_t allocate_extent(uint64_t length);
+  void free_extent(uint64_t offset, uint64_t length);
+  extent_stream *new_stream(uint64_t obj_id, uint64_t version, extent *&e);
+
+  std::string root;
+  int data_fd = -1;
+  int map_fd = -1;
+  uint64_t file_end = 0;      // end of the highest extent ever handed out
+  uint64_t file_capacity = 0; // preallocated size of the data file
+  uint64_t live_bytes = 0;
+
+  // (obj_id, version) -> extent
+  std::map<std::pair<uint64_t, uint64_t>, extent> extents;
+  // free list: offset -> length, adjacent extents are always coalesced
+  std::map<uint64_t, uint64_t> free_extents;
+};
+
+// A single-file store that does its I/O asynchronously.  Reads and
+// writes are handed to an io_engine: an io_uring ring when the kernel
+// supports it, otherwise a small pool of threads doing pread/pwrite.
+// put_batch() submits all of its writes in one go and waits for them,
+// and get_async() returns as soon as the read is queued.  The
+// allocator and the map are still only touched by the calling thread;
+// the engine only ever sees raw reads and writes.
+#define ASYNC_IO_QUEUE_DEPTH (256)
+#define ASYNC_IO_THREADS (4)
+
+#define ASYNC_IO_READ (0)
+#define ASYNC_IO_WRITE (1)
+#define ASYNC_IO_FSYNC (2)
+
+class io_request {
+public:
+  int opcode;
+  int fd;
+  char *buf;
+  uint64_t length;
+  uint64_t offset;
+  // called on the engine's thread with the result of the syscall: a
+  // byte count, or -errno on failure
+  std::function<void(int64_t)> on_complete;
+};
+
+class io_engine {
+public:
+  virtual void submit(std::vector<io_request *> &batch) = 0;
+  virtual ~io_engine(void) {};
+};
+
+class async_backing_store: public single_file_backing_store {
+public:
+  async_backing_store(std::string rt, bool try_io_uring = true);
+  ~async_backing_store(void);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  std::future<std::iostream *> get_async(uint64_t obj_id, uint64_t version);
+  bool reads_asynchronously(void) { return true; }
+  void sync(void);
+
+  bool is_using_io_uring(void) const { return using_io_uring; }
+
+protected:
+  void write_extents(std::vector<extent_write> &writes);
+
+private:
+  io_engine *engine;
+  bool using_io_uring;
 };
 
 #endif // BACKING_STORE_HPP
@@ -56,10 +56,41 @@
 // by comparing the checkpoint_counter with checkpoint_granularity.
 // When needed to do checkpoint, call checkpoint().
 // There are three major steps in the checkpoint process.
-// (1) flush all the in memory betree nodes to disk (all node files can be found at DESTINATION_DIRECTORY);
-// (2) record the checkpoint information (lsn  and the checkpoint opcode = 3) in log file;
-// (3) update loggingFileStatus.txt which contains the path of log file, 
-// betree root node name and last checkpoint lsn.
+// (1) write back the dirty betree nodes and sync them; clean nodes and
+// nodes on disk are not touched, and every node stays in memory;
+// (2) record the checkpoint information (lsn  and the checkpoint opcode = 4) in log file;
+// (3) replace the manifest (CHECKPOINT_MANIFEST_FILE), which contains the path
+// of log file, betree root node id, last checkpoint lsn and the version of
+// every node.  Versions a checkpoint refers to are never overwritten and
+// are only freed once a newer manifest is in place.
+
+// Node layout: by default a node keeps its pivots and buffered
+// messages in sorted arrays (sorted_array_map).  Build with
+// -DBETREE_STD_MAP_NODES (make MAP_NODES=1) to use std::map instead.
+// Both layouts serialize identically, so either build can read nodes
+// written by the other.  Node code must not keep an iterator into
+// pivots or elements across an insert or erase on the same map.
+
+// Threads: query() may be called from many threads at once, and
+// concurrently with upsert() and upsert_batch().  Every node has its
+// own reader/writer latch.  A query latches the nodes on its path
+// shared, each before releasing its parent (latch coupling), so it
+// sees every message for its key exactly once even while an upsert
+// moves messages down the same path.  Upserts are serialized by
+// writer_lock, since each of them enters at the root, and latch the
+// nodes they change exclusively, again each child before releasing
+// its parent.  An upsert releases a node while it works below it and
+// latches it again afterwards, so queries get past it into the rest
+// of the tree; it never waits for a node above one it holds.  A node
+// that its parent stops pointing to (one that split, or was merged)
+// keeps its contents until the readers already in it have left.  The
+// tree latch is shared by queries and upserts and held exclusively by
+// whatever reshapes the whole tree or its parameters: checkpoints,
+// bulk loads, recovery, reshaping and epsilon changes.  An upsert logs
+// its record under writer_lock, so log order is timestamp order, but
+// waits for its log group to be committed after releasing it, so
+// writers share fdatasync()s.  Iterators take no latch and must not be
+// used while another thread updates the tree.
 
 #include <map>
 #include <vector>
@@ -68,22 +99,70 @@
 #include <cstdint>
 #include <cmath>
 #include <deque>
-#include <ext/stdio_filebuf.h>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <cerrno>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include "swap_space.hpp"
 #include "backing_store.hpp"
+#include "bloom_filter.hpp"
+#include "workload_predictor.hpp"
+#include "cost_model.hpp"
 
 template<typename Key, typename Value> 
 class betree;
 
-// kosumi log status filename
-#define LOGGING_FILE_STATUS "loggingFileStatus.txt"
+// A reader/writer latch, for the tree and for each node.  C++11 has
+// no std::shared_mutex, so this wraps a pthread rwlock that prefers
+// writers, so a steady stream of readers cannot starve them.  lock()
+// and unlock() make it usable with std::lock_guard;
+// shared_latch_guard holds it shared.
+class rw_latch {
+public:
+  rw_latch(void) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int res = pthread_rwlock_init(&rw, &attr);
+    assert(res == 0);
+    pthread_rwlockattr_destroy(&attr);
+  }
+
+  ~rw_latch(void) {
+    pthread_rwlock_destroy(&rw);
+  }
+
+  void lock(void) { pthread_rwlock_wrlock(&rw); }
+  void unlock(void) { pthread_rwlock_unlock(&rw); }
+  void lock_shared(void) { pthread_rwlock_rdlock(&rw); }
+  void unlock_shared(void) { pthread_rwlock_unlock(&rw); }
+
+private:
+  rw_latch(const rw_latch &);
+  rw_latch & operator=(const rw_latch &);
+
+  pthread_rwlock_t rw;
+};
+
+class shared_latch_guard {
+public:
+  shared_latch_guard(rw_latch &l) : latch(l) { latch.lock_shared(); }
+  ~shared_latch_guard(void) { latch.unlock_shared(); }
+
+private:
+  rw_latch &latch;
+};
 
-// Ang: tmpdir_backup
-#define DESTINATION_BACKUP_DIRECTORY "tmpdir_backup"
-// Ang : swap_space objects serialized data
-#define SWAPSPACE_OBJECTS_FILE "ss_objects.txt"
+// The checkpoint manifest: the log file, the root, the checkpoint lsn
+// and the swap_space objects table, i.e. the version of every node.
+// It is replaced atomically by each checkpoint.
+#define CHECKPOINT_MANIFEST_FILE "checkpoint.manifest"
 
 
 ////////////////// Upserts
@@ -122,15 +201,19 @@ public:
   }
 
   void _serialize(std::iostream &fs, serialization_context &context) const {
-    fs << timestamp << " ";
+    serialize(fs, context, timestamp);
     serialize(fs, context, key);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> timestamp;
+    deserialize(fs, context, timestamp);
     deserialize(fs, context, key);
   }
 
+  uint64_t _footprint(void) const {
+    return sizeof(*this) - sizeof(key) + footprint(key);
+  }
+
   Key key;
   uint64_t timestamp;
 };
@@ -181,15 +264,21 @@ public:
   {}
   
   void _serialize(std::iostream &fs, serialization_context &context) {
-    fs << opcode << " ";
+    serialize(fs, context, (int64_t)opcode);
     serialize(fs, context, val);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> opcode;
+    int64_t opc;
+    deserialize(fs, context, opc);
+    opcode = opc;
     deserialize(fs, context, val);
   }
 
+  uint64_t _footprint(void) const {
+    return sizeof(*this) - sizeof(val) + footprint(val);
+  }
+
   int opcode;
   Value val;
 };
@@ -208,6 +297,15 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
 #define DEFAULT_MIN_FLUSH_SIZE (DEFAULT_MAX_NODE_SIZE / 16ULL)
 
+// The fraction of max_node_size (leaves) and of pivot_upper_bound
+// (internal nodes) that bulk_load() fills, leaving room for later
+// upserts before the nodes split.
+#define DEFAULT_BULK_LOAD_FILL_FACTOR (0.75)
+
+// The number of siblings a range scan prefetches ahead of the child it
+// goes down.
+#define BETREE_SCAN_PREFETCH (2)
+
 template<class Key, class Value>
 class Op {
     MessageKey<Key> key;
@@ -225,6 +323,14 @@ class Op {
         return key.timestamp;
     }
 
+    const MessageKey<Key> & get_key() const {
+        return key;
+    }
+
+    const Message<Value> & get_message() const {
+        return val;
+    }
+
     void _serialize(std::iostream &fs, serialization_context &context) {
         key._serialize(fs, context);
         fs << " -> ";
@@ -247,79 +353,229 @@ class Op {
 };
 
 
-//return filestream corresponding to an item. Needed for deserialization.
-std::iostream * load_log(char* log_file) {
-  __gnu_cxx::stdio_filebuf<char> *fb = new __gnu_cxx::stdio_filebuf<char>;
-  fb->open(log_file, std::fstream::in | std::fstream::out);
+// A group of upserts applied by betree::upsert_batch().  The
+// operations get consecutive timestamps in the order they were added,
+// so a batch behaves exactly like issuing them one at a time.
+template<class Key, class Value>
+class write_batch {
+public:
+  class entry {
+  public:
+    int opcode;
+    Key key;
+    Value val;
+  };
 
-  std::fstream *ios = new std::fstream;
-  ios->std::ios::rdbuf(fb);
-  // ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
-  assert(ios->good());
-  
-  return ios;
-}
+  void insert(const Key &k, const Value &v) { ops.push_back(entry{INSERT, k, v}); }
+  void update(const Key &k, const Value &v) { ops.push_back(entry{UPDATE, k, v}); }
+  void erase(const Key &k) { ops.push_back(entry{DELETE, k, Value()}); }
 
+  uint64_t size(void) const { return ops.size(); }
+  bool empty(void) const { return ops.empty(); }
+  void clear(void) { ops.clear(); }
+
+  std::vector<entry> ops;
+};
+
+
+// Write-ahead log sync policies.  Logs is a group-commit writer: the
+// records of many upserts are buffered in wal and committed together
+// with one write() and, unless the policy is LOG_SYNC_NONE, one
+// fdatasync().  A group is committed
+// - LOG_SYNC_PER_OP: after every upsert (or upsert_batch)
+// - LOG_SYNC_PER_RECORDS: once persistence_granularity records are
+//   buffered
+// - LOG_SYNC_PER_INTERVAL: once the oldest buffered record has waited
+//   sync_interval microseconds.  The check is made when an upsert
+//   finishes; there is no timer thread.
+// - LOG_SYNC_NONE: like LOG_SYNC_PER_RECORDS, but the group is only
+//   written, never synced.
+// A checkpoint always commits the buffered records first.
+//
+// Records can be logged and committed from several threads.  One
+// thread at a time commits: it takes the whole buffered group and
+// writes and syncs it without holding the log's mutex, so other
+// threads keep logging into the next group meanwhile.  A thread that
+// wants to commit while a group is being written waits for it, and
+// then commits whatever was buffered in the meantime, if anything.
+#define LOG_SYNC_NONE (0)
+#define LOG_SYNC_PER_OP (1)
+#define LOG_SYNC_PER_RECORDS (2)
+#define LOG_SYNC_PER_INTERVAL (3)
+
+#define DEFAULT_LOG_FILE "test.logg"
+#define LOG_HEADER "Logs: \n"
 
 template<class Op>
 class Logs: public serializable {
   public:
-    std::vector<Op> wal;
+    std::vector<Op> wal; // records logged but not committed yet
 
-    uint64_t lastPersistLSN; // lastPersistLSN is the lsn of the last time we do persist(flush writing ahead log from memory to disk), this also should be the last lsn in the test.logg file
+    uint64_t lastPersistLSN; // lastPersistLSN is the lsn of the last record committed to the log file
     uint64_t lastCheckpointLSN; // lastCheckpointLSN is the lsn of the last time we do checkpoint
     uint64_t persistence_granularity;
     uint64_t checkpoint_granularity;
     uint64_t log_counter = 1; // count how many times we write a log to wal
     serialization_context context;
-    std::fstream outfile;
     std::string log_file_path; // the path of log file, in this project it is the path of test.logg file
+    int sync_policy;
+    uint64_t sync_interval; // in microseconds, for LOG_SYNC_PER_INTERVAL
 
-    
-        Logs(uint64_t pg , uint64_t cg , char* log_file , serialization_context context): 
+        Logs(uint64_t pg , uint64_t cg , char* log_file , serialization_context context,
+             int sync_policy = LOG_SYNC_PER_RECORDS, uint64_t sync_interval = 0):
             lastPersistLSN(0), 
             lastCheckpointLSN(0),
         persistence_granularity(pg),
         checkpoint_granularity(cg),
-        context(context)
+        context(context),
+        log_file_path(log_file != nullptr ? log_file : DEFAULT_LOG_FILE),
+        sync_policy(sync_policy),
+        sync_interval(sync_interval)
     {
-            if (log_file != nullptr) {
-                auto log_data = load_log(log_file);
-                this->_deserialize(*log_data, context);
-                outfile = std::fstream(log_file, std::ios_base::app);
-                log_file_path = log_file;
-            } else {
-                std::string filename = "test.logg";
-                log_file_path = filename;
-                std::ofstream myfile;
-                myfile.open (filename, std::fstream::app);
-                myfile.close();
-                outfile = std::fstream("test.logg");
-                outfile << "Logs: " << std::endl;
-            }
+            open_log();
         }
-        // Logs() = default;
 
+        ~Logs(void) {
+            persist();
+            close(log_fd);
+        }
 
         void log(Op op) {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (wal.empty())
+                group_start = now_us();
+            logged_time_sum += now_us();
             this->wal.push_back(op);
             log_counter++;
         }
 
+        // append a whole batch of operations as one group
+        void log_batch(const std::vector<Op> &ops) {
+            if (ops.empty())
+                return;
+            std::lock_guard<std::mutex> guard(mutex);
+            uint64_t t = now_us();
+            if (wal.empty())
+                group_start = t;
+            logged_time_sum += t * ops.size();
+            this->wal.insert(this->wal.end(), ops.begin(), ops.end());
+            log_counter += ops.size();
+        }
+
+        // Called once an upsert (or a batch) has been logged.  Commits
+        // the buffered group if the sync policy says so, and returns
+        // whether it did.
+        bool end_of_operation(void) {
+            bool due = false;
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                if (wal.empty())
+                    return false;
+                switch (sync_policy) {
+                case LOG_SYNC_PER_OP:
+                    due = true;
+                    break;
+                case LOG_SYNC_PER_INTERVAL:
+                    due = now_us() - group_start >= sync_interval;
+                    break;
+                default:
+                    due = persistence_granularity > 0 && wal.size() >= persistence_granularity;
+                    break;
+                }
+            }
+            if (due)
+                persist();
+            return due;
+        }
+
+        // Commit the buffered records: serialize them into one buffer,
+        // write it with a single write() and make it durable with a
+        // single fdatasync().  Returns once every record logged before
+        // the call is committed; throws std::system_error if the write
+        // or the sync fails, in which case the group is not committed.
         void persist() {
-            for (auto& op: wal) {
-                auto lsn = op.get_LSN();
-                if (lastPersistLSN < lsn) {
-                    op._serialize(outfile, context);
-                    outfile << std::endl;
-                    lastPersistLSN = lsn;
+            std::unique_lock<std::mutex> guard(mutex);
+            while (committing)
+                committed.wait(guard);
+            if (wal.empty())
+                return;
+            std::vector<Op> ops;
+            ops.swap(wal);
+            uint64_t start = group_start;
+            uint64_t logged = logged_time_sum;
+            logged_time_sum = 0;
+            committing = true;
+            guard.unlock();
+
+            std::stringstream group;
+            for (auto& op: ops) {
+                op._serialize(group, context);
+                group << std::endl;
+            }
+            std::string buffer = group.str();
+            const char *p = buffer.data();
+            size_t left = buffer.size();
+            int error = 0;
+            while (left > 0) {
+                ssize_t written = write(log_fd, p, left);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0) {
+                    error = written < 0 ? errno : EIO;
+                    break;
                 }
+                p += written;
+                left -= written;
+            }
+            uint64_t synced = 0;
+            if (error == 0 && sync_policy != LOG_SYNC_NONE) {
+                uint64_t sync_start = now_us();
+                if (fdatasync(log_fd) != 0)
+                    error = errno;
+                synced = now_us() - sync_start;
             }
-            std::flush(outfile);
-            // Ang : we need to clear the records in wal after flushing them to disk
+
+            uint64_t t = now_us();
+            guard.lock();
+            if (error) {
+                // None of these records is acknowledged: lastPersistLSN
+                // stays where it was and the caller gets the error.
+                committing = false;
+                committed.notify_all();
+                throw std::system_error(error, std::generic_category(), "Logs::persist");
+            }
+            sync_time += synced;
+            commit_latency_sum += t * ops.size() - logged;
+            commit_latency_max = std::max(commit_latency_max, t - start);
+            committed_records += ops.size();
+            group_count++;
+            lastPersistLSN = ops.back().get_LSN();
+            committing = false;
+            committed.notify_all();
+        }
+
+        // Forget every record, e.g. when starting over without a
+        // checkpoint to recover from.
+        void reset(void) {
+            std::unique_lock<std::mutex> guard(mutex);
+            while (committing)
+                committed.wait(guard);
             wal.clear();
+            logged_time_sum = 0;
+            lastPersistLSN = 0;
+            lastCheckpointLSN = 0;
+            int res = ftruncate(log_fd, 0);
+            assert(res == 0);
+            write_header();
         }
 
+        uint64_t get_group_count(void) { return group_count; }
+        uint64_t get_committed_records(void) { return committed_records; }
+        // total and worst time from logging a record to committing it
+        uint64_t get_commit_latency_sum(void) { return commit_latency_sum; }
+        uint64_t get_commit_latency_max(void) { return commit_latency_max; }
+        uint64_t get_sync_time(void) { return sync_time; }
+
   
         // const Op& get_last_checkpoint() {
         //     if (wal.empty()) {
@@ -367,7 +623,55 @@ class Logs: public serializable {
           // deserialize(fs, context, child_size);
         }
 
-    
+  private:
+    int log_fd = -1;
+    // guards wal, lastPersistLSN and the counters below
+    std::mutex mutex;
+    // a group is being written outside mutex
+    bool committing = false;
+    std::condition_variable committed;
+    uint64_t group_start = 0;     // when the oldest record in wal was logged
+    uint64_t logged_time_sum = 0; // sum of the times the records in wal were logged
+    uint64_t group_count = 0;
+    uint64_t committed_records = 0;
+    uint64_t commit_latency_sum = 0;
+    uint64_t commit_latency_max = 0;
+    uint64_t sync_time = 0;
+
+    static uint64_t now_us(void) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void write_header(void) {
+        ssize_t written = write(log_fd, LOG_HEADER, strlen(LOG_HEADER));
+        assert(written == (ssize_t)strlen(LOG_HEADER));
+    }
+
+    // Open the log for appending.  A crash can leave the last group
+    // partly written, so anything after the last complete record is
+    // cut off, and lastPersistLSN is set to the lsn of that record.
+    void open_log(void) {
+        log_fd = open(log_file_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        assert(log_fd >= 0);
+
+        std::ifstream in(log_file_path, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t end = contents.rfind('\n');
+        if (end == std::string::npos || contents.compare(0, strlen(LOG_HEADER), LOG_HEADER) != 0) {
+            int res = ftruncate(log_fd, 0);
+            assert(res == 0);
+            write_header();
+            return;
+        }
+        if (end + 1 < contents.size()) {
+            int res = ftruncate(log_fd, end + 1);
+            assert(res == 0);
+        }
+        if (end + 1 > strlen(LOG_HEADER)) {
+            size_t start = contents.rfind('\n', end - 1) + 1;
+            lastPersistLSN = std::stoull(contents.substr(start, end - start));
+        }
+    }
 };
 
 template<class Key, class Value> class betree {
@@ -380,30 +684,64 @@ private:
   public:
     child_info(void)
       : child(),
-	    child_size(0)
+	    child_size(0),
+      child_pivots(0),
+      message_count(0)
     {}
     
-    child_info(node_pointer child, uint64_t child_size)
+    child_info(node_pointer child, uint64_t child_size, uint64_t child_pivots)
       : child(child),
-	    child_size(child_size)
+	    child_size(child_size),
+      child_pivots(child_pivots),
+      message_count(0)
     {}
 
+    // Record the child's current size.  Loads the child.
+    void update_size(void) {
+      const node_pointer &c = child;
+      child_pivots = c->pivots.size();
+      child_size = child_pivots + c->elements.size();
+    }
+
     void _serialize(std::iostream &fs, serialization_context &context) {
       serialize(fs, context, child);
-      fs << " ";
+      if (!context.is_binary())
+        fs << " ";
       serialize(fs, context, child_size);
+      serialize(fs, context, child_pivots);
     }
 
     void _deserialize(std::iostream &fs, serialization_context &context) {
       deserialize(fs, context, child);
       deserialize(fs, context, child_size);
+      // older images have no pivot count; the size bounds it
+      if (context.version >= 4)
+        deserialize(fs, context, child_pivots);
+      else
+        child_pivots = child_size;
+    }
+
+    uint64_t _footprint(void) const {
+      return sizeof(*this);
     }
     
     node_pointer child;
+    // the child's pivots plus elements, and its pivots, as of the last
+    // time it was flushed into, so the parent can size its children
+    // without loading them
     uint64_t child_size;
+    uint64_t child_pivots;
+    // number of messages buffered in the parent for this child.  Not
+    // serialized; the parent recounts it when it is loaded.
+    uint64_t message_count;
   };
+#ifdef BETREE_STD_MAP_NODES
   typedef typename std::map<Key, child_info> pivot_map;
   typedef typename std::map<MessageKey<Key>, Message<Value> > message_map;
+#else
+  typedef sorted_array_map<Key, child_info> pivot_map;
+  typedef sorted_array_map<MessageKey<Key>, Message<Value> > message_map;
+#endif
     
   class node : public serializable {
   public:
@@ -411,11 +749,34 @@ private:
     // Child pointers
     pivot_map pivots;
     message_map elements;
+    // Covers every key in the elements of an internal node, and maybe
+    // keys that have since been flushed out.  Leaves do not keep one.
+    bloom_filter<Key> filter;
+    // The pivot_upper_bound the node was last balanced under, 0 if not
+    // known.  Its message bound is max_node_size minus this.
+    uint64_t pivot_bound = 0;
+    // see "Threads" at the top of this file; whoever holds it also
+    // holds a pin and a reference on the node
+    mutable rw_latch latch;
 
     bool is_leaf(void) const {
       return pivots.empty();
     }
 
+    // The height above the leaves, the level hint betree gives the
+    // swap_space for this node.  Children get theirs when they are
+    // allocated, so this only looks at the first child's object.
+    uint64_t level(void) const {
+      return is_leaf() ? 0 : pivots.begin()->second.child.get_level() + 1;
+    }
+
+    // The pivot bound the node is held to: that of the subtree it lies
+    // in (see betree::set_subtree_adaptation()), or the tree's if it
+    // spans several.  Its message bound is max_node_size minus this.
+    uint64_t fanout_bound(const betree &bet) const {
+      return bet.pivot_bound_of(*this);
+    }
+
     // Check if a node needs to be split
     bool need_to_split(betree &bet) {
 
@@ -427,7 +788,7 @@ private:
       if (is_leaf()) {
         return elements.size() >= bet.max_node_size;
       } else {
-        return pivots.size() >= bet.pivot_upper_bound;
+        return pivots.size() >= fanout_bound(bet);
       }
     
     }
@@ -487,11 +848,61 @@ private:
       return it == pivots.end() ? elements.end() : get_element_begin(it->first);
     }
 
+    // Recompute the message_count of every child with one pass over
+    // pivots and elements.  Messages below the first pivot belong to
+    // the first child.
+    void recount_messages(void) {
+      auto elt = elements.begin();
+      for (auto it = pivots.begin(); it != pivots.end(); ++it) {
+        auto next_it = next(it);
+        it->second.message_count = 0;
+        while (elt != elements.end() &&
+               (next_it == pivots.end() || elt->first.key < next_it->first)) {
+          it->second.message_count++;
+          ++elt;
+        }
+      }
+    }
+
+    void rebuild_filter(void) {
+      if (is_leaf())
+        return;
+      filter.reset(2 * elements.size());
+      for (auto it = elements.begin(); it != elements.end(); ++it)
+        filter.add(it->first.key);
+    }
+
+    // Rebuild the filter once most of the keys it was built from have
+    // been flushed out of the buffer.
+    void maybe_rebuild_filter(void) {
+      if (filter.get_count() > 2 * elements.size())
+        rebuild_filter();
+    }
+
+    // Every key put into the buffer of an internal node must go
+    // through here first.
+    void add_to_filter(const Key &k) {
+      if (!filter.is_built() || filter.is_full())
+        rebuild_filter();
+      filter.add(k);
+    }
+
+    // Apply a message to our buffer and charge it to its child.
+    void apply_to_buffer(const MessageKey<Key> &mkey, const Message<Value> &elt,
+                         Value &default_value) {
+      uint64_t buffered = elements.size();
+      apply(mkey, elt, default_value);
+      auto it = get_pivot(mkey.key);
+      it->second.message_count = it->second.message_count + elements.size() - buffered;
+    }
+
     // Apply a message to ourself.
     // Ang : apply() actually insert the MessageKey<Key>-Message<Value> pair 
     // into the elements of the corresponding node;
     void apply(const MessageKey<Key> &mkey, const Message<Value> &elt,
 	       Value &default_value) {
+      if (!is_leaf())
+        add_to_filter(mkey.key);
       switch (elt.opcode) {
       case INSERT:
         elements.erase(elements.lower_bound(mkey.range_start()),
@@ -567,6 +978,7 @@ private:
 	      (pivots.size() + elements.size() + num_new_leaves - 1) / num_new_leaves;
 
       pivot_map result;
+      uint64_t new_level = level();
       auto pivot_idx = pivots.begin(); // pivot_idx is an iterator of pivots(pivot_map) of the node to be splited;
       auto elt_idx = elements.begin(); // pivot_idx is an iterator of elements(message_map) of the node to be splited;
       int things_moved = 0;
@@ -574,10 +986,12 @@ private:
         if (pivot_idx == pivots.end() && elt_idx == elements.end())
           break;
         node_pointer new_node = bet.ss->allocate(new node);
+        new_node.set_level(new_level);
         result[pivot_idx != pivots.end() ?
               pivot_idx->first :
               elt_idx->first.key] = child_info(new_node,
                   new_node->elements.size() +
+                  new_node->pivots.size(),
                   new_node->pivots.size());
         while(things_moved < (i+1) * things_per_new_leaf &&
               (pivot_idx != pivots.end() || elt_idx != elements.end())) {
@@ -601,27 +1015,62 @@ private:
         }
       }
       
-      for (auto it = result.begin(); it != result.end(); ++it)
-        it->second.child_size = it->second.child->elements.size() +
-          it->second.child->pivots.size();
+      for (auto it = result.begin(); it != result.end(); ++it) {
+        it->second.child->rebuild_filter();
+        it->second.child->pivot_bound = it->second.child->fanout_bound(bet);
+        it->second.update_size();
+      }
             
       assert(pivot_idx == pivots.end());
       assert(elt_idx == elements.end());
-      pivots.clear();
-      elements.clear();
+      // The node keeps its contents, so that readers that reach it
+      // before its parent points to the new nodes still find them.
+      return result;
+    }
+
+    // Flush msgs into child, or with msgs NULL flush its whole buffer
+    // down, with the latches coupled.  The caller holds this node's
+    // latch exclusively, and holds it again on return, but in between
+    // it is released once the child is latched: messages on their way
+    // down are always behind a latch no reader can pass, and readers
+    // can get into this node while the child is worked on.  This node
+    // is latched again only after the child is released, so a writer
+    // never waits for a node above one it holds.
+    pivot_map flush_child(betree &bet, const node_pointer &child, message_map *msgs) {
+      typename swap_space::pin<node> pinned(&child);
+      const typename swap_space::pin<node> &cpinned = pinned;
+      cpinned->latch.lock();
+      latch.unlock();
+      pivot_map result = msgs ? pinned->flush(bet, *msgs) : pinned->compulsory_flush(bet);
+      cpinned->latch.unlock();
+      latch.lock();
       return result;
     }
 
+    // Called once this node no longer points to np, with this node
+    // latched exclusively: wait for the readers that got into np
+    // before, which hold np's latch.  None can get in afterwards, and
+    // once they are gone the nodes that took np's place can change.
+    static void retire(const node_pointer &np) {
+      typename swap_space::pin<node> pinned(&np);
+      const typename swap_space::pin<node> &cpinned = pinned;
+      cpinned->latch.lock();
+      cpinned->latch.unlock();
+    }
+
     node_pointer merge(betree &bet,
 		       typename pivot_map::iterator begin,
 		       typename pivot_map::iterator end) {
       node_pointer new_node = bet.ss->allocate(new node);
+      new_node.set_level(begin->second.child.get_level());
       for (auto it = begin; it != end; ++it) {
         new_node->elements.insert(it->second.child->elements.begin(),
                 it->second.child->elements.end());
         new_node->pivots.insert(it->second.child->pivots.begin(),
                 it->second.child->pivots.end());
       }
+      new_node->pivot_bound = new_node->fanout_bound(bet);
+      new_node->rebuild_filter();
       return new_node;
     }
 
@@ -649,10 +1098,66 @@ private:
           }
           Key key = beginit->first;
           pivots.erase(beginit, endit);
-          pivots[key] = child_info(merged_node, merged_node->pivots.size() + merged_node->elements.size());
+          pivots[key] = child_info(merged_node, merged_node->pivots.size() + merged_node->elements.size(),
+                                   merged_node->pivots.size());
           beginit = pivots.lower_bound(key);
         }
       }
+      recount_messages();
+    }
+
+    // Bring a node that was balanced under another epsilon to bound,
+    // its current fanout_bound().  Under a larger fanout its internal
+    // children may be underfull, so runs of adjacent ones at the same
+    // level are merged while their pivots fit in 6/10 of the current
+    // bound, about what split leaves, and the merged node in
+    // max_node_size.
+    // Runs are sized from the child_info records, so only the children
+    // that are merged get loaded.  Under a smaller fanout it has too
+    // many pivots, and the flush that called this splits it.
+    void rebalance(betree &bet, uint64_t bound) {
+      bet.rebalanced_nodes++;
+      if (pivots.size() > bound)
+        bet.rebalance_splits++;
+      if (pivot_bound < bound) {
+        uint64_t max_pivots = 6 * bound / 10;
+        uint64_t max_size = bet.max_node_size;
+        auto beginit = pivots.begin();
+        while (beginit != pivots.end()) {
+          uint64_t level = beginit->second.child.get_level();
+          uint64_t total_pivots = 0;
+          uint64_t total_size = 0;
+          auto endit = beginit;
+          while (level > 0 && endit != pivots.end() && endit->second.child.get_level() == level) {
+            uint64_t child_pivots = endit->second.child_pivots;
+            uint64_t child_size = endit->second.child_size;
+            if (total_pivots + child_pivots > max_pivots || total_size + child_size > max_size)
+              break;
+            total_pivots += child_pivots;
+            total_size += child_size;
+            ++endit;
+          }
+          uint64_t n = std::distance(beginit, endit);
+          if (n < 2) {
+            beginit = n == 0 ? std::next(beginit) : endit;
+            continue;
+          }
+          node_pointer merged_node = merge(bet, beginit, endit);
+          std::vector<node_pointer> merged;
+          for (auto it = beginit; it != endit; ++it)
+            merged.push_back(it->second.child);
+          Key key = beginit->first;
+          pivots.erase(beginit, endit);
+          pivots[key] = child_info(merged_node, 0, 0);
+          pivots[key].update_size();
+          for (auto it = merged.begin(); it != merged.end(); ++it)
+            retire(*it);
+          bet.rebalance_merges += n - 1;
+          beginit = std::next(pivots.find(key));
+        }
+        recount_messages();
+      }
+      pivot_bound = bound;
     }
     
     // Receive a collection of new messages and perform recursive
@@ -691,13 +1196,18 @@ private:
       }	
 
       ////////////// Non-leaf
+
+      uint64_t bound = fanout_bound(bet);
+      if (bet.rebalances_lazily && pivot_bound != bound)
+        rebalance(bet, bound);
       
       // Update the key of the first child, if necessary
       Key oldmin = pivots.begin()->first;
       MessageKey<Key> newmin = elts.begin()->first;
       if (newmin < oldmin) {
-        pivots[newmin.key] = pivots[oldmin];
+        child_info first_child = pivots.begin()->second;
         pivots.erase(oldmin);
+        pivots[newmin.key] = first_child;
       }
 
       // If everything is going to a single dirty child, go ahead
@@ -708,25 +1218,32 @@ private:
       auto last_pivot_idx = get_pivot((--elts.end())->first.key);
       if (first_pivot_idx == last_pivot_idx &&
 	      first_pivot_idx->second.child.is_dirty()) { //Ang: first_pivot_idx is an iterator of pivot_map
-      	// There shouldn't be anything in our buffer for this child,
-      	// but lets assert that just to be safe.
-        {
-          auto next_pivot_idx = next(first_pivot_idx);
-          auto elt_start = get_element_begin(first_pivot_idx);
-          auto elt_end = get_element_begin(next_pivot_idx); 
-          // assert(elt_start == elt_end);
-        }
-      	pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts);
+      	// Our buffer can still hold older messages for this child (it
+      	// may have split since they were buffered, or a batch may have
+      	// left them here).  They must not be overtaken by the new
+      	// messages, so send them down together.
+      	message_map merged;
+      	message_map *to_child = &elts;
+      	if (first_pivot_idx->second.message_count > 0) {
+      	  auto elt_start = get_element_begin(first_pivot_idx);
+      	  auto elt_end = get_element_begin(next(first_pivot_idx));
+      	  merged = message_map(elt_start, elt_end);
+      	  merged.insert(elts.begin(), elts.end());
+      	  elements.erase(elt_start, elt_end);
+      	  first_pivot_idx->second.message_count = 0;
+      	  to_child = &merged;
+      	}
+      	pivot_map new_children = flush_child(bet, first_pivot_idx->second.child, to_child);
       	if (!new_children.empty()) {
+      	  node_pointer old_child = first_pivot_idx->second.child;
       	  pivots.erase(first_pivot_idx);
       	  pivots.insert(new_children.begin(), new_children.end());
+      	  retire(old_child);
       	} else {
-          first_pivot_idx->second.child_size =
-          first_pivot_idx->second.child->pivots.size() +
-          first_pivot_idx->second.child->elements.size();
+          first_pivot_idx->second.update_size();
 	      }
 
-        if (pivots.size() > bet.pivot_upper_bound || (elements.size() + pivots.size()) > bet.max_node_size) {
+        if (pivots.size() > bound || (elements.size() + pivots.size()) > bet.max_node_size) {
           result = split(bet);
         }
 
@@ -735,7 +1252,7 @@ private:
         // apply the message in the current node.
         // The apply() function inserts the message in the elements map of the current node.
         for (auto it = elts.begin(); it != elts.end(); ++it)
-          apply(it->first, it->second, bet.default_value);
+          apply_to_buffer(it->first, it->second, bet.default_value);
 
         // Ang : After apply() the message into the current node, 
         // check if the size of the message map of the node is large enough 
@@ -744,39 +1261,37 @@ private:
         // Now flush to out-of-core or clean children as necessary
         // the original while loop condition: elements.size() + pivots.size() >= bet.max_node_size
         // while (elements.size() + pivots.size() >= bet.max_node_size) {
-        while (elements.size() >= bet.message_upper_bound) {
+        while (elements.size() >= bet.max_node_size - bound) {
           // Find the child with the largest set of messages in our buffer
-          unsigned int max_size = 0;
+          uint64_t max_size = 0;
           auto child_pivot = pivots.begin();
-          auto next_pivot = pivots.begin();
           for (auto it = pivots.begin(); it != pivots.end(); ++it) {
-            auto it2 = next(it);
-            auto elt_it = get_element_begin(it); 
-            auto elt_it2 = get_element_begin(it2); 
-            unsigned int dist = distance(elt_it, elt_it2);
-            if (dist > max_size) {
+            if (it->second.message_count > max_size) {
               child_pivot = it;
-              next_pivot = it2;
-              max_size = dist;
+              max_size = it->second.message_count;
             }
           }
+          auto next_pivot = next(child_pivot);
 
           if (!(max_size > bet.min_flush_size ||
           (max_size > bet.min_flush_size/2 &&
           child_pivot->second.child.is_in_memory())))
             break; // We need to split because we have too many pivots
+          // read the child while its messages are copied out
+          child_pivot->second.child.prefetch();
           auto elt_child_it = get_element_begin(child_pivot);
           auto elt_next_it = get_element_begin(next_pivot);
           message_map child_elts(elt_child_it, elt_next_it); // initialize the message map need to be flushed
-          pivot_map new_children = child_pivot->second.child->flush(bet, child_elts); // flush child_elts to the child node
           elements.erase(elt_child_it, elt_next_it); // erase the corresponding messages in the current node elements
+          pivot_map new_children = flush_child(bet, child_pivot->second.child, &child_elts); // flush child_elts to the child node
           if (!new_children.empty()) {  // if the child is split 
+            node_pointer old_child = child_pivot->second.child;
             pivots.erase(child_pivot);
             pivots.insert(new_children.begin(), new_children.end());
+            retire(old_child);
           } else {
-            child_pivot->second.child_size =
-              child_pivot->second.child->pivots.size() +
-              child_pivot->second.child->elements.size();
+            child_pivot->second.message_count = 0;
+            child_pivot->second.update_size();
           }
         }
 
@@ -786,10 +1301,12 @@ private:
         //   result = split(bet);
         // }
 
+        maybe_rebuild_filter();
+
         // the modified split condition, for internal node the split condition is
         // either the pivots size exceeds the upper bound 
         // or the overall size of the node exceeds the max_node_size
-        if (pivots.size() > bet.pivot_upper_bound || (elements.size() + pivots.size()) > bet.max_node_size) {
+        if (pivots.size() > bound || (elements.size() + pivots.size()) > bet.max_node_size) {
           result = split(bet);
         }
 
@@ -875,23 +1392,27 @@ private:
           auto child_pivot = pivots.begin();
           auto next_pivot = pivots.begin();
           for (auto it = pivots.begin(); it != pivots.end(); ++it) {
-            auto it2 = next(it);
-            auto elt_it = get_element_begin(it); 
-            auto elt_it2 = get_element_begin(it2); 
+            if (it->second.message_count == 0)
+              continue;
             child_pivot = it;
-            next_pivot = it2;
+            next_pivot = next(it);
+            child_pivot->second.child.prefetch();
             auto elt_child_it = get_element_begin(child_pivot);
             auto elt_next_it = get_element_begin(next_pivot);
             message_map child_elts(elt_child_it, elt_next_it);
-            pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
             elements.erase(elt_child_it, elt_next_it);
+            pivot_map new_children = flush_child(bet, child_pivot->second.child, &child_elts);
             if (!new_children.empty()) {
+              // continue after the new children
+              Key last_child = (--new_children.end())->first;
+              node_pointer old_child = child_pivot->second.child;
               pivots.erase(child_pivot);
               pivots.insert(new_children.begin(), new_children.end());
+              retire(old_child);
+              it = pivots.find(last_child);
             } else {
-              child_pivot->second.child_size =
-                child_pivot->second.child->pivots.size() +
-                child_pivot->second.child->elements.size();
+              child_pivot->second.message_count = 0;
+              child_pivot->second.update_size();
             }
             
           }
@@ -899,12 +1420,14 @@ private:
         
         }
 
+        maybe_rebuild_filter();
+
         // std::cout << "current node message map size(should be zero after compulsory flush): " << 
         //   elements.size() << std::endl;
         // std::cout << "the pivots size after compulsory flush is: " << pivots.size() << std::endl;
 
         // We have too many pivots to efficiently flush stuff down, so split
-        if (pivots.size() > bet.pivot_upper_bound || (elements.size() + pivots.size()) > bet.max_node_size) {
+        if (pivots.size() > fanout_bound(bet) || (elements.size() + pivots.size()) > bet.max_node_size) {
           result = split(bet);
         }
     //  }
@@ -915,7 +1438,33 @@ private:
       return result;
     }
 
+    // Move the child at it up into this node: flush the child's buffer
+    // down, then put its children in its place.  The first of them
+    // takes over the child's key, so the key ranges stay as they were.
+    // Returns false if the flush split the child instead; the halves
+    // then take its place and nothing is moved up.  The caller holds the
+    // tree latch exclusively.
+    bool absorb_child(betree &bet, typename pivot_map::iterator it) {
+      std::lock_guard<rw_latch> guard(latch);
+      Key key = it->first;
+      node_pointer child = it->second.child;
+      pivot_map new_children = flush_child(bet, child, NULL);
+      bool absorbed = new_children.empty();
+      if (absorbed)
+        new_children = child->pivots;
+      pivots.erase(it);
+      child_info first = new_children.begin()->second;
+      new_children.erase(new_children.begin());
+      new_children[key] = first;
+      pivots.insert(new_children.begin(), new_children.end());
+      retire(child);
+      recount_messages();
+      return absorbed;
+    }
+
+    // The caller holds the tree latch exclusively.
     std::deque<node_pointer> shorten_node(betree &bet) {
+      std::lock_guard<rw_latch> guard(latch);
       // std::cout << "the pivots size of current node (before the shortening process): "
       //   << pivots.size() << std::endl;
 
@@ -934,17 +1483,17 @@ private:
           continue;
         }
 
-        pivot_map new_children = it->second.child->compulsory_flush(bet);
+        pivot_map new_children = flush_child(bet, it->second.child, NULL);
         if (!new_children.empty()) {
+          node_pointer old_child = it->second.child;
           it = pivots.erase(it);
           for (const auto& entry : new_children) {
             it = pivots.insert(it, entry);
             ++it; // Move to the next element
         }
+          retire(old_child);
         } else {
-          it->second.child_size =
-            it->second.child->pivots.size() +
-            it->second.child->elements.size();
+          it->second.update_size();
           ++it;
         }
       }
@@ -960,13 +1509,18 @@ private:
         pivot_map grand_child_pivots = it->second.child->pivots;
         // insert the grand_child_pivots to the root node.
         if (!grand_child_pivots.empty()) {
+          Key last_grand_child = (--grand_child_pivots.end())->first;
+          node_pointer child = it->second.child;
           pivots.erase(it);
           pivots.insert(grand_child_pivots.begin(), grand_child_pivots.end());
+          retire(child);
+          it = pivots.find(last_grand_child);
         }
       }
 
       // std::cout << "the pivots size of root node (after the shortening process): "
       //   << pivots.size() << std::endl;
+      recount_messages();
 
       for (auto it = pivots.begin(); it != pivots.end(); it++) {
         child_node_pointers.push_back(it->second.child);
@@ -979,62 +1533,51 @@ private:
 
     
 
-    Value query(const betree & bet, const Key k) const 
+    // One node of a query for k: append this node's messages for k to
+    // msgs, oldest first, and return true if they settle the query, so
+    // no node below needs to be looked at.  A leaf always does, and an
+    // internal node does if its oldest message for k is an INSERT or a
+    // DELETE, or if no child can hold k.  Otherwise child is set to
+    // the child to look at next.
+    bool query_step(const betree &bet, const Key &k,
+                    std::vector<Message<Value> > &msgs, node_pointer &child) const
     {
       debug(std::cout << "Querying " << this << std::endl);
       if (is_leaf()) {
         auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
         if (it != elements.end() && it->first.key == k) {
           assert(it->second.opcode == INSERT);
-          return it->second.val;
-        } else {
-          throw std::out_of_range("Key does not exist");
+          msgs.push_back(it->second);
         }
+        return true;
       }
 
       ///////////// Non-leaf
 
-      // Return iterator pointing to the first element that goes to
-      // child indicated by it; get_element_begin() return a message_map iterator
-      auto message_iter = get_element_begin(k);
-      Value v = bet.default_value;
-
-      if (message_iter == elements.end() || k < message_iter->first)
-        // If we don't have any messages for this key, just search
-        // further down the tree.
-        v = get_pivot(k)->second.child->query(bet, k);
-      else if (message_iter->second.opcode == UPDATE) {
-        // We have some updates for this key.  Search down the tree.
-        // If it has something, then apply our updates to that.  If it
-        // doesn't have anything, then apply our updates to the
-        // default initial value.
-        try {
-          Value t = get_pivot(k)->second.child->query(bet, k);
-          v = t;
-        } catch (std::out_of_range & e) {}
-      } else if (message_iter->second.opcode == DELETE) {
-        // We have a delete message, so we don't need to look further
-        // down the tree.  If we don't have any further update or
-        // insert messages, then we should return does-not-exist (in
-        // this subtree).
-        message_iter++;
-        if (message_iter == elements.end() || k < message_iter->first)
-          throw std::out_of_range("Key does not exist");
-      } else if (message_iter->second.opcode == INSERT) {
-        // We have an insert message, so we don't need to look further
-        // down the tree.  We'll apply any updates to this value.
-        v = message_iter->second.val;
-        message_iter++;
-      }
-
-      // Apply any updates to the value obtained above.
-      while (message_iter != elements.end() && message_iter->first.key == k) {
-        assert(message_iter->second.opcode == UPDATE);
-        v = v + message_iter->second.val;
-        message_iter++;
+      if (!filter.may_contain(k)) {
+        bet.filter_probes_saved++;
+      } else {
+        auto message_iter = get_element_begin(k);
+        if (message_iter == elements.end() || k < message_iter->first) {
+          // If we don't have any messages for this key, just search
+          // further down the tree.
+          bet.filter_false_positives++;
+        } else {
+          // An INSERT or a DELETE hides everything below, and only
+          // UPDATEs can follow it here.
+          bool settled = message_iter->second.opcode != UPDATE;
+          for (; message_iter != elements.end() && message_iter->first.key == k; ++message_iter)
+            msgs.push_back(message_iter->second);
+          if (settled)
+            return true;
+        }
       }
 
-      return v;
+      // keys smaller than every pivot are in no child
+      if (k < pivots.begin()->first)
+        return true;
+      child = get_pivot(k)->second.child;
+      return false;
     }
 
     std::pair<MessageKey<Key>, Message<Value> >
@@ -1077,18 +1620,49 @@ private:
     
     // kosumi: serialization of "pivots:"
     void _serialize(std::iostream &fs, serialization_context &context) {
-      fs << "pivots:" << std::endl;
+      if (!context.is_binary())
+        fs << "pivots:" << std::endl;
       serialize(fs, context, pivots);
-      fs << "elements:" << std::endl;
+      if (!context.is_binary())
+        fs << "elements:" << std::endl;
       serialize(fs, context, elements);
+      if (!context.is_binary())
+        fs << "filter:" << std::endl;
+      serialize(fs, context, filter);
+      if (!context.is_binary())
+        fs << "bound:" << std::endl;
+      serialize(fs, context, pivot_bound);
     }
     
     void _deserialize(std::iostream &fs, serialization_context &context) {
       std::string dummy;
-      fs >> dummy;
+      if (!context.is_binary())
+        fs >> dummy;
       deserialize(fs, context, pivots);
-      fs >> dummy;
+      if (!context.is_binary())
+        fs >> dummy;
       deserialize(fs, context, elements);
+      if (!context.is_binary())
+        fs >> dummy;
+      deserialize(fs, context, filter);
+      // Nodes written before the bound was recorded get 0, which a
+      // lazy rebalance treats as out of date.  Unmarked text nodes may
+      // or may not have one.
+      pivot_bound = 0;
+      bool has_bound = context.version >= 3;
+      if (!context.is_binary() && context.version == TEXT_FORMAT_UNMARKED_VERSION)
+        has_bound = has_more_text(fs);
+      if (has_bound) {
+        if (!context.is_binary())
+          fs >> dummy;
+        deserialize(fs, context, pivot_bound);
+      }
+      recount_messages();
+    }
+
+    uint64_t _footprint(void) const {
+      return sizeof(*this) - sizeof(pivots) - sizeof(elements) - sizeof(filter) +
+        footprint(pivots) + footprint(elements) + footprint(filter);
     }
 
     
@@ -1109,7 +1683,75 @@ private:
   // 7: fixed mode(epsilon do not adjust to workload);
   // the initial state is write heavy 0
   int state = 0; 
+  // see set_workload_predictor()
+  workload_predictor *predictor = NULL;
+  double write_heavy_epsilon = 0;
+  double read_heavy_epsilon = 0;
+  bool shortens_when_read_heavy = false;
+  // see set_cost_model()
+  epsilon_cost_model *cost_model = NULL;
+  uint64_t shorten_count = 0;
+  uint64_t shorten_time = 0; // in microseconds
+  // the incremental reshaping, see set_reshaping() and reshape_step()
+  uint64_t reshape_steps_per_op = 0;
+  std::atomic<bool> reshape_pending{false};
+  uint64_t reshape_depth = 0;
+  Key reshape_key = Key();
+  bool reshape_at_start = true;
+  bool reshape_deeper = false;
+  uint64_t reshape_passes = 0;
+  uint64_t reshape_steps = 0;
+  uint64_t reshape_absorbed = 0;
+  uint64_t reshape_time = 0; // in microseconds
+  uint64_t reshape_longest = 0; // the longest reshape() call, in microseconds
+  // the totals when the current pass started
+  uint64_t reshape_pass_steps = 0;
+  uint64_t reshape_pass_absorbed = 0;
+  // A key range whose epsilon follows its own workload, see
+  // set_subtree_adaptation().  The counters are updated under the
+  // shared latch, the rest under the exclusive one.
+  class subtree {
+  public:
+    subtree(int policy, int mode, uint64_t window, double epsilon, uint64_t pivot_bound)
+      : predictor(policy, mode, window),
+        epsilon(epsilon),
+        pivot_bound(pivot_bound)
+    {}
+
+    workload_predictor predictor;
+    double epsilon;
+    uint64_t pivot_bound;
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+  };
+  typedef std::map<Key, std::unique_ptr<subtree> > subtree_map;
+  // each subtree under the smallest key it holds
+  subtree_map subtrees;
+  std::atomic<uint64_t> subtree_depth{0};
+  int subtree_policy = WORKLOAD_POLICY_HYSTERESIS;
+  uint64_t subtree_window = DEFAULT_WORKLOAD_WINDOW;
+  double subtree_write_heavy_epsilon = 0;
+  double subtree_read_heavy_epsilon = 0;
+  std::atomic<uint64_t> subtree_operations{0};
+  std::atomic<bool> subtree_mode_changed{false};
+  uint64_t subtree_epsilon_changes = 0;
+  // see set_lazy_rebalancing()
+  bool rebalances_lazily = false;
+  uint64_t rebalanced_nodes = 0;
+  uint64_t rebalance_merges = 0;
+  uint64_t rebalance_splits = 0;
   int split_counter = 0;
+  uint64_t checkpoint_count = 0;
+  uint64_t checkpoint_time = 0; // in microseconds
+  // buffer probes query() skipped, and probes the filters let through
+  // that found nothing
+  mutable std::atomic<uint64_t> filter_probes_saved{0};
+  mutable std::atomic<uint64_t> filter_false_positives{0};
+  // see "Threads" at the top of this file
+  mutable rw_latch latch;
+  std::mutex writer_lock;
+  // guards root against queries reading it while an upsert replaces it
+  std::mutex root_lock;
   
 public:
   // actually the max_node_size, min_flush_size and min_node_size are 
@@ -1158,11 +1800,198 @@ public:
       return split_counter;
     }
 
+    uint64_t get_checkpoint_count(void) {
+      return checkpoint_count;
+    }
+
+    uint64_t get_checkpoint_time(void) {
+      return checkpoint_time;
+    }
+
+    uint64_t get_filter_probes_saved(void) {
+      return filter_probes_saved;
+    }
+
+    uint64_t get_filter_false_positives(void) {
+      return filter_false_positives;
+    }
+
     // Ang: set epsilon and upper bounds
     void set_epsilon(double new_epsilon) {
+      std::lock_guard<rw_latch> guard(latch);
+      apply_epsilon(new_epsilon);
+    }
+
+    // The caller holds the latch exclusively.
+    void apply_epsilon(double new_epsilon) {
+      uint64_t old_bound = pivot_upper_bound;
       epsilon = new_epsilon;
       pivot_upper_bound = pow(static_cast<double>(max_node_size), epsilon);
       message_upper_bound = max_node_size - pivot_upper_bound;
+      if (reshape_steps_per_op > 0 && pivot_upper_bound > old_bound)
+        start_reshape();
+      else if (pivot_upper_bound < old_bound)
+        reshape_pending = false;
+    }
+
+    // Reshape the tree toward a larger fanout a little at a time:
+    // whenever epsilon grows, every upsert and query does steps steps
+    // of a pass that moves grandchildren up into the nodes that have
+    // room for them now (see reshape_step()).  This also replaces the
+    // shortening of set_workload_predictor().  0 turns it off.  A
+    // smaller fanout needs no pass, nodes split as they are flushed.
+    void set_reshaping(uint64_t steps) {
+      std::lock_guard<rw_latch> guard(latch);
+      reshape_steps_per_op = steps;
+      if (steps == 0)
+        reshape_pending = false;
+    }
+
+    // Bring each internal node to a new epsilon only when a flush next
+    // goes through it (see node::rebalance()), so the cost of a change
+    // follows the nodes the workload touches.  Nodes record the bounds
+    // they were balanced under either way.
+    void set_lazy_rebalancing(bool lazy) {
+      std::lock_guard<rw_latch> guard(latch);
+      rebalances_lazily = lazy;
+    }
+
+    uint64_t get_rebalanced_nodes(void) {
+      return rebalanced_nodes;
+    }
+
+    // the children merged away, and the rebalanced nodes that were
+    // overfull and split
+    uint64_t get_rebalance_merges(void) {
+      return rebalance_merges;
+    }
+
+    uint64_t get_rebalance_splits(void) {
+      return rebalance_splits;
+    }
+
+    // Let key ranges pick their own epsilon.  The subtrees are the
+    // nodes depth levels below the root: every upsert and query is
+    // counted against the one that holds its key, each has a
+    // workload_predictor of policy over its own windows of operations,
+    // and a subtree turning write heavy or read heavy takes write_heavy
+    // or read_heavy as its epsilon.  Nodes inside a subtree are held to
+    // its bounds, the nodes above to the tree's.  The subtrees are
+    // found again every window operations, as the tree changes shape.
+    // 0 turns it off.
+    void set_subtree_adaptation(uint64_t depth, int policy, uint64_t window,
+                                double write_heavy, double read_heavy) {
+      std::lock_guard<rw_latch> guard(latch);
+      assert(window > 0);
+      subtree_depth = depth;
+      subtree_policy = policy;
+      subtree_window = window;
+      subtree_write_heavy_epsilon = write_heavy;
+      subtree_read_heavy_epsilon = read_heavy;
+      subtrees.clear();
+      if (depth > 0)
+        refresh_subtrees();
+    }
+
+    class subtree_stats {
+    public:
+      Key start;
+      uint64_t reads;
+      uint64_t writes;
+      double epsilon;
+      uint64_t pivot_bound;
+      uint64_t message_bound;
+      // the level hint of the subtree's root
+      uint64_t height;
+      uint64_t transitions;
+    };
+
+    std::vector<subtree_stats> get_subtree_stats(void) {
+      std::lock_guard<rw_latch> guard(latch);
+      std::vector<subtree_stats> result;
+      for (auto it = subtrees.begin(); it != subtrees.end(); ++it) {
+        subtree_stats st;
+        st.start = it->first;
+        st.reads = it->second->reads;
+        st.writes = it->second->writes;
+        st.epsilon = it->second->epsilon;
+        st.pivot_bound = it->second->pivot_bound;
+        st.message_bound = max_node_size - it->second->pivot_bound;
+        st.height = subtree_height(it->first);
+        st.transitions = it->second->predictor.get_transition_count();
+        result.push_back(st);
+      }
+      return result;
+    }
+
+    uint64_t get_subtree_epsilon_changes(void) {
+      return subtree_epsilon_changes;
+    }
+
+    bool is_reshaping(void) {
+      return reshape_pending;
+    }
+
+    // the levels the pass has yet to visit, by the root's level hint
+    uint64_t get_reshape_levels_left(void) {
+      std::lock_guard<rw_latch> guard(latch);
+      if (!reshape_pending)
+        return 0;
+      uint64_t height = root.get_level();
+      return height > reshape_depth ? height - reshape_depth : 1;
+    }
+
+    uint64_t get_reshape_passes(void) {
+      return reshape_passes;
+    }
+
+    uint64_t get_reshape_steps(void) {
+      return reshape_steps;
+    }
+
+    uint64_t get_reshape_absorbed(void) {
+      return reshape_absorbed;
+    }
+
+    uint64_t get_reshape_time(void) {
+      return reshape_time;
+    }
+
+    uint64_t get_reshape_longest(void) {
+      return reshape_longest;
+    }
+
+    // Adapt epsilon to the workload.  Every upsert and query is
+    // reported to p, which must outlive the tree or be detached with
+    // NULL, and whenever p changes mode the tree takes that state and
+    // write_heavy or read_heavy as its epsilon.  With shorten, turning
+    // read heavy also shortens the tree.  A tree in state 7 (fixed)
+    // should not be given a predictor.
+    void set_workload_predictor(workload_predictor *p, double write_heavy,
+                                double read_heavy, bool shorten) {
+      std::lock_guard<rw_latch> guard(latch);
+      predictor = p;
+      write_heavy_epsilon = write_heavy;
+      read_heavy_epsilon = read_heavy;
+      shortens_when_read_heavy = shorten;
+    }
+
+    // Let m choose epsilon instead: every upsert and query is reported
+    // to m, which must outlive the tree or be detached with NULL, and
+    // at the end of each of its intervals the tree gives it the I/O
+    // swap_space has done and its height, and takes the epsilon it
+    // returns.  Use either a cost model or a workload predictor.
+    void set_cost_model(epsilon_cost_model *m) {
+      std::lock_guard<rw_latch> guard(latch);
+      cost_model = m;
+    }
+
+    uint64_t get_shorten_count(void) {
+      return shorten_count;
+    }
+
+    uint64_t get_shorten_time(void) {
+      return shorten_time;
     }
 
     double get_epsilon(void) {
@@ -1265,13 +2094,23 @@ public:
     }
 
     void shorten_betree(void) {
+      std::lock_guard<rw_latch> guard(latch);
+      shorten_from_root();
+    }
+
+    // The caller holds the latch exclusively.
+    void shorten_from_root(void) {
+      auto start = std::chrono::steady_clock::now();
       std::cout << "******** start shortening betree ********" << std::endl;
 
       std::deque<node_pointer> being_processed_nodes;
       being_processed_nodes.push_back(root);
       shorten_betree(being_processed_nodes);
+      relevel(root);
 
       std::cout << "******** finish shortening betree ********" << std::endl;
+      shorten_count++;
+      shorten_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
     }
 
     void shorten_betree(std::deque<node_pointer>& being_processed_nodes) {
@@ -1298,6 +2137,296 @@ public:
     }
 
 
+    // The caller holds the latch exclusively.
+    void start_reshape(void) {
+      debug(std::cout << "******** start reshaping betree, pivot upper bound: "
+                << pivot_upper_bound << " ********" << std::endl);
+      reshape_pending = true;
+      reshape_depth = 0;
+      reshape_at_start = true;
+      reshape_deeper = false;
+      reshape_passes++;
+      reshape_pass_steps = reshape_steps;
+      reshape_pass_absorbed = reshape_absorbed;
+    }
+
+    // Do up to steps steps of the pass, if one is under way.  The
+    // caller holds the latch exclusively.
+    void reshape(uint64_t steps) {
+      if (!reshape_pending)
+        return;
+      auto start = std::chrono::steady_clock::now();
+      for (uint64_t i = 0; i < steps && reshape_pending; i++) {
+        reshape_step();
+        reshape_steps++;
+      }
+      uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+      reshape_time += t;
+      reshape_longest = std::max(reshape_longest, t);
+    }
+
+    typename subtree_map::const_iterator subtree_of(const Key &k) const {
+      auto it = subtrees.upper_bound(k);
+      return it == subtrees.begin() ? it : std::prev(it);
+    }
+
+    uint64_t pivot_bound_of(const node &n) const {
+      if (subtrees.empty() || n.is_leaf())
+        return pivot_upper_bound;
+      auto first = subtree_of(n.pivots.begin()->first);
+      auto last = subtree_of(std::prev(n.pivots.end())->first);
+      return first == last ? first->second->pivot_bound : pivot_upper_bound;
+    }
+
+    // Count operations on key k against its subtree.  The caller holds
+    // the latch, shared or exclusive.
+    void observe_subtree(const Key &k, uint64_t writes, uint64_t reads) {
+      if (subtree_depth == 0)
+        return;
+      if (!subtrees.empty()) {
+        subtree *st = subtree_of(k)->second.get();
+        st->writes += writes;
+        st->reads += reads;
+        if (st->predictor.observe(writes, reads))
+          subtree_mode_changed = true;
+      }
+      subtree_operations += writes + reads;
+    }
+
+    // Called once an operation released the latch: give the subtrees
+    // that changed mode their new epsilon, and find the subtrees again
+    // at the end of each window.
+    void follow_subtrees(uint64_t operations) {
+      if (subtree_depth == 0)
+        return;
+      uint64_t after = subtree_operations;
+      bool window_ended = (after - operations) / subtree_window != after / subtree_window;
+      if (!subtree_mode_changed && !window_ended)
+        return;
+      std::lock_guard<rw_latch> guard(latch);
+      if (subtree_depth == 0)
+        return;
+      if (subtree_mode_changed.exchange(false)) {
+        for (auto it = subtrees.begin(); it != subtrees.end(); ++it) {
+          subtree *st = it->second.get();
+          double e = st->predictor.get_mode() == WORKLOAD_READ_HEAVY
+            ? subtree_read_heavy_epsilon : subtree_write_heavy_epsilon;
+          if (e == st->epsilon)
+            continue;
+          uint64_t old_bound = st->pivot_bound;
+          st->epsilon = e;
+          st->pivot_bound = pow(static_cast<double>(max_node_size), e);
+          subtree_epsilon_changes++;
+          debug(std::cout << "subtree " << it->first
+                    << ": operation number: " << st->predictor.get_operation_count()
+                    << ", write_ratio: " << st->predictor.get_write_ratio()
+                    << ", epsilon: " << e
+                    << ", pivot upper bound: " << st->pivot_bound << std::endl);
+          if (reshape_steps_per_op > 0 && st->pivot_bound > old_bound && !reshape_pending)
+            start_reshape();
+        }
+      }
+      if (window_ended)
+        refresh_subtrees();
+    }
+
+    // Find the subtrees again: the nodes subtree_depth levels below the
+    // root, or the leaves above that depth.  A subtree that still
+    // starts at the same key keeps its state, a new one starts as the
+    // subtree that held its key.  The caller holds the latch
+    // exclusively.
+    void refresh_subtrees(void) {
+      std::vector<std::pair<Key, node_pointer> > level;
+      const node_pointer &r = root;
+      auto root_pivots = r->pivots;
+      if (root_pivots.empty())
+        return;
+      for (auto it = root_pivots.begin(); it != root_pivots.end(); ++it)
+        level.push_back(std::make_pair(it->first, it->second.child));
+      for (uint64_t d = 1; d < subtree_depth; d++) {
+        std::vector<std::pair<Key, node_pointer> > next;
+        for (auto it = level.begin(); it != level.end(); ++it) {
+          if (it->second.get_level() == 0) {
+            next.push_back(*it);
+            continue;
+          }
+          const node_pointer &np = it->second;
+          auto pivots = np->pivots;
+          for (auto p = pivots.begin(); p != pivots.end(); ++p)
+            // the first child covers the node's whole range from its key
+            next.push_back(std::make_pair(p == pivots.begin() ? it->first : p->first, p->second.child));
+        }
+        level.swap(next);
+      }
+
+      int initial_mode = state == WORKLOAD_READ_HEAVY ? WORKLOAD_READ_HEAVY : WORKLOAD_WRITE_HEAVY;
+      subtree_map fresh;
+      for (auto it = level.begin(); it != level.end(); ++it) {
+        if (subtrees.count(it->first))
+          continue;
+        if (subtrees.empty()) {
+          fresh[it->first].reset(new subtree(subtree_policy, initial_mode, subtree_window,
+                                             epsilon, pivot_upper_bound));
+        } else {
+          subtree *from = subtree_of(it->first)->second.get();
+          fresh[it->first].reset(new subtree(subtree_policy, from->predictor.get_mode(), subtree_window,
+                                             from->epsilon, from->pivot_bound));
+        }
+      }
+      for (auto it = level.begin(); it != level.end(); ++it) {
+        auto old = subtrees.find(it->first);
+        if (old != subtrees.end())
+          fresh[it->first] = std::move(old->second);
+      }
+      subtrees.swap(fresh);
+    }
+
+    // the level hint of the node at subtree_depth that holds k
+    uint64_t subtree_height(const Key &k) {
+      node_pointer np = root;
+      for (uint64_t d = 0; d < subtree_depth && np.get_level() > 0; d++) {
+        typename swap_space::pin<node> pinned(&np);
+        const typename swap_space::pin<node> &cpinned = pinned;
+        const node *n = cpinned.operator->();
+        auto it = k < n->pivots.begin()->first ? n->pivots.begin() : n->get_pivot(k);
+        node_pointer child = it->second.child;
+        np = child;
+      }
+      return np.get_level();
+    }
+
+    // Called by a query once it released the latch.
+    void reshape_after_query(void) {
+      if (!reshape_pending)
+        return;
+      std::lock_guard<rw_latch> guard(latch);
+      reshape(reshape_steps_per_op);
+    }
+
+    // One step of the reshape pass.  The pass visits the internal nodes
+    // a depth at a time, left to right, and a node takes its internal
+    // children's children in their place while its fanout stays within
+    // pivot_upper_bound.  Its cursor is a depth and a key rather than a
+    // node, so the splits between steps cannot leave it behind: each
+    // step walks down to the node at the cursor and looks at its next
+    // internal child.  Between steps the tree is an ordinary Be-tree,
+    // some of it in the old shape and some in the new.
+    void reshape_step(void) {
+      std::vector<node_pointer> path(1, root);
+      bool bounded = false;
+      Key end = Key();
+      while (path.size() <= reshape_depth) {
+        typename swap_space::pin<node> pinned(&path.back());
+        const typename swap_space::pin<node> &cpinned = pinned;
+        const node *n = cpinned.operator->();
+        if (n->is_leaf()) {
+          reshape_next_node(bounded, end);
+          return;
+        }
+        auto it = reshape_at_start || reshape_key < n->pivots.begin()->first
+          ? n->pivots.begin() : n->get_pivot(reshape_key);
+        auto next_it = std::next(it);
+        if (next_it != n->pivots.end()) {
+          bounded = true;
+          end = next_it->first;
+        }
+        // this key range has no node at the cursor's depth
+        if (it->second.child.get_level() == 0) {
+          reshape_next_node(bounded, end);
+          return;
+        }
+        path.push_back(it->second.child);
+      }
+
+      Key key;
+      bool last;
+      {
+        typename swap_space::pin<node> pinned(&path.back());
+        const typename swap_space::pin<node> &cpinned = pinned;
+        const node *n = cpinned.operator->();
+        if (n->is_leaf()) {
+          reshape_next_node(bounded, end);
+          return;
+        }
+        auto it = reshape_at_start ? n->pivots.begin() : n->pivots.lower_bound(reshape_key);
+        while (it != n->pivots.end() && it->second.child.get_level() == 0)
+          ++it;
+        if (it == n->pivots.end()) {
+          reshape_next_node(bounded, end);
+          return;
+        }
+        reshape_deeper = true;
+        key = it->first;
+        auto next_it = std::next(it);
+        last = next_it == n->pivots.end();
+        if (!last) {
+          reshape_key = next_it->first;
+          reshape_at_start = false;
+        }
+        const node_pointer &child = it->second.child;
+        if (n->pivots.size() - 1 + child->pivots.size() > n->fanout_bound(*this)) {
+          if (last)
+            reshape_next_node(bounded, end);
+          return;
+        }
+      }
+
+      typename swap_space::pin<node> pinned(&path.back());
+      node *n = pinned.operator->();
+      if (n->absorb_child(*this, n->pivots.find(key))) {
+        reshape_absorbed++;
+        if (last)
+          reshape_next_node(bounded, end);
+      } else {
+        // look at the halves of the child next
+        reshape_key = key;
+        reshape_at_start = false;
+      }
+      for (auto p = path.rbegin(); p != path.rend(); ++p) {
+        const node_pointer &np = *p;
+        np.set_level(np->level());
+      }
+    }
+
+    // Move the reshape cursor past the node it is in: to the next node
+    // at the same depth, which starts at end, or to the next depth.
+    void reshape_next_node(bool bounded, const Key &end) {
+      if (bounded) {
+        reshape_key = end;
+        reshape_at_start = false;
+        return;
+      }
+      if (!reshape_deeper) {
+        reshape_pending = false;
+        // the step that ends the pass is not counted yet
+        debug(std::cout << "******** finish reshaping betree: " << reshape_steps + 1 - reshape_pass_steps
+                  << " steps, " << reshape_absorbed - reshape_pass_absorbed
+                  << " children absorbed ********" << std::endl);
+        return;
+      }
+      reshape_depth++;
+      reshape_at_start = true;
+      reshape_deeper = false;
+      debug(std::cout << "reshaping betree: depth " << reshape_depth
+                << ", children absorbed: " << reshape_absorbed - reshape_pass_absorbed
+                << ", levels left: " << std::max<int64_t>(1, (int64_t)root.get_level() - (int64_t)reshape_depth)
+                << std::endl);
+    }
+
+    // Recompute the level hints of np's subtree after the tree was
+    // reshaped and return np's.  A node below the root whose hint is 0
+    // is a leaf and is not read.
+    uint64_t relevel(const node_pointer &np) {
+      if (np != root && np.get_level() == 0)
+        return 0;
+      uint64_t level = 0;
+      auto pivots = np->pivots;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+        level = std::max(level, relevel(it->second.child) + 1);
+      np.set_level(level);
+      return level;
+    }
+
     void traverse_betree(std::deque<node_pointer>& being_traversed_nodes, 
       int current_height, int& leaves_num, int& total_leaves_height) {
 
@@ -1355,168 +2484,103 @@ public:
         return (stat(filePath.c_str(), &buffer) == 0);
     }
 
-    // Ang :Function to copy a file
-    bool copyFile(const std::string& sourcePath, const std::string& destinationPath) {
-      std::ifstream sourceFile(sourcePath, std::ios::binary);
-      std::ofstream destinationFile(destinationPath, std::ios::binary);
 
-      if (!sourceFile || !destinationFile) {
-          return false; // Error in opening source or destination file
-      }
-
-      destinationFile << sourceFile.rdbuf();
-      return true;
-    }
-
-    bool directoryExist(const std::string& path) {
-      struct stat info;
-      return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR);
-    }
-
-    bool createDirectory(const std::string& path) {
-      #ifdef _WIN32
-          // Windows-specific code
-          return _mkdir(path.c_str()) == 0;
-      #else
-          // Unix-like system code
-          return mkdir(path.c_str(), 0777) == 0;
-      #endif
-    }
-
-    // Ang: Function to copy all files from a source directory to a destination directory
-    bool copyFilesInDirectory(const std::string& sourceDir, const std::string& destDir) {
-      DIR* dir = opendir(sourceDir.c_str());
-
-      if (dir == nullptr) {
-          return false; // Unable to open the source directory
+    // Write the manifest of the checkpoint that was just taken.
+    // It is written to a temporary file, synced and renamed over the old
+    // one, so a crash leaves either the old or the new manifest.  Throws
+    // std::system_error if any step fails; a failure before the rename
+    // leaves the old manifest in place.
+    void writeManifest(std::string manifestPath) {
+      std::stringstream manifest;
+      manifest << "log_file_path " << logs.log_file_path << std::endl;
+      manifest << "betree_root_id " << get_betree_root_id() << std::endl;
+      manifest << "persist_lsn " << logs.lastPersistLSN << std::endl;
+      manifest << "checkpoint_lsn " << logs.lastCheckpointLSN << std::endl;
+      ss->serialize_objects(manifest);
+
+      std::string contents = manifest.str();
+      std::string tmpPath = manifestPath + ".tmp";
+      int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open " + tmpPath);
+      const char *p = contents.data();
+      size_t left = contents.size();
+      int error = 0;
+      while (left > 0) {
+        ssize_t written = write(fd, p, left);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0) {
+          error = written < 0 ? errno : EIO;
+          break;
+        }
+        p += written;
+        left -= written;
       }
-
-      struct dirent* entry;
-
-      while ((entry = readdir(dir)) != nullptr) {
-          if (entry->d_type == DT_REG) { // Check if it's a regular file
-              std::string sourcePath = sourceDir + "/" + entry->d_name;
-              std::string destPath = destDir + "/" + entry->d_name;
-
-              if (!copyFile(sourcePath, destPath)) {
-                  closedir(dir);
-                  return false; // Error while copying the file
-              }
-          }
+      if (error == 0 && fsync(fd) != 0)
+        error = errno;
+      close(fd);
+      if (error != 0) {
+        unlink(tmpPath.c_str());
+        throw std::system_error(error, std::generic_category(), "write " + tmpPath);
       }
-
-      closedir(dir);
-      return true;
+      if (rename(tmpPath.c_str(), manifestPath.c_str()) != 0)
+        throw std::system_error(errno, std::generic_category(), "rename " + tmpPath);
+
+      std::string dir = manifestPath.find('/') == std::string::npos ? "." : manifestPath.substr(0, manifestPath.rfind('/'));
+      int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      if (dir_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open " + dir);
+      int res = fsync(dir_fd);
+      error = errno;
+      close(dir_fd);
+      if (res != 0)
+        throw std::system_error(error, std::generic_category(), "fsync " + dir);
     }
 
+    // Read the manifest back, restoring the swap_space objects
+    // table and the betree root
+    void readManifest(std::string manifestPath) {
+      std::ifstream manifestFile(manifestPath);
+      std::stringstream manifest;
+      manifest << manifestFile.rdbuf();
 
-    // Ang : update loggingFileStatus.txt
-    void updateLoggingFileStatus(std::string loggingFileStatusPath) {
-      if (loggingFileStatusPath.empty()) {
-          loggingFileStatusPath = LOGGING_FILE_STATUS;
-      }
-      std::ofstream loggingFileStatus(loggingFileStatusPath); // Open in overwrite mode
-
-      if (loggingFileStatus) {
-          // Add three lines of content to the file (appending)
-          loggingFileStatus << "log_file_path " << logs.log_file_path <<std::endl;
-          std::string betree_root_name = get_betree_root_id();
-          loggingFileStatus << "betree_root_id " << betree_root_name << std::endl;
-          loggingFileStatus << "persist_lsn " << logs.lastPersistLSN << std::endl;
-          loggingFileStatus << "checkpoint_lsn " << logs.lastCheckpointLSN << std::endl;
-          // std::cout << "In updateLoggingFileStatus(), root_id: " << betree_root_name <<std::endl;
-          
-      } else {
-          std::cerr << "Error creating the file: loggingFileStatus." << std::endl;
-      }
-
-      loggingFileStatus.close();
-    }
-
-    void updateLoggingFileStatus_lastPersistLSN(std::string loggingFileStatusPath, uint64_t newPersistLSN) {
-      // Open the file in read mode
-      std::ifstream inputFile(loggingFileStatusPath);
-      
-      // Read the existing content line by line
-      std::stringstream updatedContent;
       std::string line;
-      while (std::getline(inputFile, line)) {
-          if (line.find("persist_lsn") != std::string::npos) {
-              // Replace the line containing "persist_lsn" with the new value
-              updatedContent << "persist_lsn " << newPersistLSN << std::endl;
-          } else {
-              // Keep the other lines unchanged
-              updatedContent << line << std::endl;
-          }
-      }
-
-      // Close the input file
-      inputFile.close();
-
-      // Open the file in write mode (truncate)
-      std::ofstream outputFile(loggingFileStatusPath);
-
-      if (!outputFile) {
-          std::cerr << "Error opening the file for writing: " << loggingFileStatusPath << std::endl;
-          return;
-      }
-
-      // Write the updated content back to the file
-      outputFile << updatedContent.str();
-      outputFile.close();
-    }
-
-
-    // Ang: deserialize loggingFileStatus.txt
-    void deserializeLoggingFileStatus(std::string loggingFileStatusPath) {
-      if (loggingFileStatusPath.empty()) {
-          loggingFileStatusPath = LOGGING_FILE_STATUS;
-      }
-      std::ifstream loggingFileStatus(loggingFileStatusPath);
-
-      if (loggingFileStatus) {
-          std::string line;
-          while (std::getline(loggingFileStatus, line)) {
-              std::istringstream iss(line);
-              std::string key, value;
-              if (iss >> key >> value) {
-                  if (key == "log_file_path") {
-                      logs.log_file_path = value;
-                      // std::cout << "log_file_path: " << logs.log_file_path << std::endl;
-                  } else if (key == "betree_root_id") {
-                      uint64_t root_id = std::stoull(value);
-                      root.set_target(root_id); 
-                      // std::cout << "root.target: " << root.get_target() << std::endl;
-                  }else if (key == "persist_lsn") {
-                      logs.lastPersistLSN = std::stoull(value);
-                      // std::cout << "logs.lastPersistLSN: " << logs.lastPersistLSN << std::endl;
-                  }else if (key == "checkpoint_lsn") {
-                      logs.lastCheckpointLSN = std::stoull(value);
-                      // std::cout << "logs.lastCheckpointLSN: " << logs.lastCheckpointLSN << std::endl;
-                  }
+      while (std::getline(manifest, line)) {
+          std::istringstream iss(line);
+          std::string key, value;
+          if (iss >> key >> value) {
+              if (key == "log_file_path") {
+                  logs.log_file_path = value;
+              } else if (key == "betree_root_id") {
+                  uint64_t root_id = std::stoull(value);
+                  root.set_target(root_id); 
+              } else if (key == "checkpoint_lsn") {
+                  logs.lastCheckpointLSN = std::stoull(value);
+              } else if (key == "obj_id") {
+                  break;
               }
           }
-      } else {
-          std::cerr << "Error opening the file for deserialization." << std::endl;
       }
 
-      loggingFileStatus.close();
+      manifest.clear();
+      manifest.seekg(0);
+      ss->restore_checkpoint(manifest);
     }
 
 
     // Ang: Do checkpoint
-    // Firstly, flush the whole tree to disk
+    // Firstly, write back the dirty nodes
     // Secondly, write a checkpoint record in the log file and flush it to disk
-    // At last, update loggingFileStatus.txt
+    // At last, replace the manifest
+    // The caller holds the latch exclusively.
     void checkpoint(Key k, Value v){
+      auto start = std::chrono::steady_clock::now();
       //flush current in memory logs to disk
       logs.persist();
 
-      // flush in memory dirty nodes to disk
-      if(!directoryExist(DESTINATION_BACKUP_DIRECTORY)) {
-        createDirectory(DESTINATION_BACKUP_DIRECTORY);
-      }
-      ss->flush_whole_tree(DESTINATION_BACKUP_DIRECTORY);
+      // write back the dirty nodes and make every node version durable
+      ss->write_back_dirty_objects();
 
       // then add checkpoint record into log file, 
       // this make sure the current checkpoint has already finished when the current checkpoint record is written to disk 
@@ -1525,112 +2589,158 @@ public:
       Op<Key, Value> op = Op<Key, Value>(key, val);
       logs.log(op);
       logs.persist(); 
+      uint64_t previousCheckpointLSN = logs.lastCheckpointLSN;
       logs.lastCheckpointLSN = op.get_LSN();
 
-      updateLoggingFileStatus(LOGGING_FILE_STATUS);
+      // the new manifest is the commit point of the checkpoint, after it
+      // the versions only the previous checkpoint needed can be freed.
+      // A failed sync above or here throws before that, so those
+      // versions stay allocated and recovery uses the old manifest.
+      try {
+        writeManifest(CHECKPOINT_MANIFEST_FILE);
+      } catch (...) {
+        logs.lastCheckpointLSN = previousCheckpointLSN;
+        throw;
+      }
+      ss->checkpoint_committed();
 
-      //flush swap_space objects to disk, store the information needed when do recovery
-      ss->serialize_objects(SWAPSPACE_OBJECTS_FILE);
-      
-      // test functionality
-      // ss->clear_objects();
-      // ss->deserialize_objects(SWAPSPACE_OBJECTS_FILE);
+      checkpoint_count++;
+      checkpoint_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
 
-      // root.set_swap_space(nullptr);
-      // root.set_target(0);
+    // crossed_boundary() is true if the last n logged operations
+    // reached a multiple of granularity.
+    bool crossed_boundary(uint64_t granularity, uint64_t n) {
+      return granularity > 0 && logs.log_counter / granularity != (logs.log_counter - n) / granularity;
+    }
 
-      // deserializeLoggingFileStatus(LOGGING_FILE_STATUS);
-      // root.set_swap_space(ss);
-      
+    // Called once an upsert of n operations has released the latch: do
+    // its steps of reshaping, and the checkpoint if its records reached
+    // a multiple of checkpoint_granularity, both under the latch held
+    // exclusively.  Returns whether a checkpoint was taken.
+    bool finish_upsert(Key k, Value v, uint64_t n, bool checkpoint_due) {
+      if (!checkpoint_due && !reshape_pending)
+        return false;
+      std::lock_guard<rw_latch> guard(latch);
+      reshape(reshape_steps_per_op * n);
+      if (!checkpoint_due)
+        return false;
+      checkpoint(k, v); 
+      std::cout << "do checkpoint, logs.lastCheckpointLSN is " << logs.lastCheckpointLSN << std::endl;
+      return true;
     }
 
-    void check_if_need_persist_or_checkpoint(Key k, Value v) {
-      if (logs.log_counter % logs.checkpoint_granularity == 0) {
-        checkpoint(k, v); 
-      //   updateLoggingFileStatus(LOGGING_FILE_STATUS);
-        std::cout << "do checkpoint, logs.lastCheckpointLSN is " << logs.lastCheckpointLSN << std::endl;
-        return; // when doing checkpoint, there is no need to do persist() again, as we will flush all the logs in memory to disk in checkpoint();
-      }
-      if (logs.log_counter % logs.persistence_granularity == 0) {
-        logs.persist();
-        updateLoggingFileStatus_lastPersistLSN(LOGGING_FILE_STATUS, logs.lastPersistLSN);
-        std::cout << "do persist, logs.lastPersistLSN is " << logs.lastPersistLSN << std::endl;
-      //   test recovery()
-      //   recovery(LOGGING_FILE_STATUS, SWAPSPACE_OBJECTS_FILE);
-      //   std::cout << "do recovery, log_counter is " << logs.log_counter << std::endl;
+    // Report operations to the workload predictor, and follow it if
+    // they made it change mode.  The caller holds no latch.
+    void observe_workload(uint64_t writes, uint64_t reads) {
+      if (predictor && predictor->observe(writes, reads))
+        follow_workload();
+      if (cost_model && cost_model->observe(writes, reads))
+        follow_cost_model();
+    }
+
+    // The root's level hint is the height, see node::level().
+    void follow_cost_model(void) {
+      std::lock_guard<rw_latch> guard(latch);
+      double height = root.get_level();
+      double new_epsilon = cost_model->evaluate(ss->get_store_reads(), ss->get_write_back_count(),
+                                                height, max_node_size, epsilon);
+      debug(std::cout << "cost model: operation number: " << cost_model->get_operation_count()
+                << ", write ratio: " << cost_model->get_write_ratio()
+                << ", height: " << height
+                << ", epsilon: " << epsilon
+                << ", observed io per op: " << cost_model->get_observed_cost()
+                << ", predicted io per op: " << cost_model->get_current_cost()
+                << ", new epsilon: " << new_epsilon
+                << ", predicted io per op: " << cost_model->get_chosen_cost()
+                << std::endl);
+      if (new_epsilon != epsilon)
+        apply_epsilon(new_epsilon);
+    }
+
+    void follow_workload(void) {
+      std::lock_guard<rw_latch> guard(latch);
+      int mode = predictor->get_mode();
+      if (mode == state)
+        return;
+      std::cout << "betree state (before change state): " << state << std::endl;
+      std::cout << "betree epsilon (before change state): " << epsilon << std::endl;
+      std::cout << "betree pivot upper bound (before change state): " << pivot_upper_bound << std::endl;
+
+      state = mode;
+      if (mode == WORKLOAD_READ_HEAVY) {
+        apply_epsilon(read_heavy_epsilon);
+        if (shortens_when_read_heavy && reshape_steps_per_op == 0)
+          shorten_from_root();
+      } else {
+        apply_epsilon(write_heavy_epsilon);
       }
+
+      std::cout << "operation number : " << predictor->get_operation_count()
+                << ", write_ratio: " << predictor->get_write_ratio() << std::endl;
+      std::cout << "betree state: " << state << std::endl;
+      std::cout << "betree epsilon: " << epsilon << std::endl;
+      std::cout << "betree pivot upper bound: " << pivot_upper_bound << std::endl;
+      std::cout << "betree message upper bound: " << message_upper_bound << std::endl;
+    }
+
+    // Called once an upsert has released the latch.  When the upsert
+    // took a checkpoint there is no need to persist() again, the
+    // checkpoint committed every buffered record; otherwise the log
+    // decides when to commit a group, according to its sync policy.
+    void end_of_upsert(bool checkpointed) {
+      if (!checkpointed)
+        logs.end_of_operation();
     }
 
-    void redo(std::string& logFilePath, uint64_t lastCheckpointLSN, uint64_t lastPersistLSN) {
+    // Replay every record after lastCheckpointLSN.  Records keep their
+    // original timestamps and are not logged again.  The log only holds
+    // complete records (Logs cuts off a torn tail when it is opened),
+    // so everything in it was committed.
+    void redo(std::string& logFilePath, uint64_t lastCheckpointLSN) {
       std::ifstream logFile(logFilePath);
       if (!logFile.is_open()) {
           std::cerr << "Error opening log file." << std::endl;
           return;
       }
 
-      uint64_t timestamp;
-      uint64_t key;
-      int opcode;
-      std::string timestamp_str, key_str, opcode_str, dummy;
-
       std::string line;
       std::getline(logFile, line); // get the first line, but do not parse it
       while (std::getline(logFile, line)) {
-          std::istringstream iss(line);
-          iss >> timestamp_str >> key_str >> dummy >> opcode_str;
-          timestamp = std::stoull(timestamp_str);
-          key = std::stoull(key_str);
-          opcode = std::stoi(opcode_str);
-          
-          if (timestamp > lastCheckpointLSN && timestamp <= lastPersistLSN) {
-              // std::cout << "in redo, getline: " << timestamp << ", " << key << ", " << opcode << std::endl;
-              upsert(opcode, key, std::to_string(key) + ":");
-          }
-          if (timestamp > lastPersistLSN) {
-              break;
+          std::stringstream record(line);
+          Op<Key, Value> op;
+          deserialize(record, logs.context, op);
+
+          if (op.get_LSN() > lastCheckpointLSN && op.get_message().opcode != CHECKPOINT_OPCODE) {
+              message_map tmp;
+              tmp[op.get_key()] = op.get_message();
+              flush_into_root(tmp);
           }
       }
 
       logFile.close();
     }
 
-    void recovery(std::string loggingFileStatusPath, std::string swapspaceObjectsFilePath) {
-      bool loggingFileStatus_exist = fileExists(loggingFileStatusPath);
-      bool objects_exist = fileExists(swapspaceObjectsFilePath);
-
-      // if any of these files needed for recovery does not exist, return directly
-      if (!loggingFileStatus_exist || !objects_exist) { 
+    void recovery(std::string manifestPath) {
+      std::lock_guard<rw_latch> guard(latch);
+      // without a manifest there is no checkpoint to recover from, so
+      // start a new log, the old records cannot be replayed without one
+      if (!fileExists(manifestPath)) { 
+          logs.reset();
           return;
       }
 
-      // copy all the files from sourceDir to destinationDir
-      std::string sourceDir = "tmpdir_backup";  
-      std::string destinationDir = "tmpdir"; 
-
-      if (copyFilesInDirectory(sourceDir, destinationDir)) {
-          std::cout << "Files copied successfully." << std::endl;
-      } else {
-          std::cerr << "Error copying files." << std::endl;
-      }
-
-      // !!! need to clear lru_pqueue, because the initialization of betree will add root node to lru_pqueue, but we do not need that when do recovery
-      ss->clear_lru_pqueue();
-      // if all the files needed exist, do recovery
-      // 1. recovery objects in swap_space
-      ss->deserialize_objects(swapspaceObjectsFilePath);
-      uint64_t max_objects_id = ss->get_max_objects_id();
-      std::cout << "In recovery, max_objects_id: " << max_objects_id << std::endl;
-      // !!! set ss->next_id with max_objects_id + 1, it is very important to reset next_id to make sure the revcovery process are the following process of history record.
-      ss->set_next_id(max_objects_id + 1);
-      // 2. recovery betree root
-      deserializeLoggingFileStatus(loggingFileStatusPath);
-      set_next_timestamp(logs.lastPersistLSN + 1); // set next_timestamp;
-      // ss->set_next_access_time(logs.lastPersistLSN + 1);
-      // 3. redo from lastFlushLSN
+      // 1. recovery objects in swap_space and betree root; versions
+      // written after the checkpoint are dropped from the backing store
+      readManifest(manifestPath);
+      std::cout << "In recovery, max_objects_id: " << ss->get_max_objects_id() << std::endl;
+      // the log continues after its last committed record
+      set_next_timestamp(std::max(logs.lastPersistLSN, logs.lastCheckpointLSN) + 1); // set next_timestamp;
+      // 2. redo from lastCheckpointLSN
       
       bool log_exist = fileExists(logs.log_file_path);
       if (log_exist) {
-          redo(logs.log_file_path, logs.lastCheckpointLSN, logs.lastPersistLSN);
+          redo(logs.log_file_path, logs.lastCheckpointLSN);
           std::cout << "In recovery, redo has finished." << std::endl;
       } else {
           std::cout << "In recovery, log file does not exist." << std::endl;
@@ -1642,22 +2752,169 @@ public:
   // occurs.
   void upsert(int opcode, Key k, Value v)
   {
-    // kosumi: logging here
-    message_map tmp;
-    MessageKey<Key> key = MessageKey<Key>(k, next_timestamp++); 
-    Message<Value> val = Message<Value>(opcode, v);
-    logs.log(Op<Key, Value>(key, val));
-    tmp[key] = val;
-    pivot_map new_nodes = root->flush(*this, tmp);
-    if (new_nodes.size() > 0) {
-      root = ss->allocate(new node);
-      root->pivots = new_nodes;
-    }
-
-    // std::cout << "In upsert(), the number of elements in ss->objects is: " << ss->get_objects_size() << std::endl;
-    // ss->print_objects_id();
-    // Ang: check if we need persist or do checkpoint
-    check_if_need_persist_or_checkpoint(k, v);
+    observe_workload(1, 0);
+    bool checkpoint_due;
+    {
+      shared_latch_guard guard(latch);
+      std::lock_guard<std::mutex> writing(writer_lock);
+      // kosumi: logging here
+      message_map tmp;
+      MessageKey<Key> key = MessageKey<Key>(k, next_timestamp++); 
+      Message<Value> val = Message<Value>(opcode, v);
+      logs.log(Op<Key, Value>(key, val));
+      tmp[key] = val;
+      observe_subtree(k, 1, 0);
+      flush_into_root(tmp);
+
+      // Ang: check if we need persist or do checkpoint
+      checkpoint_due = crossed_boundary(logs.checkpoint_granularity, 1);
+    }
+    bool checkpointed = finish_upsert(k, v, 1, checkpoint_due);
+    end_of_upsert(checkpointed);
+    follow_subtrees(1);
+  }
+
+  // Apply every operation of batch: log them as one group and push
+  // the whole sorted batch down through a single root->flush().
+  void upsert_batch(const write_batch<Key, Value> &batch)
+  {
+    if (batch.empty())
+      return;
+    observe_workload(batch.size(), 0);
+    bool checkpoint_due;
+    {
+      shared_latch_guard guard(latch);
+      std::lock_guard<std::mutex> writing(writer_lock);
+      message_map tmp;
+      std::vector<Op<Key, Value>> ops;
+      ops.reserve(batch.size());
+      for (auto it = batch.ops.begin(); it != batch.ops.end(); ++it) {
+        MessageKey<Key> key = MessageKey<Key>(it->key, next_timestamp++);
+        Message<Value> val = Message<Value>(it->opcode, it->opcode == DELETE ? default_value : it->val);
+        ops.push_back(Op<Key, Value>(key, val));
+        tmp[key] = val;
+        observe_subtree(it->key, 1, 0);
+      }
+      logs.log_batch(ops);
+      flush_into_root(tmp);
+
+      checkpoint_due = crossed_boundary(logs.checkpoint_granularity, batch.size());
+    }
+    const auto &last = batch.ops.back();
+    bool checkpointed = finish_upsert(last.key, last.opcode == DELETE ? default_value : last.val,
+                                      batch.size(), checkpoint_due);
+    end_of_upsert(checkpointed);
+    follow_subtrees(batch.size());
+  }
+
+  // Push msgs down from the root, growing the tree while the root
+  // splits.  A large batch can split the root into more children than
+  // one root can hold, so the new root may have to split again.  The
+  // new root is complete before queries can see it; the old one keeps
+  // its contents, and its latch until then, so queries that latched it
+  // meanwhile see that it is no longer the root and start over.  The
+  // caller holds writer_lock.
+  void flush_into_root(message_map &msgs)
+  {
+    node_pointer old_root = root;
+    typename swap_space::pin<node> pinned(&old_root);
+    const typename swap_space::pin<node> &cpinned = pinned;
+    cpinned->latch.lock();
+    pivot_map new_nodes = pinned->flush(*this, msgs);
+    if (!new_nodes.empty()) {
+      node_pointer new_root;
+      while (new_nodes.size() > 0) {
+        new_root = ss->allocate(new node);
+        new_root->pivots = new_nodes;
+        new_root->pivot_bound = new_root->fanout_bound(*this);
+        new_root->rebuild_filter();
+        new_root.set_level(new_nodes.begin()->second.child.get_level() + 1);
+        new_nodes.clear();
+        if (new_root->pivots.size() > pivot_upper_bound)
+          new_nodes = new_root->split(*this);
+      }
+      std::lock_guard<std::mutex> guard(root_lock);
+      root = new_root;
+    }
+    cpinned->latch.unlock();
+  }
+
+  // Build the tree bottom-up from the (key, value) pairs in [first,
+  // last), which must be sorted by key without duplicates.  The tree
+  // must be empty.  Leaves are packed with fill_factor * max_node_size
+  // INSERT messages and internal nodes with fill_factor *
+  // pivot_upper_bound children and empty buffers.  Each node is handed
+  // to the swap_space complete and never touched again, so it is
+  // written back once, when it is evicted or by the checkpoint that
+  // ends the load.  The pairs are not logged; that checkpoint is what
+  // makes them durable.
+  template<class InputIt>
+  void bulk_load(InputIt first, InputIt last,
+                 double fill_factor = DEFAULT_BULK_LOAD_FILL_FACTOR)
+  {
+    std::lock_guard<rw_latch> guard(latch);
+    assert(fill_factor > 0 && fill_factor <= 1);
+    assert(root->is_leaf() && root->elements.empty());
+    if (first == last)
+      return;
+
+    uint64_t leaf_size = std::max<uint64_t>(1, fill_factor * max_node_size);
+    uint64_t fanout = std::max<uint64_t>(2, fill_factor * pivot_upper_bound);
+
+    // the nodes of the level being built, keyed as in their parent
+    std::vector<std::pair<Key, child_info> > level;
+    node *leaf = new node;
+    Key last_key = first->first;
+    Value last_value = first->second;
+    for (; first != last; ++first) {
+      assert((leaf->elements.empty() && level.empty()) || last_key < first->first);
+      last_key = first->first;
+      last_value = first->second;
+      leaf->elements[MessageKey<Key>(last_key, next_timestamp++)] =
+        Message<Value>(INSERT, last_value);
+      if (leaf->elements.size() == leaf_size) {
+        bulk_load_append(level, leaf);
+        leaf = new node;
+      }
+    }
+    if (leaf->elements.empty())
+      delete leaf;
+    else
+      bulk_load_append(level, leaf);
+
+    while (level.size() > 1) {
+      std::vector<std::pair<Key, child_info> > parents;
+      uint64_t nparents = (level.size() + fanout - 1) / fanout;
+      auto it = level.begin();
+      for (uint64_t i = 0; i < nparents; i++) {
+        // spread the children evenly over the parents
+        auto end = level.begin() + (i + 1) * level.size() / nparents;
+        node *parent = new node;
+        for (; it != end; ++it)
+          parent->pivots[it->first] = it->second;
+        bulk_load_append(parents, parent);
+      }
+      level.swap(parents);
+    }
+    root = level.front().second.child;
+    level.clear();
+
+    checkpoint(last_key, last_value);
+  }
+
+  // Hand a complete node built by bulk_load() to the swap_space and
+  // add it to level under the smallest key of its subtree.
+  void bulk_load_append(std::vector<std::pair<Key, child_info> > &level, node *n)
+  {
+    Key min_key = n->is_leaf() ? n->elements.begin()->first.key : n->pivots.begin()->first;
+    uint64_t size = n->pivots.size() + n->elements.size();
+    uint64_t pivot_count = n->pivots.size();
+    uint64_t node_level = n->level();
+    n->pivot_bound = pivot_upper_bound;
+    n->rebuild_filter();
+    node_pointer np = ss->allocate(n);
+    np.set_level(node_level);
+    level.push_back(std::make_pair(min_key, child_info(np, size, pivot_count)));
   }
 
   void insert(Key k, Value v)
@@ -1677,7 +2934,94 @@ public:
   
   Value query(Key k)
   {
-    Value v = root->query(*this, k);
+    observe_workload(0, 1);
+    Value v;
+    {
+      shared_latch_guard guard(latch);
+      observe_subtree(k, 0, 1);
+      v = query_path(k);
+    }
+    reshape_after_query();
+    follow_subtrees(1);
+    return v;
+  }
+
+  // Latch the root shared.  An upsert can replace the root between
+  // reading it and latching it, so once latched it is checked to still
+  // be the root.  np keeps the node referenced while pinned pins it.
+  void latch_root_shared(node_pointer &np, typename swap_space::pin<node> &pinned)
+  {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> guard(root_lock);
+        np = root;
+      }
+      pinned = typename swap_space::pin<node>(&np);
+      const typename swap_space::pin<node> &cpinned = pinned;
+      cpinned->latch.lock_shared();
+      {
+        std::lock_guard<std::mutex> guard(root_lock);
+        if (root == np)
+          return;
+      }
+      cpinned->latch.unlock_shared();
+      pinned = typename swap_space::pin<node>();
+    }
+  }
+
+  // Look k up from the root down, latching each node shared before
+  // releasing its parent, and through const pins, so no node is
+  // dirtied.  The messages of each node are kept until a node settles
+  // the query (see node::query_step()) and then applied from the
+  // deepest, which are the oldest, up.
+  Value query_path(const Key &k)
+  {
+    std::vector<std::vector<Message<Value> > > levels;
+    node_pointer np;
+    typename swap_space::pin<node> pinned;
+    latch_root_shared(np, pinned);
+    for (;;) {
+      const typename swap_space::pin<node> &cpinned = pinned;
+      const node *n = cpinned.operator->();
+      levels.push_back(std::vector<Message<Value> >());
+      node_pointer child;
+      if (n->query_step(*this, k, levels.back(), child)) {
+        n->latch.unlock_shared();
+        break;
+      }
+      typename swap_space::pin<node> child_pinned(&child);
+      const typename swap_space::pin<node> &child_cpinned = child_pinned;
+      child_cpinned->latch.lock_shared();
+      n->latch.unlock_shared();
+      pinned = child_pinned;
+      np = child;
+    }
+
+    bool exists = false;
+    Value v = default_value;
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+      for (auto m = level->begin(); m != level->end(); ++m) {
+        switch (m->opcode) {
+        case INSERT:
+          v = m->val;
+          exists = true;
+          break;
+        case DELETE:
+          v = default_value;
+          exists = false;
+          break;
+        case UPDATE:
+          // an update of a missing key applies to the default value
+          v = v + m->val;
+          exists = true;
+          break;
+        default:
+          assert(0);
+        }
+      }
+    }
+    if (!exists)
+      throw std::out_of_range("Key does not exist");
     return v;
   }
 
@@ -1698,11 +3042,45 @@ public:
     } catch (std::out_of_range e) {}
   }
 
+  // A range scan.  The iterator keeps the path from the root to the
+  // leaf it is in as a stack of frames, one per level, and merges the
+  // buffered messages of every level with the leaf in a single pass.
+  // The next message is the smallest message of any level that falls
+  // in the key range of the current leaf.  When no level has one
+  // left, the scan moves on to the next child of the deepest node that
+  // has one, so each node in the scanned range is pinned and loaded
+  // once.  Going down a child prefetches the next
+  // BETREE_SCAN_PREFETCH siblings, so their reads overlap with the
+  // scan of the child.
+  //
+  // As with the std containers, updating the tree invalidates every
+  // iterator.  Iterators take no latch, so they must not be used while
+  // another thread updates the tree.
   class iterator {
   public:
 
+    class frame {
+    public:
+      frame(const node_pointer &np, const MessageKey<Key> *mkey)
+	: pinned(&np)
+      {
+	const typename swap_space::pin<node> &cpinned = pinned;
+	n = cpinned.operator->();
+	next_message = mkey ? n->elements.upper_bound(*mkey) : n->elements.begin();
+	if (!n->is_leaf())
+	  child = mkey && !(mkey->key < n->pivots.begin()->first)
+	    ? n->get_pivot(mkey->key) : n->pivots.begin();
+      }
+
+      typename swap_space::pin<node> pinned;
+      const node *n;
+      typename message_map::const_iterator next_message;
+      typename pivot_map::const_iterator child;
+    };
+
     iterator(const betree &bet)
       : bet(bet),
+	path(),
 	position(),
 	is_valid(false),
 	pos_is_valid(false),
@@ -1712,17 +3090,17 @@ public:
 
     iterator(const betree &bet, const MessageKey<Key> *mkey)
       : bet(bet),
-	position(),	
+	path(),
+	position(),
 	is_valid(false),
 	pos_is_valid(false),
 	first(),
 	second()
     {
-      try {
-	position = bet.root->get_next_message(mkey);
-	pos_is_valid = true;
-	setup_next_element();
-      } catch (std::out_of_range & e) {}
+      path.push_back(frame(bet.root, mkey));
+      descend(mkey);
+      pos_is_valid = next_position();
+      setup_next_element();
     }
 
     void apply(const MessageKey<Key> &msgkey, const Message<Value> &msg) {
@@ -1748,15 +3126,59 @@ public:
       }
     }
 
+    // Push frames down to a leaf, following the child the scan is in.
+    void descend(const MessageKey<Key> *mkey) {
+      while (!path.back().n->is_leaf()) {
+	const frame &f = path.back();
+	auto sibling = std::next(f.child);
+	for (int i = 0; i < BETREE_SCAN_PREFETCH && sibling != f.n->pivots.end(); i++, ++sibling)
+	  sibling->second.child.prefetch();
+	path.push_back(frame(f.child->second.child, mkey));
+      }
+    }
+
+    // Load the next message of the scan into position and step past
+    // it.  Returns false once the whole tree has been scanned.
+    bool next_position(void) {
+      while (!path.empty()) {
+	// The current leaf's key range ends at the next pivot of the
+	// deepest node that has one.  Messages past it must wait until
+	// the scan gets there.
+	const Key *range_end = NULL;
+	for (auto f = path.rbegin(); f != path.rend() && range_end == NULL; ++f)
+	  if (!f->n->is_leaf() && std::next(f->child) != f->n->pivots.end())
+	    range_end = &std::next(f->child)->first;
+
+	frame *best = NULL;
+	for (auto &f : path)
+	  if (f.next_message != f.n->elements.end() &&
+	      (range_end == NULL || f.next_message->first.key < *range_end) &&
+	      (best == NULL || f.next_message->first < best->next_message->first))
+	    best = &f;
+	if (best) {
+	  position.first = best->next_message->first;
+	  position.second = best->next_message->second;
+	  ++best->next_message;
+	  return true;
+	}
+
+	// Every level is done with the current leaf.  Unpin it and
+	// every node whose last child was just finished, then go down
+	// the next child.
+	path.pop_back();
+	while (!path.empty() && ++path.back().child == path.back().n->pivots.end())
+	  path.pop_back();
+	if (!path.empty())
+	  descend(NULL);
+      }
+      return false;
+    }
+
     void setup_next_element(void) {
       is_valid = false;
       while (pos_is_valid && (!is_valid || position.first.key == first)) {
 	apply(position.first, position.second);
-	try {
-	  position = bet.root->get_next_message(&position.first);
-	} catch (std::exception & e) {
-	  pos_is_valid = false;
-	}
+	pos_is_valid = next_position();
       }
     }
 
@@ -1778,6 +3200,7 @@ public:
     }
     
     const betree &bet;
+    std::vector<frame> path;
     std::pair<MessageKey<Key>, Message<Value> > position;
     bool is_valid;
     bool pos_is_valid;
@@ -0,0 +1,112 @@
+// A Bloom filter over the keys buffered in a betree node, so a point
+// query can skip searching a buffer that cannot hold its key.
+//
+// Keys can only be added.  When keys leave the buffer the filter keeps
+// answering "maybe" for them, which is safe, and the owner rebuilds it
+// from the keys that are left (reset() and add() again) once enough of
+// them are gone.  A filter that was never reset answers "maybe" for
+// every key.
+//
+// Each key sets BLOOM_FILTER_HASHES bits chosen by double hashing one
+// 64-bit hash of the key.  With BLOOM_FILTER_BITS_PER_KEY bits per key
+// of capacity, about 1% of the lookups of absent keys answer "maybe".
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "swap_space.hpp"
+
+#define BLOOM_FILTER_BITS_PER_KEY (10)
+#define BLOOM_FILTER_HASHES (6)
+#define BLOOM_FILTER_MIN_KEYS (16)
+
+template<class Key>
+class bloom_filter {
+public:
+  bloom_filter(void) :
+    count(0),
+    capacity(0)
+  {}
+
+  // Empty the filter and size it for capacity_keys keys.
+  void reset(uint64_t capacity_keys) {
+    capacity = std::max<uint64_t>(capacity_keys, BLOOM_FILTER_MIN_KEYS);
+    count = 0;
+    words.assign((capacity * BLOOM_FILTER_BITS_PER_KEY + 63) / 64, 0);
+  }
+
+  void add(const Key &k) {
+    uint64_t h = hash(k);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    uint64_t nbits = words.size() * 64;
+    for (uint32_t i = 0; i < BLOOM_FILTER_HASHES; i++) {
+      uint64_t bit = ((uint64_t)(uint32_t)(h1 + i * h2) * nbits) >> 32;
+      words[bit / 64] |= 1ULL << (bit % 64);
+    }
+    count++;
+  }
+
+  bool may_contain(const Key &k) const {
+    if (words.empty())
+      return true;
+    uint64_t h = hash(k);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    uint64_t nbits = words.size() * 64;
+    for (uint32_t i = 0; i < BLOOM_FILTER_HASHES; i++) {
+      uint64_t bit = ((uint64_t)(uint32_t)(h1 + i * h2) * nbits) >> 32;
+      if (!(words[bit / 64] & (1ULL << (bit % 64))))
+        return false;
+    }
+    return true;
+  }
+
+  bool is_built(void) const { return !words.empty(); }
+  // more keys were added than the filter was sized for
+  bool is_full(void) const { return count >= capacity; }
+  // keys added since the last reset(), counting repeats
+  uint64_t get_count(void) const { return count; }
+
+  void _serialize(std::iostream &fs, serialization_context &context) const {
+    serialize(fs, context, count);
+    serialize(fs, context, capacity);
+    serialize(fs, context, (uint64_t)words.size());
+    for (auto it = words.begin(); it != words.end(); ++it)
+      serialize(fs, context, *it);
+  }
+
+  void _deserialize(std::iostream &fs, serialization_context &context) {
+    uint64_t size = 0;
+    deserialize(fs, context, count);
+    deserialize(fs, context, capacity);
+    deserialize(fs, context, size);
+    words.resize(size);
+    for (auto it = words.begin(); it != words.end(); ++it)
+      deserialize(fs, context, *it);
+  }
+
+  uint64_t _footprint(void) const {
+    return sizeof(*this) + words.capacity() * sizeof(uint64_t);
+  }
+
+private:
+  static uint64_t hash(const Key &k) {
+    // std::hash is the identity for integers, so mix its bits
+    // (the MurmurHash3 finalizer)
+    uint64_t h = std::hash<Key>()(k);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  uint64_t count;
+  uint64_t capacity;
+  std::vector<uint64_t> words;
+};
+
+#endif // BLOOM_FILTER_HPP
@@ -0,0 +1,217 @@
+// Chooses a betree's epsilon from the I/O it is measured to do (see
+// betree::set_cost_model).
+//
+// With nodes of B messages and epsilon e, a node has F = B^e children
+// and buffers B - F messages, so a flush moves about (B - F) / F of
+// them.  A message is flushed once per level on its way down, so an
+// upsert costs about
+//   W(e) = h(e) * F / (B - F)
+// node writes, where h(e) is the number of levels above the leaves,
+// and a query reads the h(e) + 1 nodes on its path,
+//   Q(e) = h(e) + 1.
+// Upserts also read the nodes they flush into, about W(e) of them.
+// Heights shrink as fanouts grow, so from the height h0 measured at
+// the current epsilon e0, h(e) = h0 * ln F(e0) / ln F(e).
+//
+// The cache absorbs some of this I/O, so the model is calibrated each
+// interval: the node writes and reads swap_space did over the interval
+// scale W and the reads.  The scales and the write ratio w are
+// smoothed over intervals, so that a workload that alternates between
+// short phases does not drag epsilon back and forth.  The expected I/O
+// per operation is then
+//   cost(e) = kw * w * W(e) + kr * (w * W(e) + (1 - w) * Q(e))
+// and the model picks the candidate epsilon with the lowest cost.  It
+// only moves away from the current epsilon when that saves more than
+// COST_MODEL_MARGIN of the current cost.
+//
+// Before recalibrating, each interval also checks the model: what it
+// predicts for the interval's own write ratio at the epsilon the tree
+// had is compared with the I/O the interval actually took.
+
+#ifndef COST_MODEL_HPP
+#define COST_MODEL_HPP
+
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+
+#define DEFAULT_COST_MODEL_INTERVAL (250)
+#define DEFAULT_COST_MODEL_CANDIDATES (9)
+// the weight of the newest interval in the smoothed scales and ratio
+#define COST_MODEL_SMOOTHING (0.5)
+#define COST_MODEL_MARGIN (0.05)
+
+class epsilon_cost_model {
+public:
+  // candidates epsilons spread evenly over [min_epsilon, max_epsilon]
+  epsilon_cost_model(double min_epsilon, double max_epsilon,
+                     uint64_t interval = DEFAULT_COST_MODEL_INTERVAL,
+                     int candidates = DEFAULT_COST_MODEL_CANDIDATES) :
+    min_epsilon(min_epsilon),
+    max_epsilon(max_epsilon),
+    interval(interval),
+    candidates(candidates)
+  {
+    assert(0 < min_epsilon && min_epsilon <= max_epsilon && max_epsilon < 1);
+    assert(interval > 0 && candidates > 0);
+  }
+
+  // Record writes and reads.  Returns true if they ended an interval,
+  // and the caller should then call evaluate().
+  bool observe(uint64_t writes, uint64_t reads) {
+    uint64_t n = writes + reads;
+    if (n == 0)
+      return false;
+    write_count += writes;
+    uint64_t before = operation_count.fetch_add(n);
+    return before / interval != (before + n) / interval;
+  }
+
+  // One evaluation, for the operations since the last one.
+  // node_reads and node_writes are swap_space's running totals of
+  // store reads and write-backs, height is the current number of
+  // levels above the leaves, and the tree has nodes of max_node_size
+  // messages and is at epsilon.  Returns the epsilon to use.
+  double evaluate(uint64_t node_reads, uint64_t node_writes, double height,
+                  uint64_t max_node_size, double epsilon) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t ops = operation_count;
+    uint64_t writes = write_count;
+    uint64_t interval_ops = ops - last_ops;
+    uint64_t interval_writes = writes - last_writes;
+    uint64_t interval_node_reads = node_reads - last_node_reads;
+    uint64_t interval_node_writes = node_writes - last_node_writes;
+    bool first = evaluation_count == 0;
+    last_ops = ops;
+    last_writes = writes;
+    last_node_reads = node_reads;
+    last_node_writes = node_writes;
+    evaluation_count++;
+    if (first || interval_ops == 0)
+      return epsilon;
+
+    B = max_node_size;
+    h0 = std::max(height, 1.0);
+    e0 = epsilon;
+    double w = interval_writes * 1.0 / interval_ops;
+    observed = (interval_node_reads + interval_node_writes) * 1.0 / interval_ops;
+    if (kw_calibrated && kr_calibrated) {
+      error_sum += std::fabs(cost(e0, w) - observed);
+      observed_sum += observed;
+      prediction_count++;
+    }
+
+    // calibrate against this interval
+    if (interval_writes > 0)
+      smooth(kw, kw_calibrated, interval_node_writes * 1.0 / interval_writes / writes_per_upsert(e0));
+    double model_reads = w * writes_per_upsert(e0) + (1 - w) * reads_per_query(e0);
+    smooth(kr, kr_calibrated, interval_node_reads * 1.0 / interval_ops / model_reads);
+    smooth(write_ratio, ratio_calibrated, w);
+
+    double best = e0;
+    double best_cost = cost(e0, write_ratio);
+    current_cost = best_cost;
+    for (int i = 0; i < candidates; i++) {
+      double e = candidates == 1 ? min_epsilon
+        : min_epsilon + (max_epsilon - min_epsilon) * i / (candidates - 1);
+      if (cost(e, write_ratio) < best_cost) {
+        best = e;
+        best_cost = cost(e, write_ratio);
+      }
+    }
+    if (best_cost >= current_cost * (1 - COST_MODEL_MARGIN))
+      best = e0;
+    else
+      change_count++;
+    chosen_cost = cost(best, write_ratio);
+    return best;
+  }
+
+  uint64_t get_evaluation_count(void) { return evaluation_count; }
+  uint64_t get_change_count(void) { return change_count; }
+  uint64_t get_operation_count(void) { return operation_count; }
+
+  // The last evaluation: the smoothed write ratio, the I/O per
+  // operation it saw, and what it predicts per operation at the epsilon
+  // it found and at the one it chose
+  double get_write_ratio(void) { std::lock_guard<std::mutex> guard(lock); return write_ratio; }
+  double get_observed_cost(void) { std::lock_guard<std::mutex> guard(lock); return observed; }
+  double get_current_cost(void) { std::lock_guard<std::mutex> guard(lock); return current_cost; }
+  double get_chosen_cost(void) { std::lock_guard<std::mutex> guard(lock); return chosen_cost; }
+
+  // over every interval that was checked: the mean absolute error of
+  // the predicted I/O per operation, and the mean observed
+  double get_mean_prediction_error(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return prediction_count ? error_sum / prediction_count : 0;
+  }
+  double get_mean_observed_cost(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return prediction_count ? observed_sum / prediction_count : 0;
+  }
+
+private:
+  double fanout(double e) {
+    double f = std::floor(std::pow((double)B, e));
+    return std::max(2.0, std::min(f, B - 1.0));
+  }
+
+  double height(double e) {
+    return h0 * std::log(fanout(e0)) / std::log(fanout(e));
+  }
+
+  double writes_per_upsert(double e) {
+    double f = fanout(e);
+    return height(e) * f / (B - f);
+  }
+
+  double reads_per_query(double e) {
+    return height(e) + 1;
+  }
+
+  double cost(double e, double w) {
+    return kw * w * writes_per_upsert(e) +
+      kr * (w * writes_per_upsert(e) + (1 - w) * reads_per_query(e));
+  }
+
+  // fold value into k, which starts out as the first value
+  void smooth(double &k, bool &calibrated, double value) {
+    k = calibrated ? COST_MODEL_SMOOTHING * value + (1 - COST_MODEL_SMOOTHING) * k : value;
+    calibrated = true;
+  }
+
+  const double min_epsilon;
+  const double max_epsilon;
+  const uint64_t interval;
+  const int candidates;
+  std::atomic<uint64_t> operation_count{0};
+  std::atomic<uint64_t> write_count{0};
+  std::atomic<uint64_t> evaluation_count{0};
+  std::atomic<uint64_t> change_count{0};
+
+  // the rest is guarded by lock
+  std::mutex lock;
+  uint64_t last_ops = 0;
+  uint64_t last_writes = 0;
+  uint64_t last_node_reads = 0;
+  uint64_t last_node_writes = 0;
+  uint64_t B = 0;
+  double h0 = 1;
+  double e0 = 0;
+  double write_ratio = 0;
+  double kw = 1;
+  double kr = 1;
+  bool kw_calibrated = false;
+  bool kr_calibrated = false;
+  bool ratio_calibrated = false;
+  double observed = 0;
+  double current_cost = 0;
+  double chosen_cost = 0;
+  double error_sum = 0;
+  double observed_sum = 0;
+  uint64_t prediction_count = 0;
+};
+
+#endif // COST_MODEL_HPP
@@ -0,0 +1,139 @@
+// Compression for swap_space's compressed tier, in the LZ4 block
+// format, so no library is needed.
+//
+// A block is a sequence of (literals, match) pairs.  Each starts with
+// a token byte, whose high nibble is the literal length and low nibble
+// the match length minus LZ4_MIN_MATCH, a nibble of 15 meaning that
+// 255-terminated extra length bytes follow.  Then come the literals, a
+// 2-byte little-endian offset back into the output, and the extra
+// match length bytes.  The last pair has literals only, and the last
+// LZ4_LAST_LITERALS bytes are always literals.  The block does not
+// record the uncompressed size, the caller keeps it.
+//
+// The compressor is greedy: it looks up the last position that hashed
+// to the same 4 bytes and takes the match if those bytes are equal.
+
+#ifndef LZ4_BLOCK_HPP
+#define LZ4_BLOCK_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define LZ4_MIN_MATCH (4)
+#define LZ4_LAST_LITERALS (5)
+// a match starts at least this far from the end of the input
+#define LZ4_MATCH_LIMIT (12)
+#define LZ4_MAX_OFFSET (65535)
+#define LZ4_HASH_BITS (12)
+
+inline uint32_t lz4_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void lz4_write_length(std::string &out, uint64_t length) {
+  while (length >= 255) {
+    out.push_back((char)255);
+    length -= 255;
+  }
+  out.push_back((char)length);
+}
+
+// append the literals [begin, end) and, if match_length > 0, a match
+inline void lz4_write_sequence(std::string &out, const uint8_t *begin, const uint8_t *end,
+                               uint64_t offset, uint64_t match_length) {
+  uint64_t literals = end - begin;
+  uint64_t extra = match_length > 0 ? match_length - LZ4_MIN_MATCH : 0;
+  out.push_back((char)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15)));
+  if (literals >= 15)
+    lz4_write_length(out, literals - 15);
+  out.append((const char *)begin, literals);
+  if (match_length == 0)
+    return;
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (extra >= 15)
+    lz4_write_length(out, extra - 15);
+}
+
+// compress size bytes at src into out
+inline void lz4_compress(const char *src, uint64_t size, std::string &out) {
+  const uint8_t *in = (const uint8_t *)src;
+  out.clear();
+  out.reserve(size + size / 255 + 16);
+  uint64_t anchor = 0;
+  if (size > LZ4_MATCH_LIMIT) {
+    // position + 1 of the last 4 bytes with each hash, 0 for none
+    std::vector<uint32_t> table(1 << LZ4_HASH_BITS, 0);
+    uint64_t i = 0;
+    while (i < size - LZ4_MATCH_LIMIT) {
+      uint32_t bytes = lz4_read32(in + i);
+      uint32_t h = (bytes * 2654435761U) >> (32 - LZ4_HASH_BITS);
+      uint64_t candidate = table[h];
+      table[h] = i + 1;
+      if (candidate == 0 || i - (candidate - 1) > LZ4_MAX_OFFSET ||
+          lz4_read32(in + candidate - 1) != bytes) {
+        i++;
+        continue;
+      }
+      uint64_t match = candidate - 1;
+      uint64_t length = LZ4_MIN_MATCH;
+      while (i + length < size - LZ4_LAST_LITERALS && in[match + length] == in[i + length])
+        length++;
+      lz4_write_sequence(out, in + anchor, in + i, i - match, length);
+      i += length;
+      anchor = i;
+    }
+  }
+  lz4_write_sequence(out, in + anchor, in + size, 0, 0);
+}
+
+// decompress the size bytes at src, which hold original_size bytes
+// compressed by lz4_compress(), into out
+inline void lz4_decompress(const char *src, uint64_t size, std::string &out, uint64_t original_size) {
+  const uint8_t *in = (const uint8_t *)src;
+  out.resize(original_size);
+  char *dst = original_size > 0 ? &out[0] : NULL;
+  uint64_t ip = 0, op = 0;
+  while (ip < size) {
+    uint8_t token = in[ip++];
+    uint64_t literals = token >> 4;
+    if (literals == 15) {
+      uint8_t b;
+      do {
+        b = in[ip++];
+        literals += b;
+      } while (b == 255);
+    }
+    assert(ip + literals <= size && op + literals <= original_size);
+    if (literals > 0)
+      memcpy(dst + op, in + ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip >= size)
+      break;
+
+    uint64_t offset = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    uint64_t length = token & 15;
+    if (length == 15) {
+      uint8_t b;
+      do {
+        b = in[ip++];
+        length += b;
+      } while (b == 255);
+    }
+    length += LZ4_MIN_MATCH;
+    assert(offset > 0 && offset <= op && op + length <= original_size);
+    // the match may overlap the bytes it produces
+    for (uint64_t k = 0; k < length; k++, op++)
+      dst[op] = dst[op - offset];
+  }
+  assert(op == original_size);
+}
+
+#endif // LZ4_BLOCK_HPP
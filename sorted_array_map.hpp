@@ -0,0 +1,149 @@
+// A map stored as one contiguous array of (key, value) pairs kept
+// sorted by key.  It implements the subset of the std::map interface
+// used by the betree nodes, so a node can hold its pivots and
+// buffered messages in it instead of in red-black trees.
+//
+// Lookups are binary searches over contiguous memory and iteration is
+// a linear scan, at the cost of O(n) inserts and erases in the middle
+// of the array.  Nodes are bounded by max_node_size, so n is small and
+// the shifting is cheaper than chasing tree pointers across the heap.
+// Appending in key order (what split() and deserialization do) is
+// amortized O(1).
+//
+// Unlike std::map, inserting or erasing invalidates every iterator
+// into the map, and value_type is std::pair<Key, Value> rather than
+// std::pair<const Key, Value>.
+
+#ifndef SORTED_ARRAY_MAP_HPP
+#define SORTED_ARRAY_MAP_HPP
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+
+template<class Key, class Value>
+class sorted_array_map {
+public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef std::pair<Key, Value> value_type;
+  typedef typename std::vector<value_type>::iterator iterator;
+  typedef typename std::vector<value_type>::const_iterator const_iterator;
+  typedef typename std::vector<value_type>::size_type size_type;
+
+  sorted_array_map(void) {}
+
+  // [first, last) must be sorted by key without duplicates, e.g. a
+  // range of another sorted_array_map.
+  template<class InputIt>
+  sorted_array_map(InputIt first, InputIt last) :
+    array(first, last)
+  {}
+
+  iterator begin(void) { return array.begin(); }
+  iterator end(void) { return array.end(); }
+  const_iterator begin(void) const { return array.begin(); }
+  const_iterator end(void) const { return array.end(); }
+
+  size_type size(void) const { return array.size(); }
+  bool empty(void) const { return array.empty(); }
+  size_type capacity(void) const { return array.capacity(); }
+  void clear(void) { array.clear(); }
+  void reserve(size_type n) { array.reserve(n); }
+
+  iterator lower_bound(const Key &k) {
+    return std::lower_bound(array.begin(), array.end(), k, key_less());
+  }
+
+  const_iterator lower_bound(const Key &k) const {
+    return std::lower_bound(array.begin(), array.end(), k, key_less());
+  }
+
+  iterator upper_bound(const Key &k) {
+    return std::upper_bound(array.begin(), array.end(), k, key_less());
+  }
+
+  const_iterator upper_bound(const Key &k) const {
+    return std::upper_bound(array.begin(), array.end(), k, key_less());
+  }
+
+  iterator find(const Key &k) {
+    iterator it = lower_bound(k);
+    return it != array.end() && !(k < it->first) ? it : array.end();
+  }
+
+  const_iterator find(const Key &k) const {
+    const_iterator it = lower_bound(k);
+    return it != array.end() && !(k < it->first) ? it : array.end();
+  }
+
+  size_type count(const Key &k) const {
+    return find(k) != array.end() ? 1 : 0;
+  }
+
+  Value & operator[](const Key &k) {
+    // fast path for appending in key order
+    if (array.empty() || array.back().first < k) {
+      array.push_back(value_type(k, Value()));
+      return array.back().second;
+    }
+    iterator it = lower_bound(k);
+    if (it == array.end() || k < it->first)
+      it = array.insert(it, value_type(k, Value()));
+    return it->second;
+  }
+
+  std::pair<iterator, bool> insert(const value_type &v) {
+    iterator it = lower_bound(v.first);
+    if (it != array.end() && !(v.first < it->first))
+      return std::make_pair(it, false);
+    return std::make_pair(array.insert(it, v), true);
+  }
+
+  // The hint is only used when it is the right place for v.
+  iterator insert(iterator hint, const value_type &v) {
+    if ((hint == array.begin() || (hint - 1)->first < v.first) &&
+        (hint == array.end() || v.first < hint->first))
+      return array.insert(hint, v);
+    return insert(v).first;
+  }
+
+  template<class InputIt>
+  void insert(InputIt first, InputIt last) {
+    for (; first != last; ++first)
+      insert(value_type(first->first, first->second));
+  }
+
+  template<class... Args>
+  iterator emplace_hint(iterator hint, Args&&... args) {
+    return insert(hint, value_type(std::forward<Args>(args)...));
+  }
+
+  iterator erase(iterator pos) {
+    return array.erase(pos);
+  }
+
+  iterator erase(iterator first, iterator last) {
+    return array.erase(first, last);
+  }
+
+  size_type erase(const Key &k) {
+    iterator it = find(k);
+    if (it == array.end())
+      return 0;
+    array.erase(it);
+    return 1;
+  }
+
+private:
+  class key_less {
+  public:
+    bool operator()(const value_type &v, const Key &k) const { return v.first < k; }
+    bool operator()(const Key &k, const value_type &v) const { return k < v.first; }
+  };
+
+  std::vector<value_type> array;
+};
+
+#endif // SORTED_ARRAY_MAP_HPP
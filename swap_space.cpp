@@ -1,36 +1,122 @@
 #include "swap_space.hpp"
 
 
+//Little-endian fixed-width integers used by the binary format.
+static void write_le(std::iostream &fs, uint64_t x, int nbytes)
+{
+  char buf[8];
+  for (int i = 0; i < nbytes; i++)
+    buf[i] = (char)((x >> (8 * i)) & 0xff);
+  fs.write(buf, nbytes);
+}
+
+static uint64_t read_le(std::iostream &fs, int nbytes)
+{
+  unsigned char buf[8];
+  fs.read((char *)buf, nbytes);
+  uint64_t x = 0;
+  for (int i = 0; i < nbytes; i++)
+    x |= (uint64_t)buf[i] << (8 * i);
+  return x;
+}
+
+void write_format_header(std::iostream &fs, int fmt)
+{
+  if (fmt == SERIALIZATION_FORMAT_BINARY) {
+    fs.write(BINARY_FORMAT_MAGIC, BINARY_FORMAT_MAGIC_SIZE);
+    write_le(fs, SERIALIZATION_FORMAT_VERSION, 4);
+  } else {
+    fs << TEXT_FORMAT_MAGIC " " << SERIALIZATION_FORMAT_VERSION << std::endl;
+  }
+  assert(fs.good());
+}
+
+static void check_format_version(uint64_t version)
+{
+  if (version < SERIALIZATION_FORMAT_OLDEST_VERSION || version > SERIALIZATION_FORMAT_VERSION)
+    throw std::runtime_error("unsupported node format version " + std::to_string(version));
+}
+
+void read_format_header(std::iostream &fs, serialization_context &context)
+{
+  if (fs.peek() != BINARY_FORMAT_MAGIC[0]) {
+    context.format = SERIALIZATION_FORMAT_TEXT;
+    context.version = TEXT_FORMAT_UNMARKED_VERSION;
+    if (fs.peek() == TEXT_FORMAT_MAGIC[0]) {
+      std::string magic;
+      fs >> magic >> context.version;
+      if (magic != TEXT_FORMAT_MAGIC)
+        throw std::runtime_error("bad text node format magic");
+      check_format_version(context.version);
+    }
+    assert(fs.good());
+    return;
+  }
+  char magic[BINARY_FORMAT_MAGIC_SIZE];
+  fs.read(magic, BINARY_FORMAT_MAGIC_SIZE);
+  if (std::string(magic, BINARY_FORMAT_MAGIC_SIZE) != std::string(BINARY_FORMAT_MAGIC, BINARY_FORMAT_MAGIC_SIZE))
+    throw std::runtime_error("bad binary node format magic");
+  uint64_t version = read_le(fs, 4);
+  check_format_version(version);
+  assert(fs.good());
+  context.format = SERIALIZATION_FORMAT_BINARY;
+  context.version = version;
+}
+
+bool has_more_text(std::iostream &fs)
+{
+  std::streambuf *buf = fs.rdbuf();
+  while (buf->sgetc() != std::char_traits<char>::eof() && isspace(buf->sgetc()))
+    buf->sbumpc();
+  return buf->sgetc() != std::char_traits<char>::eof();
+}
+
 //Methods to serialize/deserialize different kinds of objects.
 //You shouldn't need to touch these.
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x)
 {
-  fs << x << " ";
+  if (context.is_binary())
+    write_le(fs, x, 8);
+  else
+    fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 {
-  fs >> x;
+  if (context.is_binary())
+    x = read_le(fs, 8);
+  else
+    fs >> x;
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x)
 {
-  fs << x << " ";
+  if (context.is_binary())
+    write_le(fs, (uint64_t)x, 8);
+  else
+    fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x)
 {
-  fs >> x;
+  if (context.is_binary())
+    x = (int64_t)read_le(fs, 8);
+  else
+    fs >> x;
   assert(fs.good());
 }
 
 // kosumi: serialization of (size, val)
 void serialize(std::iostream &fs, serialization_context &context, std::string x)
 {
-  fs << x.size() << ",";
+  if (context.is_binary()) {
+    assert(x.size() <= UINT32_MAX);
+    write_le(fs, x.size(), 4);
+  } else
+    fs << x.size() << ",";
   assert(fs.good());
   fs.write(x.data(), x.size());
   assert(fs.good());
@@ -39,27 +125,180 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
 {
   size_t length;
-  char comma;
-  fs >> length >> comma;
+  if (context.is_binary()) {
+    length = read_le(fs, 4);
+  } else {
+    char comma;
+    fs >> length >> comma;
+  }
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+  x.resize(length);
+  if (length > 0)
+    fs.read(&x[0], length);
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
-bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b) {
-  return a->last_access < b->last_access;
+uint64_t footprint(const std::string &x)
+{
+  // short strings live inside the std::string object itself
+  const char *self = (const char *)&x;
+  if (x.data() >= self && x.data() < self + sizeof(x))
+    return sizeof(x);
+  return sizeof(x) + x.capacity() + 1;
+}
+
+//////////////////////////
+// Replacement policies //
+//////////////////////////
+void swap_space::replacement_policy::link_at_tail(swap_space::object *obj) {
+  obj->prev_resident = tail;
+  obj->next_resident = NULL;
+  if (tail)
+    tail->next_resident = obj;
+  else
+    head = obj;
+  tail = obj;
+  obj->is_resident = true;
+  count++;
+}
+
+void swap_space::replacement_policy::unlink(swap_space::object *obj) {
+  if (obj->prev_resident)
+    obj->prev_resident->next_resident = obj->next_resident;
+  else
+    head = obj->next_resident;
+  if (obj->next_resident)
+    obj->next_resident->prev_resident = obj->prev_resident;
+  else
+    tail = obj->prev_resident;
+  obj->prev_resident = NULL;
+  obj->next_resident = NULL;
+  obj->is_resident = false;
+  count--;
+}
+
+void swap_space::replacement_policy::erase(swap_space::object *obj) {
+  if (obj->is_resident)
+    unlink(obj);
+}
+
+void swap_space::replacement_policy::clear(void) {
+  while (head)
+    erase(head);
+}
+
+void swap_space::packed_list::push(swap_space::object *obj) {
+  obj->prev_packed = tail;
+  obj->next_packed = NULL;
+  if (tail)
+    tail->next_packed = obj;
+  else
+    head = obj;
+  tail = obj;
+}
+
+void swap_space::packed_list::erase(swap_space::object *obj) {
+  if (obj->prev_packed)
+    obj->prev_packed->next_packed = obj->next_packed;
+  else
+    head = obj->next_packed;
+  if (obj->next_packed)
+    obj->next_packed->prev_packed = obj->prev_packed;
+  else
+    tail = obj->prev_packed;
+  obj->prev_packed = NULL;
+  obj->next_packed = NULL;
+}
+
+void swap_space::lru_policy::touch(swap_space::object *obj) {
+  if (obj->is_resident)
+    unlink(obj);
+  link_at_tail(obj);
 }
 
-swap_space::swap_space(backing_store *bs, uint64_t n) :
+//the least recently used object that is not pinned
+swap_space::object * swap_space::lru_policy::pick_victim(bool spare_internal) {
+  for (object *obj = head; obj != NULL; obj = obj->next_resident)
+    if (obj->pincount == 0 && !(spare_internal && obj->level > 0))
+      return obj;
+  return NULL;
+}
+
+void swap_space::lru_policy::cold_objects(std::vector<swap_space::object *> &out, uint64_t n) {
+  for (object *obj = head; obj != NULL && n > 0; obj = obj->next_resident, n--)
+    out.push_back(obj);
+}
+
+void swap_space::clock_policy::touch(swap_space::object *obj) {
+  if (!obj->is_resident)
+    link_at_tail(obj);
+  obj->referenced = true;
+}
+
+void swap_space::clock_policy::erase(swap_space::object *obj) {
+  if (obj == hand)
+    hand = obj->next_resident;
+  replacement_policy::erase(obj);
+}
+
+//sweep at most twice around the clock: the first pass may only clear
+//reference bits, the second then finds any unpinned object.  Spared
+//objects keep their reference bits.
+swap_space::object * swap_space::clock_policy::pick_victim(bool spare_internal) {
+  if (head == NULL)
+    return NULL;
+  if (hand == NULL)
+    hand = head;
+  object *start = hand;
+  int laps = 0;
+  while (laps < 2) {
+    object *obj = hand;
+    hand = hand->next_resident ? hand->next_resident : head;
+    if (hand == start)
+      laps++;
+    if (obj->pincount > 0 || (spare_internal && obj->level > 0))
+      continue;
+    if (obj->referenced) {
+      obj->referenced = false;
+      continue;
+    }
+    return obj;
+  }
+  return NULL;
+}
+
+//the next n unreferenced objects the hand will reach, which it takes
+//before the ones it gives a second chance
+void swap_space::clock_policy::cold_objects(std::vector<swap_space::object *> &out, uint64_t n) {
+  object *obj = hand ? hand : head;
+  for (uint64_t i = 0; i < count && n > 0; i++) {
+    if (!obj->referenced) {
+      out.push_back(obj);
+      n--;
+    }
+    obj = obj->next_resident ? obj->next_resident : head;
+  }
+}
+
+swap_space::swap_space(backing_store *bs, uint64_t n, int fmt, int replacement) :
   backstore(bs),
   max_in_memory_objects(n),
-  objects(),
-  lru_pqueue(cmp_by_last_access) // Ang: pass a function cmp_by_last_access() to the set lru_pqueue which makes this set a priority queue;
-{}
+  format(fmt),
+  replacement(replacement)
+{
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    if (replacement == REPLACEMENT_POLICY_CLOCK)
+      shards[i].policy = new clock_policy();
+    else
+      shards[i].policy = new lru_policy();
+  }
+}
+
+swap_space::~swap_space(void) {
+  stop_flusher();
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++)
+    delete shards[i].policy;
+}
 
 //construct a new object. Called by ss->allocate() via pointer<Referent> construction
 //Does not insert into objects table - that's handled by pointer<Referent>()
@@ -68,10 +307,26 @@ swap_space::object::object(swap_space *sspace, serializable * tgt) {
   id = sspace->next_id++;
   version = 0;
   is_leaf = false;
+  level = 0;
   refcount = 1;
   last_access = sspace->next_access_time++;
   target_is_dirty = true;
   pincount = 0;
+  prev_resident = NULL;
+  next_resident = NULL;
+  is_resident = false;
+  referenced = false;
+  footprint = 0;
+  footprint_is_stale = false;
+  checkpointed_version = 0;
+  is_loading = false;
+  load_is_prefetched = false;
+  is_packed = false;
+  packed_size = 0;
+  packed_is_dirty = false;
+  packed_time = 0;
+  prev_packed = NULL;
+  next_packed = NULL;
 }
 
 swap_space::object::object(){
@@ -79,10 +334,26 @@ swap_space::object::object(){
   id = -1; // object id 
   version = -1;
   is_leaf = false;
+  level = 0;
   refcount = -1;
   last_access = -1;
   target_is_dirty = false;
   pincount = -1;
+  prev_resident = NULL;
+  next_resident = NULL;
+  is_resident = false;
+  referenced = false;
+  footprint = 0;
+  footprint_is_stale = false;
+  checkpointed_version = 0;
+  is_loading = false;
+  load_is_prefetched = false;
+  is_packed = false;
+  packed_size = 0;
+  packed_is_dirty = false;
+  packed_time = 0;
+  prev_packed = NULL;
+  next_packed = NULL;
 }
 
 //set # of items that can live in ss.
@@ -92,12 +363,39 @@ void swap_space::set_cache_size(uint64_t sz) {
   maybe_evict_something();
 }
 
-//write an object that lives on disk back to disk
+//set the byte budget of the objects in ss, 0 disables it.
+void swap_space::set_cache_bytes(uint64_t bytes) {
+  max_in_memory_bytes = bytes;
+  maybe_evict_something();
+}
+
+//set the fraction of the budget kept for objects above level 0.
+void swap_space::set_internal_reserve(double fraction) {
+  assert(fraction >= 0 && fraction <= 1);
+  internal_reserve = fraction;
+}
+
+//set the byte budget of the compressed tier, 0 disables the tier.
+void swap_space::set_compressed_cache_bytes(uint64_t bytes) {
+  max_packed_bytes = bytes;
+  maybe_evict_something();
+}
+
+//a stream buffer that drops whatever is written to it
+class discarding_buf : public std::streambuf {
+protected:
+  int overflow(int c) { return traits_type::not_eof(c); }
+  std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+//write an object back to disk, leaving the stream in batch so that
+//the caller can put several write-backs in one submission.
 //only triggers a write if the object is "dirty" (target_is_dirty == true)
-void swap_space::write_back(swap_space::object *obj)
+//Unless evicting, the target stays valid in memory afterwards.  The
+//caller holds the lock of obj's shard.
+void swap_space::write_back(swap_space::object *obj, std::vector<std::iostream *> &batch, bool evicting)
 {
   // std::cout << "In write_back(), obj->id: " << obj->id << std::endl;
-  assert(objects.count(obj->id) > 0);
 
   debug(std::cout << "Writing back " << obj->id
 	<< " (" << obj->target << ") "
@@ -105,114 +403,439 @@ void swap_space::write_back(swap_space::object *obj)
 
   // This calls _serialize on all the pointers in this object,
   // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
-  serialization_context ctxt(*this);
+  // pack() does the same for victims kept in the compressed tier.
+  serialization_context ctxt(*this, format);
+  ctxt.releases_pointers = evicting;
+  if (!obj->target_is_dirty) {
+    // the on-disk version is current; a victim is still serialized,
+    // into a stream that drops the bytes, to release its pointers
+    if (evicting) {
+      discarding_buf buf;
+      std::iostream discard(&buf);
+      serialize(discard, ctxt, *obj->target);
+      obj->is_leaf = ctxt.is_leaf;
+    }
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
   std::stringstream sstream;
+  write_format_header(sstream, format);
   serialize(sstream, ctxt, *obj->target);
   obj->is_leaf = ctxt.is_leaf;
 
-  if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
+  write_version(obj, sstream.str(), batch);
+  obj->target_is_dirty = false;
+  write_back_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//write image as the next version of obj, leaving the stream in batch.
+//The caller holds the lock of obj's shard.
+void swap_space::write_version(swap_space::object *obj, const std::string &buffer, std::vector<std::iostream *> &batch)
+{
+  write_back_count++;
+  write_back_bytes += buffer.length();
 
-    //modification - ss now controls BSID - split into unique id and version.
-    //version increments linearly based uniquely on this version counter.
+  //modification - ss now controls BSID - split into unique id and version.
+  //version increments linearly based uniquely on this version counter.
 
-    uint64_t new_version_id = obj->version+1;
+  uint64_t new_version_id = obj->version+1;
 
+  std::iostream *out;
+  {
+    std::lock_guard<std::mutex> io(io_lock);
     backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    // printf("In write_back function:\n");
-    // printf("obj_id: %" PRIu64 "\n", obj->id);
-    // printf("version: %" PRIu64 "\n", new_version_id);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
+    out = backstore->get(obj->id, new_version_id);
+  }
+  // printf("In write_back function:\n");
+  // printf("obj_id: %" PRIu64 "\n", obj->id);
+  // printf("version: %" PRIu64 "\n", new_version_id);
+  out->write(buffer.data(), buffer.length());
+  batch.push_back(out);
+
+
+  // version 0 is the flag that the object exists only in memory.
+  // The version this one supersedes is dead, unless the last
+  // checkpoint still refers to it.
+  uint64_t old_version = obj->version;
+  obj->version = new_version_id;
+  if (old_version > 0)
+    release_version(obj, old_version);
+}
+
+//move the victim obj into the compressed tier.  Like an eviction it
+//releases the pointers in the target, which the caller then deletes.
+//The caller holds the lock of obj's shard.
+void swap_space::pack(swap_space::object *obj)
+{
+  serialization_context ctxt(*this, format);
+  std::stringstream sstream;
+  write_format_header(sstream, format);
+  serialize(sstream, ctxt, *obj->target);
+  obj->is_leaf = ctxt.is_leaf;
 
+  std::string image = sstream.str();
+  lz4_compress(image.data(), image.size(), obj->packed);
+  obj->packed.shrink_to_fit();
+  obj->packed_size = image.size();
+  obj->packed_is_dirty = obj->target_is_dirty;
+  obj->target_is_dirty = false;
+  obj->packed_time = next_access_time++;
+  obj->is_packed = true;
+  shard_of(obj->id).packed.push(obj);
+  current_packed_bytes += obj->packed.size();
+  packed_input_bytes += image.size();
+  packed_output_bytes += obj->packed.size();
+}
 
-    // version 0 is the flag that the object exists only in memory.
-    // if (obj->version > 0)
-    //   backstore->deallocate(obj->id, obj->version);
-    obj->version = new_version_id;
-    obj->target_is_dirty = false;
+//drop obj from the compressed tier, writing its image first if the
+//backing store does not have it.  The caller holds the lock of obj's
+//shard.
+void swap_space::unpack_to_store(swap_space::object *obj, std::vector<std::iostream *> &batch)
+{
+  shard_of(obj->id).packed.erase(obj);
+  obj->is_packed = false;
+  current_packed_bytes -= obj->packed.size();
+  if (obj->packed_is_dirty) {
+    auto start = std::chrono::steady_clock::now();
+    std::string image;
+    lz4_decompress(obj->packed.data(), obj->packed.size(), image, obj->packed_size);
+    write_version(obj, image, batch);
+    obj->packed_is_dirty = false;
+    write_back_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
   }
+  std::string().swap(obj->packed);
 }
 
 
+//hand the streams of batch to the backing store
+void swap_space::put_batch(std::vector<std::iostream *> &batch)
+{
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    backstore->put_batch(batch);
+  }
+  write_back_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//pick the next victim and lock its shard in held.  Objects above
+//level 0 are only taken when they exceed the internal reserve or
+//nothing else can be evicted.  Only the evicting thread calls this.
+swap_space::object * swap_space::pick_victim(std::unique_lock<std::mutex> *held)
+{
+  object *obj = NULL;
+  if (spares_internal())
+    obj = pick_victim(held, true);
+  return obj ? obj : pick_victim(held, false);
+}
+
+//LRU takes the least recently used unpinned object of all the
+//shards, looking at each shard's oldest one; CLOCK sweeps the shards
+//in turn.
+swap_space::object * swap_space::pick_victim(std::unique_lock<std::mutex> *held, bool spare_internal)
+{
+  if (replacement == REPLACEMENT_POLICY_CLOCK) {
+    for (int n = 0; n < SWAP_SPACE_SHARDS; n++) {
+      int i = clock_shard++ % SWAP_SPACE_SHARDS;
+      std::unique_lock<std::mutex> guard(shards[i].lock, std::defer_lock);
+      if (!held[i].owns_lock())
+        guard.lock();
+      object *obj = shards[i].policy->pick_victim(spare_internal);
+      if (obj) {
+        if (guard.owns_lock())
+          held[i] = std::move(guard);
+        return obj;
+      }
+    }
+    return NULL;
+  }
+
+  int oldest = -1;
+  uint64_t oldest_access = 0;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::unique_lock<std::mutex> guard(shards[i].lock, std::defer_lock);
+    if (!held[i].owns_lock())
+      guard.lock();
+    object *obj = shards[i].policy->pick_victim(spare_internal);
+    if (obj && (oldest < 0 || obj->last_access < oldest_access)) {
+      oldest = i;
+      oldest_access = obj->last_access;
+    }
+  }
+  if (oldest < 0)
+    return NULL;
+  if (!held[oldest].owns_lock())
+    held[oldest] = std::unique_lock<std::mutex>(shards[oldest].lock);
+  // the shard may have changed since we looked
+  return shards[oldest].policy->pick_victim(spare_internal);
+}
+
+//the oldest object in the compressed tier, with its shard locked in
+//held as for pick_victim()
+swap_space::object * swap_space::pick_packed_victim(std::unique_lock<std::mutex> *held)
+{
+  int oldest = -1;
+  uint64_t oldest_time = 0;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::unique_lock<std::mutex> guard(shards[i].lock, std::defer_lock);
+    if (!held[i].owns_lock())
+      guard.lock();
+    object *obj = shards[i].packed.oldest();
+    if (obj && (oldest < 0 || obj->packed_time < oldest_time)) {
+      oldest = i;
+      oldest_time = obj->packed_time;
+    }
+  }
+  if (oldest < 0)
+    return NULL;
+  if (!held[oldest].owns_lock())
+    held[oldest] = std::unique_lock<std::mutex>(shards[oldest].lock);
+  return shards[oldest].packed.oldest();
+}
+
 //attempt to evict an unused object from the swap space
-//objects in swap space are referenced in a priority queue
-//pull objects with low counts first to try and find an object with pincount 0.
+//the replacement policy picks a resident object with pincount 0.
+//all the victims of one call are written back as a single batch.
+//One thread evicts at a time; the others go on, and the evicting
+//thread keeps going until the swap space is within its budget.
 void swap_space::maybe_evict_something(void)
 {
-  while (current_in_memory_objects > max_in_memory_objects) {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0) {
-        obj = *it;
+  if (!is_over_budget())
+    return;
+  std::unique_lock<std::mutex> evicting(evict_lock, std::try_to_lock);
+  if (!evicting.owns_lock())
+    return;
+
+  auto start = std::chrono::steady_clock::now();
+  // The victims' shards stay locked until the batch is put, so no
+  // thread can load one of the new versions before it is written.
+  std::unique_lock<std::mutex> held[SWAP_SPACE_SHARDS];
+  std::vector<std::iostream *> batch;
+  while (is_over_budget()) {
+    if (!is_memory_over_budget()) {
+      // the compressed tier overflowed
+      object *obj = pick_packed_victim(held);
+      if (obj == NULL)
         break;
-      }
-      
+      unpack_to_store(obj, batch);
+      continue;
+    }
+    object *obj = pick_victim(held);
     if (obj == NULL)
-      return;
-    lru_pqueue.erase(obj);
-
-    write_back(obj);
+      break;
+    shard_of(obj->id).policy->erase(obj);
+
+    eviction_count++;
+    if (obj->target_is_dirty)
+      dirty_eviction_count++;
+    if (max_packed_bytes > 0)
+      pack(obj);
+    else
+      write_back(obj, batch);
     
     delete obj->target; // obj->target is a serializable pointer, set this to NULL means this object is not in memory;
     obj->target = NULL;
     current_in_memory_objects--;
+    release_footprint(obj);
+  }
+  if (!batch.empty()) {
+    put_batch(batch);
+    // the flusher fell behind
+    flusher_wakeup.notify_one();
   }
+  foreground_stall_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
-// Ang : copy a file from sourcePath to destinationPath
-bool swap_space::copy_file(std::string sourcePath, std::string destinationPath) {
-    std::ifstream sourceFile(sourcePath, std::ios::binary);
-    std::ofstream destinationFile(destinationPath, std::ios::binary);
+//the bytes of the version each object was last written as
+uint64_t swap_space::get_live_bytes(void) {
+  uint64_t bytes = 0;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    std::lock_guard<std::mutex> io(io_lock);
+    for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); ++it)
+      if (it->second->version > 0)
+        bytes += backstore->get_version_bytes(it->second->id, it->second->version);
+  }
+  return bytes;
+}
+
+uint64_t swap_space::get_disk_bytes(void) {
+  std::lock_guard<std::mutex> io(io_lock);
+  return backstore->get_disk_bytes();
+}
+
+void swap_space::start_flusher(uint64_t interval_us) {
+  assert(!flusher.joinable());
+  flush_interval = interval_us;
+  flusher_stopping = false;
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    frees_in_background = true;
+  }
+  flusher = std::thread(&swap_space::flusher_main, this);
+}
 
-    if (!sourceFile || !destinationFile) {
-        return false; // Error in opening source or destination file
+void swap_space::stop_flusher(void) {
+  if (!flusher.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> guard(flusher_lock);
+    flusher_stopping = true;
+  }
+  flusher_wakeup.notify_one();
+  flusher.join();
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    frees_in_background = false;
+  }
+  free_dead_versions();
+}
+
+void swap_space::flusher_main(void) {
+  std::unique_lock<std::mutex> guard(flusher_lock);
+  while (!flusher_stopping) {
+    flusher_wakeup.wait_for(guard, std::chrono::microseconds(flush_interval));
+    if (flusher_stopping)
+      break;
+    guard.unlock();
+    if (is_near_budget())
+      flush_cold_objects();
+    free_dead_versions();
+    guard.lock();
+  }
+}
+
+//one pass of the flusher: write back the dirty, unpinned objects among
+//the coldest of each shard, keeping them in memory.  Each shard stays
+//locked until its batch is put, so a flushed object cannot be evicted
+//and its new version loaded before it is written.
+void swap_space::flush_cold_objects(void) {
+  uint64_t depth = 0;
+  std::vector<object *> cold;
+  std::vector<std::iostream *> batch;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    cold.clear();
+    replacement_policy *policy = shards[i].policy;
+    policy->cold_objects(cold, std::max<uint64_t>(1, policy->size() / SWAP_SPACE_FLUSH_WINDOW));
+    for (auto it = cold.begin(); it != cold.end(); ++it)
+      if ((*it)->target_is_dirty && (*it)->pincount == 0)
+        write_back(*it, batch, false);
+    if (!batch.empty()) {
+      depth += batch.size();
+      flush_count += batch.size();
+      put_batch(batch);
+      batch.clear();
     }
+  }
+  flush_passes++;
+  flush_queue_depth_sum += depth;
+  uint64_t max = flush_queue_depth_max;
+  while (depth > max && !flush_queue_depth_max.compare_exchange_weak(max, depth))
+    ;
+}
 
-    destinationFile << sourceFile.rdbuf();
-    return true;
+//free a version nothing refers to any more.  A version recorded by the
+//last checkpoint is kept until the next checkpoint is committed, since
+//recovery would need it.  While the flusher runs it frees the others,
+//off the foreground threads.
+void swap_space::release_version(object *obj, uint64_t version) {
+  std::lock_guard<std::mutex> io(io_lock);
+  if (version == obj->checkpointed_version) {
+    deferred_frees.push_back(std::make_pair(obj->id, version));
+  } else if (frees_in_background) {
+    dead_versions.push_back(std::make_pair(obj->id, version));
+  } else {
+    backstore->deallocate(obj->id, version);
+    freed_version_count++;
+  }
 }
 
+//free the versions release_version() queued for the flusher
+void swap_space::free_dead_versions(void) {
+  std::vector<std::pair<uint64_t, uint64_t>> dead;
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    dead.swap(dead_versions);
+  }
+  // one at a time, so loads are not held up behind all of them
+  for (auto it = dead.begin(); it != dead.end(); ++it) {
+    std::lock_guard<std::mutex> io(io_lock);
+    backstore->deallocate(it->first, it->second);
+    freed_version_count++;
+  }
+}
 
-// kosumi: modify swap_space::maybe_evict_something to flush the whole tree
-// Ang : flush the in memory betree nodes to disk, the node files can be found at destinationDirectory
-// in this project the path of destinationDirectory is tmpdir_backup
-void swap_space::flush_whole_tree(std::string destinationDirectory) {
-  object *obj = NULL;
-  // std::cout << "In flush whole tree()" << std::endl;
-  // print_objects_id();
-  // print_lru_pqueue_id();
-
-  for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it) {
-    obj = *it;  
-    if (obj == NULL){
-      return;
+//write back every dirty object as one batch and make all written
+//versions durable.  Clean objects are not touched and nothing is
+//evicted, so a checkpoint only costs what changed since the last one.
+void swap_space::write_back_dirty_objects(void) {
+  // nothing is evicted, and so no new version loaded, before the
+  // batch is put
+  std::lock_guard<std::mutex> evicting(evict_lock);
+  std::vector<std::iostream *> batch;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    for (object *obj = shards[i].policy->first(); obj != NULL; obj = obj->next_resident)
+      if (obj->target_is_dirty)
+        write_back(obj, batch, false);
+    // compressed images stay in the tier, now clean
+    for (object *obj = shards[i].packed.oldest(); obj != NULL; obj = shards[i].packed.next(obj)) {
+      if (obj->packed_is_dirty) {
+        std::string image;
+        lz4_decompress(obj->packed.data(), obj->packed.size(), image, obj->packed_size);
+        write_version(obj, image, batch);
+        obj->packed_is_dirty = false;
+      }
     }
-      
-    // Ang :Cannot erase object in the for loop, it will change the size of lru_pqueue
-    // and lead to segment fault;
-    // lru_pqueue.erase(obj); 
-    write_back(obj);
-
-    //Ang: I need to copy the node file from tmpdir to tmpdir_backup, 
-    // as I found for some unknow reason some of the node files stored in the tmpdir directory will disappear after the whole program finish
-    // when I used gdb to debug this problem I found some destructor functions were called before the main() exit
-    // this might be the reason.
-    std::string sourcePath = backstore->get_filename(obj->id, obj->version);
-    std::string destinationPath = destinationDirectory + "/" + std::to_string(obj->id) + "_" + std::to_string(obj->version);
-    copy_file(sourcePath, destinationPath);
-
-    delete obj->target; // Ang : obj->target is a serializable pointer, set this to NULL means this object is not in memory;
-    obj->target = NULL;
-    current_in_memory_objects--;
-  
   }
-  // clear all the entries in lru_pqueue;
-  lru_pqueue.clear();
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    backstore->put_batch(batch);
+    backstore->sync();
+  }
+  write_back_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//the objects table is now recorded durably as the latest checkpoint
+void swap_space::checkpoint_committed(void) {
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    for (auto it = deferred_frees.begin(); it != deferred_frees.end(); ++it)
+      backstore->deallocate(it->first, it->second);
+    freed_version_count += deferred_frees.size();
+    deferred_frees.clear();
+  }
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); ++it)
+      it->second->checkpointed_version = it->second->version;
+  }
+}
+
+//replace the objects table with the one recorded in manifest and
+//drop every version the checkpoint does not refer to
+void swap_space::restore_checkpoint(std::istream &manifest) {
+  clear_lru_pqueue();
+  deserialize_objects(manifest);
+
+  std::set<std::pair<uint64_t, uint64_t>> versions;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); ++it) {
+      it->second->checkpointed_version = it->second->version;
+      versions.insert(std::make_pair(it->second->id, it->second->version));
+    }
+  }
+  {
+    std::lock_guard<std::mutex> io(io_lock);
+    backstore->retain_only(versions);
+    deferred_frees.clear();
+    dead_versions.clear();
+  }
+  next_id = get_max_objects_id() + 1;
 }
 
 // the root node of betree should be the node with the largest object->id
@@ -235,94 +858,86 @@ void swap_space::flush_whole_tree(std::string destinationDirectory) {
   
 // }
 
-// flush swap_space.objects from memory to disk
-void swap_space::serialize_objects(std::string filePath) {
-  if (filePath.empty()) {
-    filePath = "ss_objects.txt";
-  }
-
-  std::ofstream serialized_objects_stream(filePath, std::ofstream::out); // Open in overwrite mode
-  if (serialized_objects_stream) {
-    for (auto it = objects.begin(); it != objects.end(); it++) {
-      // std::cout << "In serialize_objects(), obj->id: " << it->first << std::endl;
-      serialized_objects_stream << "obj_id " << it->first << std::endl;
-      serialized_objects_stream << "object->id " << it->second->id << std::endl;
-      serialized_objects_stream << "object->version " << it->second->version << std::endl;
-      serialized_objects_stream << "object->is_leaf " << it->second->is_leaf << std::endl;
-      serialized_objects_stream << "object->refcount " << it->second->refcount << std::endl;
-      serialized_objects_stream << "object->last_access " << it->second->last_access << std::endl;
-      serialized_objects_stream << "object->target_is_dirty " << it->second->target_is_dirty << std::endl;
-      serialized_objects_stream << "object->pincount " << it->second->pincount << std::endl;
+// write swap_space.objects to os
+void swap_space::serialize_objects(std::ostream &os) {
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); it++) {
+      os << "obj_id " << it->first << std::endl;
+      os << "object->id " << it->second->id << std::endl;
+      os << "object->version " << it->second->version << std::endl;
+      os << "object->is_leaf " << it->second->is_leaf << std::endl;
+      os << "object->level " << it->second->level << std::endl;
+      os << "object->refcount " << it->second->refcount.load() << std::endl;
+      os << "object->last_access " << it->second->last_access << std::endl;
+      os << "object->target_is_dirty " << it->second->target_is_dirty << std::endl;
+      os << "object->pincount " << it->second->pincount.load() << std::endl;
     }
-  } else {
-    std::cerr << "Error creating the file: serialized_objects." << std::endl;
   }
-
-  serialized_objects_stream.close();
 }
 
-// Deserialize objects from a file and load them into memory
-void swap_space::deserialize_objects(std::string filePath) {
-    if (filePath.empty()) {
-        filePath = "ss_objects.txt";
+// Deserialize objects from is and load them into memory.  Lines that
+// do not describe an object are skipped.
+void swap_space::deserialize_objects(std::istream &is) {
+  clear_objects(); // Clear existing objects in memory
+  // none of the deserialized objects is in memory yet
+  current_in_memory_objects = 0;
+  current_in_memory_bytes = 0;
+  current_internal_objects = 0;
+  current_internal_bytes = 0;
+
+  std::string line;
+  int current_obj_id = -1; // Track the current object's ID
+  object* current_object = nullptr;
+
+  while (std::getline(is, line)) {
+    // Parse lines from the file
+    std::istringstream iss(line);
+    std::string token;
+    iss >> token;
+
+    if (token == "obj_id") {
+      iss >> current_obj_id;
+      current_object = new object();
+    }
+    else if (current_object) {
+      if (token == "object->id") {
+        iss >> current_object->id;
+      }
+      else if (token == "object->version") {
+        iss >> current_object->version;
+      }
+      else if (token == "object->is_leaf") {
+        iss >> current_object->is_leaf;
+      }
+      else if (token == "object->level") {
+        iss >> current_object->level;
+      }
+      else if (token == "object->refcount") {
+        uint64_t refcount;
+        iss >> refcount;
+        current_object->refcount = refcount;
+      }
+      else if (token == "object->last_access") {
+        iss >> current_object->last_access;
+      }
+      else if (token == "object->target_is_dirty") {
+        iss >> current_object->target_is_dirty;
+      }
+      else if (token == "object->pincount") {
+        uint64_t pincount;
+        iss >> pincount;
+        current_object->pincount = pincount;
+      }
     }
 
-    std::ifstream deserialized_objects_stream(filePath);
-    
-    if (deserialized_objects_stream) {
-        objects.clear(); // Clear existing objects in memory
-        
-        std::string line;
-        int current_obj_id = -1; // Track the current object's ID
-        object* current_object = nullptr;
-
-        while (std::getline(deserialized_objects_stream, line)) {
-            // Parse lines from the file
-            std::istringstream iss(line);
-            std::string token;
-            iss >> token;
-
-            if (token == "obj_id") {
-                iss >> current_obj_id;
-                // std::cout << "In deserialize_objects(), current_obj_id: " << current_obj_id << std::endl;
-                current_object = new object();
-            }
-            else if (current_object) {
-                if (token == "object->id") {
-                    iss >> current_object->id;
-                    // std::cout << "In deserialize_objects(), current_object->id: " << current_object->id << std::endl;
-                }
-                else if (token == "object->version") {
-                    iss >> current_object->version;
-                    // std::cout << "In deserialize_objects(), current_object->version: " << current_object->version << std::endl;
-                }
-                else if (token == "object->is_leaf") {
-                    iss >> current_object->is_leaf;
-                }
-                else if (token == "object->refcount") {
-                    iss >> current_object->refcount;
-                }
-                else if (token == "object->last_access") {
-                    iss >> current_object->last_access;
-                }
-                else if (token == "object->target_is_dirty") {
-                    iss >> current_object->target_is_dirty;
-                }
-                else if (token == "object->pincount") {
-                    iss >> current_object->pincount;
-                }
-            }
-
-            if (current_obj_id != -1 && current_object && current_object->pincount != -1) {
-                // Store the deserialized object in the objects map
-                objects[current_obj_id] = current_object;
-                current_obj_id = -1;
-                current_object = nullptr;
-            }
-        }
-    } else {
-        std::cerr << "Error opening the file for deserialization." << std::endl;
+    if (current_obj_id != -1 && current_object && current_object->pincount != (uint64_t)-1) {
+      // Store the deserialized object in the objects map
+      shard &s = shard_of(current_obj_id);
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.objects[current_obj_id] = current_object;
+      current_obj_id = -1;
+      current_object = nullptr;
     }
-    
-    deserialized_objects_stream.close();
+  }
 }
@@ -46,9 +46,12 @@
 // Objects are automatically garbage collected.  The garbage collector
 // uses reference counting.
 
-// The current system uses LRU to select items to swap.  The swap
-// space has a user-specified in-memory cache size it.  The cache size
-// can be adjusted dynamically.
+// The policy used to select items to swap is chosen when the swap
+// space is constructed: LRU (the default) or CLOCK.  Both keep the
+// in-memory objects on an intrusive doubly-linked list, so recording
+// an access is O(1) and never allocates.  The swap space has a
+// user-specified in-memory cache size it.  The cache size can be
+// adjusted dynamically.
 
 // Don't try to get your hands on an unwrapped pointer to the object
 // or anything that is swapped in/out as part of the object.  It can
@@ -63,9 +66,53 @@
 // a few basic types and STL containers.  Feel free to add more and
 // submit patches as you need them.
 
-// The current implementation serializes to a textual file format.
-// This is just a convenience.  It would be nice to be able to swap in
-// different formats.
+// Objects can be serialized in two formats, chosen per swap_space:
+// the original textual format, and a compact binary format in which
+// integers are 8-byte little-endian, strings are prefixed by a 4-byte
+// little-endian length and containers by an 8-byte element count.
+// Binary objects start with a header (BINARY_FORMAT_MAGIC followed by
+// a 4-byte little-endian format version), so load() can tell the
+// formats apart and objects written in either format can always be
+// read back.
+
+// A swap_space can be shared by several threads.  The objects table
+// is split into SWAP_SPACE_SHARDS shards by object id, each with its
+// own lock, hash table and replacement list, so pins, unpins and
+// accesses of objects in different shards do not contend.  A shard's
+// lock guards its table, its list and the residency, dirtiness and
+// footprint of its objects.  Objects are read and deserialized
+// without it, since deserializing a node copies pointers into other
+// shards.  Pin and reference counts are atomic: adding a reference
+// only looks the object up, and a pin caches the object so a
+// dereference takes the shard lock once.  No thread waits for a shard
+// lock while holding another one, except the one thread evicting at a
+// time, and no thread holding a shard lock waits for it, so there is
+// no lock order to get wrong.  The backing store is called under its
+// own lock.  The cache budgets are global: LRU evicts the least
+// recently used unpinned object over all the shards, CLOCK sweeps the
+// shards in turn.
+//
+// Eviction writes a dirty victim back before dropping it, which the
+// thread that triggered it waits for.  An optional background flusher
+// (start_flusher()) writes back the dirty, unpinned objects among the
+// coldest 1/SWAP_SPACE_FLUSH_WINDOW of each shard's replacement order
+// while the swap space is that close to its budget, so eviction
+// usually finds a clean victim it can drop at once.  Flushed objects
+// stay in memory, and their shard stays locked until the new versions
+// are put, as for eviction.
+//
+// With a compressed tier (set_compressed_cache_bytes()), eviction
+// keeps the victim's serialized image, compressed with lz4_block.hpp,
+// in memory instead of writing it, and a later access decompresses it
+// instead of reading the backing store.  Only when the compressed
+// images outgrow their own byte budget are the oldest dropped, and
+// written back first if they hold changes the backing store has not
+// seen.  Checkpoints write those changes too.  The flusher only looks
+// at the uncompressed tier.
+//
+// An object's contents are not guarded: a pinned object is never
+// evicted, but callers must not modify an object while another thread
+// reads it (the betree guarantees this with its node latches).
 
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
@@ -82,21 +129,80 @@
 #include <string>
 #include <algorithm>
 #include <unistd.h> 
+#include <vector>
+#include <future>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <stdexcept>
+#include <cctype>
+#include <thread>
 #include "backing_store.hpp"
+#include "sorted_array_map.hpp"
+#include "lz4_block.hpp"
 #include "debug.hpp"
 
 class swap_space;
 
+#define REPLACEMENT_POLICY_LRU (0)
+#define REPLACEMENT_POLICY_CLOCK (1)
+
+#define SWAP_SPACE_SHARDS (16)
+#define SWAP_SPACE_FLUSH_WINDOW (4)
+
+#define SERIALIZATION_FORMAT_TEXT (0)
+#define SERIALIZATION_FORMAT_BINARY (1)
+
+// The text format never starts with a NUL byte.
+#define BINARY_FORMAT_MAGIC "\0BEB"
+#define BINARY_FORMAT_MAGIC_SIZE (4)
+// Text images start with "version: <n>".  Those written before version
+// 4 start with the node itself and are read as version 3.
+#define TEXT_FORMAT_MAGIC "version:"
+#define TEXT_FORMAT_UNMARKED_VERSION (3)
+// Version 2 added the node filter, version 3 the node's pivot_bound,
+// version 4 each child's pivot count.  Version 2 images are still
+// read; older ones are rejected.
+#define SERIALIZATION_FORMAT_VERSION (4)
+#define SERIALIZATION_FORMAT_OLDEST_VERSION (2)
+
 class serialization_context {
 public:
-  serialization_context(swap_space &sspace) :
+  serialization_context(swap_space &sspace, int fmt = SERIALIZATION_FORMAT_TEXT) :
     ss(sspace),
-    is_leaf(true)
+    is_leaf(true),
+    format(fmt),
+    version(SERIALIZATION_FORMAT_VERSION),
+    releases_pointers(true)
   {}
   swap_space &ss;
   bool is_leaf;
+  int format;
+  // The format version being read.  Writes always use the current
+  // one.
+  uint64_t version;
+  // Serializing a pointer normally hands its reference over to the
+  // on-disk image, because the in-memory target is about to be deleted.
+  // Write-backs that keep the target in memory clear this.
+  bool releases_pointers;
+
+  bool is_binary(void) const {
+    return format == SERIALIZATION_FORMAT_BINARY;
+  }
 };
 
+// Write the header of format fmt.
+void write_format_header(std::iostream &fs, int fmt);
+// Consume the header, if any, and set context's format and version to
+// those of the stream.  Throws std::runtime_error for a version this
+// build cannot read.
+void read_format_header(std::iostream &fs, serialization_context &context);
+// Skip whitespace and tell whether any text is left, without setting
+// fs's state bits (the stores' streams throw at end of file).  Lets
+// text readers recognize images written before a field was added.
+bool has_more_text(std::iostream &fs);
+
 class serializable {
 public:
   virtual void _serialize(std::iostream &fs, serialization_context &context) = 0;
@@ -114,10 +220,20 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
 // kosumi: map serialization
-template<class Key, class Value> void serialize(std::iostream &fs,
-						serialization_context &context,
-						std::map<Key, Value> &mp)
+// Shared by std::map and sorted_array_map, which serialize identically.
+template<class Map> void serialize_map(std::iostream &fs,
+                                       serialization_context &context,
+                                       Map &mp)
 {
+  if (context.is_binary()) {
+    serialize(fs, context, (uint64_t)mp.size());
+    for (auto it = mp.begin(); it != mp.end(); ++it) {
+      serialize(fs, context, it->first);
+      serialize(fs, context, it->second);
+    }
+    return;
+  }
+
   fs << "map " << mp.size() << " {" << std::endl;
   assert(fs.good());
   for (auto it = mp.begin(); it != mp.end(); ++it) {
@@ -130,10 +246,25 @@ template<class Key, class Value> void serialize(std::iostream &fs,
   fs << "}" << std::endl;
 }
 
-template<class Key, class Value> void deserialize(std::iostream &fs,
-						  serialization_context &context,
-						  std::map<Key, Value> &mp)
+template<class Map> void deserialize_map(std::iostream &fs,
+                                         serialization_context &context,
+                                         Map &mp)
 {
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  if (context.is_binary()) {
+    uint64_t size = 0;
+    deserialize(fs, context, size);
+    for (uint64_t i = 0; i < size; i++) {
+      Key k;
+      Value v;
+      deserialize(fs, context, k);
+      deserialize(fs, context, v);
+      mp.emplace_hint(mp.end(), k, v);
+    }
+    return;
+  }
+
   std::string dummy;
   int size = 0;
   fs >> dummy >> size >> dummy;
@@ -149,9 +280,38 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
   fs >> dummy;
 }
 
+template<class Key, class Value> void serialize(std::iostream &fs,
+						serialization_context &context,
+						std::map<Key, Value> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template<class Key, class Value> void deserialize(std::iostream &fs,
+						  serialization_context &context,
+						  std::map<Key, Value> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
+template<class Key, class Value> void serialize(std::iostream &fs,
+						serialization_context &context,
+						sorted_array_map<Key, Value> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template<class Key, class Value> void deserialize(std::iostream &fs,
+						  serialization_context &context,
+						  sorted_array_map<Key, Value> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
 template<class X> void serialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  fs << "pointer ";
+  if (!context.is_binary())
+    fs << "pointer ";
   serialize(fs, context, *x);
 }
 
@@ -159,8 +319,10 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
 {
   std::string dummy;
   x = new X;
-  fs >> dummy;
-  assert (dummy == "pointer");
+  if (!context.is_binary()) {
+    fs >> dummy;
+    assert (dummy == "pointer");
+  }
   deserialize(fs, context, *x);
 }
 
@@ -174,32 +336,105 @@ template<class X> void deserialize(std::iostream &fs, serialization_context &con
   x._deserialize(fs, context);
 }
 
+// Approximate number of bytes of memory used by a value, including
+// sizeof the value itself.  The swap space charges every in-memory
+// object its footprint against the cache's byte budget.  Like
+// serialization, classes provide _footprint() and we provide the
+// basic types and STL containers.
+#define MAP_NODE_OVERHEAD (32) // red-black tree links and color of a std::map node
+
+inline uint64_t footprint(uint64_t x) { return sizeof(x); }
+inline uint64_t footprint(int64_t x) { return sizeof(x); }
+uint64_t footprint(const std::string &x);
+
+template<class X> uint64_t footprint(const X &x)
+{
+  return x._footprint();
+}
+
+template<class Key, class Value> uint64_t footprint(const std::map<Key, Value> &mp)
+{
+  uint64_t bytes = sizeof(mp);
+  for (auto it = mp.begin(); it != mp.end(); ++it)
+    bytes += MAP_NODE_OVERHEAD + footprint(it->first) + footprint(it->second);
+  return bytes;
+}
+
+template<class Key, class Value> uint64_t footprint(const sorted_array_map<Key, Value> &mp)
+{
+  uint64_t bytes = sizeof(mp) + mp.capacity() * sizeof(typename sorted_array_map<Key, Value>::value_type);
+  for (auto it = mp.begin(); it != mp.end(); ++it)
+    bytes += footprint(it->first) - sizeof(it->first) + footprint(it->second) - sizeof(it->second);
+  return bytes;
+}
+
 class swap_space {
+private:
+  class object;
+  class shard;
+
 public:
-  swap_space(backing_store *bs, uint64_t n);
+  swap_space(backing_store *bs, uint64_t n, int fmt = SERIALIZATION_FORMAT_TEXT,
+             int replacement = REPLACEMENT_POLICY_LRU);
+  ~swap_space(void);
 
   template<class Referent> class pointer;
-  bool copy_file(std::string sourcePath, std::string destinationPath); // Ang: define copyFile()
-  void flush_whole_tree(std::string destinationDirectory); // Ang:  set flush_whole_tree as a public function
   std::string get_betree_root_name(uint64_t root_id);
-  void serialize_objects(std::string destinationDirectory); // flush the information in swap_space::objects to disk
-  void deserialize_objects(std::string filePath); // deserialize swap_space::objects from disk to memory
-  void clear_objects() {objects.clear();};
-  void clear_lru_pqueue() {lru_pqueue.clear();};
+
+  // Checkpoints.  A checkpoint is the set of versions in the objects
+  // table, recorded in a manifest instead of copying any node.
+  // write_back_dirty_objects() writes back the dirty objects, which
+  // stay in memory, and syncs the backing store; the caller then
+  // records the table with serialize_objects() and, once that record
+  // is durable, calls checkpoint_committed().  Versions the previous
+  // checkpoint still needs are only deallocated at that point, so a
+  // failed sync, which throws, must abort the checkpoint before it.
+  // restore_checkpoint() reads the table back and drops every version
+  // written after it.
+  void write_back_dirty_objects(void);
+  void checkpoint_committed(void);
+  void restore_checkpoint(std::istream &manifest);
+  void serialize_objects(std::ostream &os); // write the information in swap_space::objects to os
+  void deserialize_objects(std::istream &is); // deserialize swap_space::objects from is to memory
+  void clear_objects() {
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      shards[i].objects.clear();
+    }
+  };
+  void clear_lru_pqueue() {
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      shards[i].policy->clear();
+      shards[i].packed.clear();
+    }
+    current_packed_bytes = 0;
+  };
 
   int get_objects_size() {
-    return objects.size();
+    int size = 0;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      size += shards[i].objects.size();
+    }
+    return size;
   }
 
   void print_objects_id() {
-    for (auto it  = objects.begin(); it != objects.end(); it++) {
-      std::cout << "objects, object id: " << it->first << std::endl;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (auto it  = shards[i].objects.begin(); it != shards[i].objects.end(); it++) {
+        std::cout << "objects, object id: " << it->first << std::endl;
+      }
     }
   }
 
   void print_lru_pqueue_id() {
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); it++) {
-      std::cout << "lru_pq, object id: " << (*it)->id << std::endl;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (object *it = shards[i].policy->first(); it != NULL; it = it->next_resident) {
+        std::cout << "lru_pq, object id: " << it->id << std::endl;
+      }
     }
   }
 
@@ -211,11 +446,96 @@ public:
     next_access_time = new_access_time;
   }
 
+  // format used for objects written from now on
+  void set_serialization_format(int fmt) {
+    format = fmt;
+  }
+
+  int get_serialization_format(void) {
+    return format;
+  }
+
+  // I/O statistics, times are in microseconds
+  uint64_t get_write_back_count(void) { return write_back_count; }
+  uint64_t get_write_back_bytes(void) { return write_back_bytes; }
+  uint64_t get_write_back_time(void) { return write_back_time; }
+  uint64_t get_load_count(void) { return load_count; }
+  uint64_t get_load_time(void) { return load_time; }
+  // Space on disk.  A write-back frees the version it supersedes, and
+  // so does freeing an object, except that a version the last
+  // checkpoint refers to is kept until the next one commits.  The
+  // flusher, while it runs, does these frees in the background.  Live
+  // bytes are those of the objects' current versions.
+  uint64_t get_live_bytes(void);
+  uint64_t get_disk_bytes(void);
+  uint64_t get_freed_version_count(void) { return freed_version_count; }
+  uint64_t get_deferred_free_count(void) {
+    std::lock_guard<std::mutex> io(io_lock);
+    return deferred_frees.size();
+  }
+
+  // Byte budget of the compressed tier, 0 (the default) means there is
+  // none and victims go straight to the backing store.
+  void set_compressed_cache_bytes(uint64_t bytes);
+  uint64_t get_compressed_cache_bytes(void) { return max_packed_bytes; }
+  uint64_t get_current_compressed_bytes(void) { return current_packed_bytes; }
+  // bytes of the images that entered the compressed tier, before and
+  // after compression
+  uint64_t get_compressed_input_bytes(void) { return packed_input_bytes; }
+  uint64_t get_compressed_output_bytes(void) { return packed_output_bytes; }
+  // accesses that found the target in memory, found it compressed,
+  // and had to read it from the backing store
+  uint64_t get_memory_hits(void) { return sum_over_shards(&shard::memory_hits); }
+  uint64_t get_compressed_hits(void) { return sum_over_shards(&shard::packed_hits); }
+  uint64_t get_store_reads(void) { return sum_over_shards(&shard::store_reads); }
+  uint64_t get_prefetch_count(void) { return sum_over_shards(&shard::prefetches); }
+  uint64_t get_prefetched_reads(void) { return sum_over_shards(&shard::prefetched_reads); }
+
+  uint64_t get_eviction_count(void) { return eviction_count; }
+  uint64_t get_dirty_eviction_count(void) { return dirty_eviction_count; }
+  // time the threads that triggered eviction spent evicting
+  uint64_t get_foreground_stall_time(void) { return foreground_stall_time; }
+
+  // Start the background flusher, which looks for cold dirty objects
+  // every interval_us microseconds, and sooner after an eviction had
+  // to write a victim back.  stop_flusher() waits for it to finish.
+  void start_flusher(uint64_t interval_us);
+  void stop_flusher(void);
+  // objects written by the flusher, and the passes that looked
+  uint64_t get_flush_count(void) { return flush_count; }
+  uint64_t get_flush_passes(void) { return flush_passes; }
+  // dirty objects a pass found to write: the total and the largest
+  uint64_t get_flush_queue_depth_sum(void) { return flush_queue_depth_sum; }
+  uint64_t get_flush_queue_depth_max(void) { return flush_queue_depth_max; }
+
+  // Byte budget for the in-memory objects, 0 means no byte budget.
+  // Objects are evicted while either the object count or the bytes
+  // are over their limit.
+  void set_cache_bytes(uint64_t bytes);
+  uint64_t get_cache_bytes(void) { return max_in_memory_bytes; }
+  uint64_t get_current_in_memory_bytes(void) { return current_in_memory_bytes; }
+  uint64_t get_peak_in_memory_bytes(void) { return peak_in_memory_bytes; }
+
+  // Fraction of the budget reserved for objects whose level hint (see
+  // pointer::set_level()) is above 0.  While those objects take no
+  // more than this fraction of the object count and of the bytes,
+  // eviction only picks them when nothing else is unpinned.  0, the
+  // default, treats every level alike.
+  void set_internal_reserve(double fraction);
+  double get_internal_reserve(void) { return internal_reserve; }
+  uint64_t get_current_internal_objects(void) { return current_internal_objects; }
+  uint64_t get_current_internal_bytes(void) { return current_internal_bytes; }
+  // accesses to objects above level 0 that did not find them in memory
+  uint64_t get_internal_misses(void) { return sum_over_shards(&shard::internal_misses); }
+
   uint64_t get_max_objects_id() {
     uint64_t max_id = 0;
-    for (auto it = objects.begin(); it != objects.end(); it++) {
-      if (it->first > max_id) {
-        max_id = it->first;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); it++) {
+        if (it->first > max_id) {
+          max_id = it->first;
+        }
       }
     }
     return max_id;
@@ -236,32 +556,39 @@ public:
   class pin {
   public:
     const Referent * operator->(void) const {
-      assert(ss->objects.count(target) > 0); debug(std::cout << "Accessing (constly) " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, false);
-      return (const Referent *)ss->objects[target]->target;
+      debug(std::cout << "Accessing (constly) " << target
+	    << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      return (const Referent *)access(false);
     }
 
     Referent * operator->(void) {
-      assert(ss->objects.count(target) > 0);
       debug(std::cout << "Accessing " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, true);
-      return (Referent *)ss->objects[target]->target;
+	    << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      return (Referent *)access(true);
     }
 
     pin(const pointer<Referent> *p)
       : ss(NULL),
-	    target(0)
+	    target(0),
+	    obj(NULL)
     {
-      dopin(p->ss, p->target);
+      dopin(p->ss, p->target, NULL);
     }
 
     pin(void)
       : ss(NULL),
-	    target(0)
+	    target(0),
+	    obj(NULL)
     {}
 
+    pin(const pin &other)
+      : ss(NULL),
+	    target(0),
+	    obj(NULL)
+    {
+      dopin(other.ss, other.target, other.obj);
+    }
+
     ~pin(void) {
       unpin();
     }
@@ -269,52 +596,63 @@ public:
     pin &operator=(const pin &other) {
       if (&other != this) {
         unpin();
-        dopin(other.ss, other.target);
+        dopin(other.ss, other.target, other.obj);
       }
+      return *this;
     }
     
   private:
 
     //called when pointer no longer accessed - remove pincount and maybe evict from cache.
     void unpin(void) {
-      debug(std::cout << "Unpinning " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
       if (target > 0) {
-        assert(ss->objects.count(target) > 0);
-        ss->objects[target]->pincount--;
+        debug(std::cout << "Unpinning " << target
+	      << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+        // nothing to measure: drop the pin without the shard lock
+        if (!obj->footprint_is_stale) {
+          obj->pincount--;
+        } else {
+          std::lock_guard<std::mutex> guard(ss->shard_of(target).lock);
+          obj->pincount--;
+          // the object may have grown or shrunk while it was pinned
+          if (obj->pincount == 0 && obj->footprint_is_stale)
+            ss->measure<Referent>(obj);
+        }
         ss->maybe_evict_something();
       }
       ss = NULL;
       target = 0;
+      obj = NULL;
     }
 
-    //Called when creating pin type - assert target exists, then force load in ss.
-    void dopin(swap_space *newss, uint64_t newtarget) {
+    //Called when creating pin type - assert target exists, then start loading it.
+    //pinned is the object when the caller already knows it.
+    void dopin(swap_space *newss, uint64_t newtarget, object *pinned) {
       assert(ss == NULL && target == 0);
       ss = newss;
       target = newtarget;
       if (target > 0) {
-        assert(ss->objects.count(target) > 0);
+        shard &s = ss->shard_of(target);
+        std::unique_lock<std::mutex> guard(s.lock);
+        obj = pinned ? pinned : ss->find(s, target);
         debug(std::cout << "Pinning " << target
-              << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-        ss->objects[target]->pincount++;
+              << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+        obj->pincount++;
+        // Start reading the object now; access() waits for it.
+        ss->start_load(obj, guard);
       }
     }
     
     //Called when accessing object, forces load - requires object to be pinned.
-    void access(uint64_t tgt, bool dirty) const {
-      assert(ss->objects.count(tgt) > 0);
-      object *obj = ss->objects[tgt];
-      ss->lru_pqueue.erase(obj);
-      obj->last_access = ss->next_access_time++;
-      ss->lru_pqueue.insert(obj);
-      obj->target_is_dirty |= dirty;
-      ss->load<Referent>(tgt);
+    serializable * access(bool dirty) const {
+      serializable *t = ss->access<Referent>(obj, dirty);
       ss->maybe_evict_something();
+      return t;
     }
   
     swap_space *ss;
     uint64_t target;
+    object *obj;
   };
   
   //pointer wrapper that allows for ss control
@@ -332,10 +670,18 @@ public:
     pointer(const pointer &other) {
       ss = other.ss;
       target = other.target;
-      if (target > 0) {
-        assert(ss->objects.count(target) > 0);
-        ss->objects[target]->refcount++;
-      }
+      if (target > 0)
+        ss->lookup(target)->refcount++;
+    }
+
+    // Moving a pointer hands over its reference without touching the
+    // refcount, which keeps array-based containers of pointers cheap
+    // to shift.
+    pointer(pointer &&other) noexcept :
+      ss(other.ss),
+      target(other.target)
+    {
+      other.target = 0;
     }
 
     pointer(swap_space* ss, uint64_t target) :
@@ -350,28 +696,45 @@ public:
     void depoint(void) {
       if (target == 0)
 	      return;
-      assert(ss->objects.count(target) > 0);
-
-      object *obj = ss->objects[target];
+      object *obj = ss->lookup(target);
       assert(obj->refcount > 0);
       if ((--obj->refcount) == 0) {
-        debug(std::cout << "Erasing " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+        debug(std::cout << "Erasing " << target << " id " << obj->id << " version " << obj->version << std::endl);
+        {
+          shard &s = ss->shard_of(target);
+          std::lock_guard<std::mutex> guard(s.lock);
+          s.objects.erase(target);
+          s.policy->erase(obj);
+          // load() below still uses the image
+          if (obj->is_packed) {
+            s.packed.erase(obj);
+            obj->is_packed = false;
+            ss->current_packed_bytes -= obj->packed.size();
+          }
+        }
+        // Nothing can reach obj any more, so the rest needs no shard
+        // lock, and freeing its children may take other shards' locks.
         // Load it into memory so we can recursively free stuff
         if (obj->target == NULL) {
-          assert(obj->version > 0);
+          assert(obj->version > 0 || !obj->packed.empty());
           if (!obj->is_leaf) {
-            ss->load<Referent>(target);
+            ss->load<Referent>(obj);
           } else {
-            debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+            debug(std::cout << "Skipping load of leaf " << target << " id " << obj->id << " version " << obj->version << std::endl);
           }
         }
-        ss->objects.erase(target);
-        ss->lru_pqueue.erase(obj);
-        if (obj->target)
+        if (obj->pending_load.valid()) {
+          std::iostream *in = obj->pending_load.get();
+          std::lock_guard<std::mutex> io(ss->io_lock);
+          ss->backstore->put(in);
+        }
+        if (obj->target) {
           delete obj->target;
-        ss->current_in_memory_objects--;
+          ss->current_in_memory_objects--;
+        }
+        ss->release_footprint(obj);
         if (obj->version > 0)
-          ss->backstore->deallocate(obj->id, obj->version);
+          ss->release_version(obj, obj->version);
         delete obj;
       }
       target = 0;
@@ -382,10 +745,18 @@ public:
         depoint();
         ss = other.ss;
         target = other.target;
-        if (target > 0) {
-          assert(ss->objects.count(target) > 0);
-          ss->objects[target]->refcount++;
-        }
+        if (target > 0)
+          ss->lookup(target)->refcount++;
+      }
+      return *this;
+    }
+
+    pointer & operator=(pointer &&other) {
+      if (&other != this) {
+        depoint();
+        ss = other.ss;
+        target = other.target;
+        other.target = 0;
       }
       return *this;
     }
@@ -419,21 +790,62 @@ public:
       return pin<Referent>(this);
     }
     
+    // Hint that the object will be pinned soon: start reading it from
+    // the store, so the read overlaps with whatever the caller does
+    // first.  Does nothing if the object is in memory, compressed, or
+    // already being read, or if the store cannot read in the
+    // background, where it would only block the caller earlier.
+    void prefetch(void) const {
+      if (target == 0 || !ss->backstore->reads_asynchronously())
+        return;
+      shard &s = ss->shard_of(target);
+      std::unique_lock<std::mutex> guard(s.lock);
+      object *obj = ss->find(s, target);
+      if (ss->start_load(obj, guard)) {
+        obj->load_is_prefetched = true;
+        s.prefetches++;
+      }
+    }
+
     bool is_in_memory(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target != NULL;
+      shard &s = ss->shard_of(target);
+      std::lock_guard<std::mutex> guard(s.lock);
+      return target > 0 && ss->find(s, target)->target != NULL;
+    }
+
+    // The level hint: 0 for the objects that are cheapest to lose,
+    // higher for the ones more of the workload goes through, e.g. the
+    // height of a tree node above the leaves.  Objects start at 0.
+    void set_level(uint64_t level) const {
+      shard &s = ss->shard_of(target);
+      std::lock_guard<std::mutex> guard(s.lock);
+      object *obj = ss->find(s, target);
+      ss->uncharge_level(obj);
+      obj->level = level;
+      ss->charge_level(obj);
+    }
+
+    uint64_t get_level(void) const {
+      shard &s = ss->shard_of(target);
+      std::lock_guard<std::mutex> guard(s.lock);
+      return ss->find(s, target)->level;
     }
 
     bool is_dirty(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target && ss->objects[target]->target_is_dirty;
+      shard &s = ss->shard_of(target);
+      std::lock_guard<std::mutex> guard(s.lock);
+      object *obj = ss->find(s, target);
+      return target > 0 && obj->target && obj->target_is_dirty;
     }
 
+    // The object pointed to is not checked: the pointer is serialized
+    // under the lock of its owner's shard, and no thread may wait for
+    // a second shard lock.
     void _serialize(std::iostream &fs, serialization_context &context) {
       assert(target > 0);
-      assert(context.ss.objects.count(target) > 0);
-      fs << target << " ";
-      target = 0;
+      serialize(fs, context, target);
+      if (context.releases_pointers)
+        target = 0;
       assert(fs.good());
       context.is_leaf = false;
     }
@@ -441,9 +853,8 @@ public:
     void _deserialize(std::iostream &fs, serialization_context &context) {
       assert(target == 0);
       ss = &context.ss;
-      fs >> target;
+      deserialize(fs, context, target);
       assert(fs.good());
-      assert(context.ss.objects.count(target) > 0);
       // We just created a new reference to this object and
       // invalidated the on-disk reference, so the total refcount
       // stays the same.
@@ -479,13 +890,16 @@ public:
       object *o = new object(sspace, tgt);
       assert(o != NULL);
       target = o->id;
-      assert(ss->objects.count(target) == 0);
-    //structs used in ss
-    //objects is a map from targets->objects (target == obj->id)
-    //std::unordered_map<uint64_t, object *> objects;
-      ss->objects[target] = o;
-      ss->lru_pqueue.insert(o);  //std::set<object *, bool (*)(object *, object *)> lru_pqueue;
-      ss->current_in_memory_objects++;
+      {
+        shard &s = ss->shard_of(target);
+        std::lock_guard<std::mutex> guard(s.lock);
+        assert(s.objects.count(target) == 0);
+        //objects is a map from targets->objects (target == obj->id)
+        s.objects[target] = o;
+        s.policy->touch(o);
+        ss->current_in_memory_objects++;
+        ss->measure<Referent>(o);
+      }
       ss->maybe_evict_something();
     }
 
@@ -494,8 +908,8 @@ public:
 private:
   backing_store *backstore;  
 
-  uint64_t next_id = 1;
-  uint64_t next_access_time = 0;
+  std::atomic<uint64_t> next_id{1};
+  std::atomic<uint64_t> next_access_time{0};
   
   class object {
   public:
@@ -508,51 +922,423 @@ private:
     uint64_t id; // object id 
     uint64_t version;
     bool is_leaf;
-    uint64_t refcount;
+    // see pointer::set_level()
+    uint64_t level;
+    std::atomic<uint64_t> refcount;
     uint64_t last_access;
     bool target_is_dirty;
-    uint64_t pincount;
+    std::atomic<uint64_t> pincount;
+    // read started by dopin() or prefetch() that load() has not
+    // consumed yet
+    std::future<std::iostream *> pending_load;
+    // pending_load was started by prefetch()
+    bool load_is_prefetched;
+    // a thread is reading the target outside the shard lock
+    bool is_loading;
+
+    // intrusive links of the replacement policy's resident list
+    object *prev_resident;
+    object *next_resident;
+    bool is_resident;
+    bool referenced; // CLOCK reference bit
+
+    // bytes charged for the in-memory target, 0 when it is on disk
+    uint64_t footprint;
+    // the target was accessed for writing since it was last measured;
+    // unpin() reads it without the shard lock
+    std::atomic<bool> footprint_is_stale;
+
+    // the version recorded by the last checkpoint, 0 if none
+    uint64_t checkpointed_version;
+
+    // The compressed image of the target while it is in the compressed
+    // tier, its uncompressed size, and whether it holds changes the
+    // backing store does not have.  packed_time orders the tier.
+    bool is_packed;
+    std::string packed;
+    uint64_t packed_size;
+    bool packed_is_dirty;
+    uint64_t packed_time;
+    object *prev_packed;
+    object *next_packed;
+  };
+
+  // The objects of a shard in the compressed tier, oldest first.
+  class packed_list {
+  public:
+    void push(object *obj);
+    void erase(object *obj);
+    void clear(void) { head = tail = NULL; }
+    object * oldest(void) { return head; }
+    object * next(object *obj) { return obj->next_packed; }
+
+  private:
+    object *head = NULL;
+    object *tail = NULL;
   };
 
-  static bool cmp_by_last_access(object *a, object *b);
+  // Tracks the in-memory objects and picks eviction victims.  The
+  // resident objects form an intrusive doubly-linked list; LRU keeps
+  // it in recency order, CLOCK sweeps it with a hand.
+  class replacement_policy {
+  public:
+    virtual ~replacement_policy(void) {};
+    // record an access, making obj resident if it was not
+    virtual void touch(object *obj) = 0;
+    // obj left memory (no-op if it was not resident)
+    virtual void erase(object *obj);
+    // return an unpinned resident object to evict, or NULL.  With
+    // spare_internal, only objects at level 0 qualify.
+    virtual object * pick_victim(bool spare_internal) = 0;
+    // append the next n resident objects in eviction order to out
+    virtual void cold_objects(std::vector<object *> &out, uint64_t n) = 0;
+    void clear(void);
+
+    object * first(void) { return head; }
+    uint64_t size(void) { return count; }
+
+  protected:
+    void link_at_tail(object *obj);
+    void unlink(object *obj);
+
+    object *head = NULL;
+    object *tail = NULL;
+    uint64_t count = 0;
+  };
 
+  // Least recently used at the head, most recently used at the tail.
+  class lru_policy : public replacement_policy {
+  public:
+    void touch(object *obj);
+    object * pick_victim(bool spare_internal);
+    void cold_objects(std::vector<object *> &out, uint64_t n);
+  };
 
-  //ss load - if the object is not in memory (target != null) 
-  //bring into memory.
+  // Second-chance CLOCK: an access only sets the reference bit; the
+  // hand clears reference bits until it finds an unreferenced,
+  // unpinned object.
+  class clock_policy : public replacement_policy {
+  public:
+    void touch(object *obj);
+    void erase(object *obj);
+    object * pick_victim(bool spare_internal);
+    void cold_objects(std::vector<object *> &out, uint64_t n);
+
+  private:
+    object *hand = NULL;
+  };
+
+
+  // One part of the objects table, see the top of this file.
+  class shard {
+  public:
+    std::mutex lock;
+    //objects is a map from targets->objects (target == obj->id)
+    std::unordered_map<uint64_t, object *> objects;
+    replacement_policy *policy;
+    packed_list packed;
+    // signalled when a load into this shard finishes
+    std::condition_variable loaded;
+    // how access() found the targets of this shard
+    uint64_t memory_hits = 0;
+    uint64_t packed_hits = 0;
+    uint64_t store_reads = 0;
+    // reads started by prefetch(), and the store reads that used one
+    uint64_t prefetches = 0;
+    uint64_t prefetched_reads = 0;
+    // accesses to objects above level 0 that were not in memory
+    uint64_t internal_misses = 0;
+  };
+
+  uint64_t sum_over_shards(uint64_t shard::*counter) {
+    uint64_t sum = 0;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      sum += shards[i].*counter;
+    }
+    return sum;
+  }
+
+  // Fibonacci hashing spreads consecutive ids over the shards.
+  shard & shard_of(uint64_t id) {
+    return shards[((id * 0x9E3779B97F4A7C15ULL) >> 32) % SWAP_SPACE_SHARDS];
+  }
+
+  // the object with id tgt; the caller holds s.lock
+  object * find(shard &s, uint64_t tgt) {
+    auto it = s.objects.find(tgt);
+    assert(it != s.objects.end());
+    return it->second;
+  }
+
+  // the object with id tgt, which the caller holds a reference to, so
+  // it stays valid after the shard lock is released
+  object * lookup(uint64_t tgt) {
+    shard &s = shard_of(tgt);
+    std::lock_guard<std::mutex> guard(s.lock);
+    return find(s, tgt);
+  }
+
+  // Start reading obj from the store unless it is in memory, in the
+  // compressed tier, or already being read.  The caller holds a
+  // reference to obj and its shard lock in guard.  The lock is dropped
+  // while the read is started, since a store may do the whole read in
+  // get_async(); obj is marked as loading meanwhile, so access() waits
+  // for it as for any other load.  Returns whether a read was started.
+  bool start_load(object *obj, std::unique_lock<std::mutex> &guard) {
+    if (obj->target != NULL || obj->is_loading || obj->is_packed || obj->pending_load.valid())
+      return false;
+    obj->is_loading = true;
+    guard.unlock();
+    std::future<std::iostream *> pending;
+    {
+      std::lock_guard<std::mutex> io(io_lock);
+      pending = backstore->get_async(obj->id, obj->version);
+    }
+    guard.lock();
+    obj->pending_load = std::move(pending);
+    obj->is_loading = false;
+    shard_of(obj->id).loaded.notify_all();
+    return true;
+  }
+
+  // Record an access to the pinned obj and return its target, loading
+  // it first if needed.  The target is read and deserialized without
+  // the shard lock, since deserializing copies pointers, which looks up
+  // their objects in other shards; other threads accessing obj
+  // meanwhile wait for the load to finish.
+  template<class Referent>
+  serializable * access(object *obj, bool dirty) {
+    shard &s = shard_of(obj->id);
+    std::unique_lock<std::mutex> guard(s.lock);
+    if (obj->target)
+      s.memory_hits++;
+    while (obj->target == NULL) {
+      if (obj->is_loading) {
+        s.loaded.wait(guard);
+        continue;
+      }
+      obj->is_loading = true;
+      std::future<std::iostream *> pending = std::move(obj->pending_load);
+      std::string packed;
+      bool packed_is_dirty = false;
+      if (obj->is_packed) {
+        s.packed.erase(obj);
+        obj->is_packed = false;
+        packed.swap(obj->packed);
+        packed_is_dirty = obj->packed_is_dirty;
+        current_packed_bytes -= packed.size();
+        s.packed_hits++;
+      } else {
+        s.store_reads++;
+        if (obj->load_is_prefetched)
+          s.prefetched_reads++;
+      }
+      if (obj->level > 0)
+        s.internal_misses++;
+      obj->load_is_prefetched = false;
+      guard.unlock();
+      auto start = std::chrono::steady_clock::now();
+      Referent *r = read<Referent>(obj, pending, packed);
+      guard.lock();
+      obj->target = r;
+      obj->target_is_dirty = packed_is_dirty;
+      obj->is_loading = false;
+      current_in_memory_objects++;
+      measure<Referent>(obj);
+      if (packed.empty())
+        load_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+      s.loaded.notify_all();
+    }
+    obj->last_access = next_access_time++;
+    s.policy->touch(obj);
+    obj->target_is_dirty |= dirty;
+    if (dirty)
+      obj->footprint_is_stale = true;
+    return obj->target;
+  }
+
+  // read obj's current version: decompress packed if it is not empty,
+  // else read it with pending if that is valid
   template<class Referent>
-  void load(uint64_t tgt) {
-    assert(objects.count(tgt) > 0);
-    if (objects[tgt]->target == NULL) { //objects[tgt]->target is a serializable pointer
-      object *obj = objects[tgt];
-      debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
-      std::iostream *in = backstore->get(obj->id, obj->version);
+  Referent * read(object *obj, std::future<std::iostream *> &pending, const std::string &packed) {
+    debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
+    if (!packed.empty()) {
+      std::string image;
+      lz4_decompress(packed.data(), packed.size(), image, obj->packed_size);
+      std::stringstream in(image);
       Referent *r = new Referent();
       serialization_context ctxt(*this);
-      // template<class X> void deserialize(std::iostream &fs, serialization_context &context, X &x)
-      // {
-      // x._deserialize(fs, context);
-      // }
-      deserialize(*in, ctxt, *r); 
+      read_format_header(in, ctxt);
+      deserialize(in, ctxt, *r);
+      return r;
+    }
+    std::iostream *in;
+    if (pending.valid()) {
+      in = pending.get();
+    } else {
+      std::lock_guard<std::mutex> io(io_lock);
+      in = backstore->get(obj->id, obj->version);
+    }
+    Referent *r = new Referent();
+    serialization_context ctxt(*this);
+    read_format_header(*in, ctxt);
+    // template<class X> void deserialize(std::iostream &fs, serialization_context &context, X &x)
+    // {
+    // x._deserialize(fs, context);
+    // }
+    deserialize(*in, ctxt, *r); 
+    {
+      std::lock_guard<std::mutex> io(io_lock);
       backstore->put(in);
-      obj->target = r;
+    }
+    load_count++;
+    return r;
+  }
+
+  //ss load - if the object is not in memory (target != null) 
+  //bring into memory.  Only for objects nothing else can reach.
+  template<class Referent>
+  void load(object *obj) {
+    if (obj->target == NULL) { //obj->target is a serializable pointer
+      auto start = std::chrono::steady_clock::now();
+      obj->target = read<Referent>(obj, obj->pending_load, obj->packed);
       current_in_memory_objects++;
+      measure<Referent>(obj);
+      load_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
     }
   }
 
   void set_cache_size(uint64_t sz);
+
+  // charge obj for its current footprint
+  template<class Referent>
+  void measure(object *obj) {
+    uint64_t bytes = obj->target ? footprint(*(Referent *)obj->target) : 0;
+    uint64_t current = current_in_memory_bytes += bytes - obj->footprint;
+    uint64_t peak = peak_in_memory_bytes;
+    while (current > peak && !peak_in_memory_bytes.compare_exchange_weak(peak, current))
+      ;
+    uncharge_level(obj);
+    obj->footprint = bytes;
+    charge_level(obj);
+    obj->footprint_is_stale = false;
+  }
+
+  // obj's target has left memory
+  void release_footprint(object *obj) {
+    current_in_memory_bytes -= obj->footprint;
+    uncharge_level(obj);
+    obj->footprint = 0;
+  }
+
+  // Count obj in, or out of, the objects the internal reserve covers.
+  // The footprint is 0 exactly when the target is not in memory.
+  void charge_level(object *obj) {
+    if (obj->level > 0 && obj->footprint > 0) {
+      current_internal_objects++;
+      current_internal_bytes += obj->footprint;
+    }
+  }
+
+  void uncharge_level(object *obj) {
+    if (obj->level > 0 && obj->footprint > 0) {
+      current_internal_objects--;
+      current_internal_bytes -= obj->footprint;
+    }
+  }
+
+  // the objects above level 0 fit in the internal reserve
+  bool spares_internal(void) const {
+    double reserve = internal_reserve;
+    return reserve > 0 &&
+      current_internal_objects <= reserve * max_in_memory_objects &&
+      (max_in_memory_bytes == 0 || current_internal_bytes <= reserve * max_in_memory_bytes);
+  }
   
-  void write_back(object *obj);
+  void write_back(object *obj, std::vector<std::iostream *> &batch, bool evicting = true);
+  void write_version(object *obj, const std::string &image, std::vector<std::iostream *> &batch);
+  void pack(object *obj);
+  void unpack_to_store(object *obj, std::vector<std::iostream *> &batch);
+  object * pick_packed_victim(std::unique_lock<std::mutex> *held);
+  void put_batch(std::vector<std::iostream *> &batch);
+  bool is_memory_over_budget(void) const {
+    return current_in_memory_objects > max_in_memory_objects ||
+      (max_in_memory_bytes > 0 && current_in_memory_bytes > max_in_memory_bytes);
+  }
+  bool is_over_budget(void) const {
+    return is_memory_over_budget() || current_packed_bytes > max_packed_bytes;
+  }
+  // within 1/SWAP_SPACE_FLUSH_WINDOW of a budget
+  bool is_near_budget(void) const {
+    uint64_t keep = SWAP_SPACE_FLUSH_WINDOW - 1;
+    return current_in_memory_objects * SWAP_SPACE_FLUSH_WINDOW > max_in_memory_objects * keep ||
+      (max_in_memory_bytes > 0 &&
+       current_in_memory_bytes * SWAP_SPACE_FLUSH_WINDOW > max_in_memory_bytes * keep);
+  }
+  object * pick_victim(std::unique_lock<std::mutex> *held);
+  object * pick_victim(std::unique_lock<std::mutex> *held, bool spare_internal);
   void maybe_evict_something(void);
-  // void flush_whole_tree(void); // set this function as public
+  void release_version(object *obj, uint64_t version);
+  void flusher_main(void);
+  void flush_cold_objects(void);
+  void free_dead_versions(void);
   
-  uint64_t max_in_memory_objects;
-  uint64_t current_in_memory_objects = 0;
+  std::atomic<uint64_t> max_in_memory_objects;
+  std::atomic<uint64_t> current_in_memory_objects{0};
+  std::atomic<uint64_t> max_in_memory_bytes{0};
+  std::atomic<uint64_t> current_in_memory_bytes{0};
+  std::atomic<uint64_t> peak_in_memory_bytes{0};
+  std::atomic<double> internal_reserve{0};
+  std::atomic<uint64_t> current_internal_objects{0};
+  std::atomic<uint64_t> current_internal_bytes{0};
+  std::atomic<uint64_t> max_packed_bytes{0};
+  std::atomic<uint64_t> current_packed_bytes{0};
+  std::atomic<uint64_t> packed_input_bytes{0};
+  std::atomic<uint64_t> packed_output_bytes{0};
+
+  int format;
+  int replacement;
+  std::atomic<uint64_t> write_back_count{0};
+  std::atomic<uint64_t> write_back_bytes{0};
+  std::atomic<uint64_t> write_back_time{0};
+  std::atomic<uint64_t> load_count{0};
+  std::atomic<uint64_t> load_time{0};
+  std::atomic<uint64_t> freed_version_count{0};
+  std::atomic<uint64_t> eviction_count{0};
+  std::atomic<uint64_t> dirty_eviction_count{0};
+  std::atomic<uint64_t> foreground_stall_time{0};
+  std::atomic<uint64_t> flush_count{0};
+  std::atomic<uint64_t> flush_passes{0};
+  std::atomic<uint64_t> flush_queue_depth_sum{0};
+  std::atomic<uint64_t> flush_queue_depth_max{0};
 
 
   //structs used in ss
-  //objects is a map from targets->objects (target == obj->id)
-  std::unordered_map<uint64_t, object *> objects;
-  std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+  shard shards[SWAP_SPACE_SHARDS];
+  // the next shard CLOCK sweeps
+  uint64_t clock_shard = 0;
+
+  // held by the one thread evicting, and by checkpoints so nothing is
+  // evicted while they write back
+  std::mutex evict_lock;
+  // guards backstore, deferred_frees, dead_versions and
+  // frees_in_background
+  std::mutex io_lock;
+
+  // (id, version) released since the last checkpoint that the last
+  // checkpoint still refers to
+  std::vector<std::pair<uint64_t, uint64_t>> deferred_frees;
+  // dead versions the flusher frees, when frees_in_background is set
+  std::vector<std::pair<uint64_t, uint64_t>> dead_versions;
+  bool frees_in_background = false;
+
+  // the background flusher; flusher_lock guards flusher_stopping
+  std::thread flusher;
+  std::mutex flusher_lock;
+  std::condition_variable flusher_wakeup;
+  bool flusher_stopping = false;
+  uint64_t flush_interval = 0;
 };
 
 #endif // SWAP_SPACE_HPP
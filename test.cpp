@@ -9,6 +9,9 @@
 // The values in this test are strings.  Since updates use operator+
 // on the values, this test performs concatenation on the strings.
 
+// The options pick the backing store, node format, cache policies and
+// tree features, so the same check covers each of them.
+
 #include <string.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -92,6 +95,7 @@ void do_scan(typename betree<Key, Value>::iterator &betit,
 #define DEFAULT_TEST_CACHE_SIZE (4)
 #define DEFAULT_TEST_NDISTINCT_KEYS (1ULL << 10)
 #define DEFAULT_TEST_NOPS (1ULL << 12)
+#define DEFAULT_TEST_EPSILON (0.5)
 
 void usage(char *name)
 {
@@ -102,7 +106,10 @@ void usage(char *name)
     << "Options are" << std::endl
     << "  Required:"   << std::endl
     << "    -d <backing_store_directory>                    [ default: none, parameter is required ]"           << std::endl
-    << "    -m  <mode>  (test or benchmark-<mode>)          [ default: none, parameter required ]"              << std::endl
+    << "    -m  <mode>  (test, test-lz4 or                  [ default: none, parameter required ]"              << std::endl
+    << "                 benchmark-<mode>)"                                                                     << std::endl
+    << "        test-lz4 round-trips the compressed tier's codec over its edge"                                 << std::endl
+    << "        cases and -t random inputs, and needs no -d"                                                    << std::endl
     << "        benchmark modes:"                                                                               << std::endl
     << "          upserts    "                                                                                  << std::endl
     << "          queries    "                                                                                  << std::endl
@@ -110,6 +117,44 @@ void usage(char *name)
     << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE  << " ]" << std::endl
     << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
     << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE     << " ]" << std::endl
+    << "    -M <max_cache_bytes>  (0 for no byte budget)    [ default: 0 ]"                                     << std::endl
+    << "                          -C is unlimited unless given with -M"                                         << std::endl
+    << "    -B <backing_store>                              [ default: file-per-object ]"                       << std::endl
+    << "        backing stores:"                                                                                << std::endl
+    << "          file-per-object    "                                                                          << std::endl
+    << "          single-file        "                                                                          << std::endl
+    << "          async              (io_uring, or threads if unsupported)"                                     << std::endl
+    << "          async-threads      "                                                                          << std::endl
+    << "    -F <node_format>    (text or binary)            [ default: text ]"                                  << std::endl
+    << "    -R <replacement_policy>   (lru or clock)        [ default: lru ]"                                   << std::endl
+    << "    -Z <compressed_cache_bytes>  (0 for no          [ default: 0 ]"                                     << std::endl
+    << "                          compressed tier)"                                                             << std::endl
+    << "    -I <internal_reserve>  (fraction of the cache   [ default: 0 ]"                                     << std::endl
+    << "                          kept for internal nodes)"                                                     << std::endl
+    << "    -G <flush_interval>  (in microseconds, 0 for no [ default: 0 ]"                                     << std::endl
+    << "                          background flusher)"                                                          << std::endl
+    << "    -b <batch_size>      (writes per upsert_batch)  [ default: 1 ]"                                     << std::endl
+    << "    -e <epsilon>                                    [ default: " << DEFAULT_TEST_EPSILON        << " ]" << std::endl
+    << "  Adapting epsilon" << std::endl
+    << "    -A <phase_length>    (integer: random           [ default: 0 ]"                                     << std::endl
+    << "                          operations per phase.  The test"                                              << std::endl
+    << "                          alternates write and query heavy"                                             << std::endl
+    << "                          phases and epsilon follows them;"                                             << std::endl
+    << "                          0 for one mix and -e)"                                                        << std::endl
+    << "    -w <write_heavy_epsilon>  (number in (0, 1])    [ default: " << DEFAULT_TEST_EPSILON        << " ]" << std::endl
+    << "    -r <read_heavy_epsilon>   (number in (0, 1])    [ default: 0.8 ]"                                   << std::endl
+    << "    -V <workload_window>  (integer, in operations)  [ default: " << DEFAULT_WORKLOAD_WINDOW     << " ]" << std::endl
+    << "    -H <reshape_steps>    (integer: steps per       [ default: 0 ]"                                     << std::endl
+    << "                          operation, to reshape the tree"                                               << std::endl
+    << "                          a little at a time when epsilon"                                              << std::endl
+    << "                          grows; 0 for no reshaping)"                                                   << std::endl
+    << "    -Y <lazy_rebalancing>  (true or false: true to  [ default: false ]"                                 << std::endl
+    << "                          bring nodes to a new epsilon"                                                 << std::endl
+    << "                          when they are next flushed)"                                                  << std::endl
+    << "    -D <subtree_depth>    (integer: subtrees this   [ default: 0 ]"                                     << std::endl
+    << "                          deep adapt epsilon on their"                                                  << std::endl
+    << "                          own, with -V, -w and -r; 0 for"                                               << std::endl
+    << "                          one epsilon)"                                                                 << std::endl
     << "  Options for both tests and benchmarks" << std::endl
     << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
     << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS           << " ]" << std::endl
@@ -119,39 +164,67 @@ void usage(char *name)
     << "    -i <script_file>                                [ default: none ]"                                  << std::endl;
 }
 
+// apply and empty the pending write batch, if any
+void flush_batch(betree<uint64_t, std::string> &b,
+		 write_batch<uint64_t, std::string> &batch)
+{
+  if (!batch.empty()) {
+    b.upsert_batch(batch);
+    batch.clear();
+  }
+}
+
+// With batch_size > 1, writes are collected into batches of up to
+// batch_size operations, and a pending batch is applied before every
+// query or scan.  With phase_length > 0, every other phase_length
+// random operations are mostly queries.
 int test(betree<uint64_t, std::string> &b,
 	 uint64_t nops,
 	 uint64_t number_of_distinct_keys,
 	 FILE *script_input,
-	 FILE *script_output)
+	 FILE *script_output,
+	 uint64_t batch_size,
+	 uint64_t phase_length)
 {
   std::map<uint64_t, std::string> reference;
+  write_batch<uint64_t, std::string> batch;
 
   for (unsigned int i = 0; i < nops; i++) {
     int op;
     uint64_t t;
     if (script_input) {
       int r = next_command(script_input, &op, &t);
-      if (r == EOF)
+      if (r == EOF) {
+	flush_batch(b, batch);
 	exit(0);
-      else if (r < 0)
+      } else if (r < 0)
 	exit(4);
     } else {
       op = rand() % 7;
+      if (phase_length > 0 && (i / phase_length) % 2 == 1 && rand() % 4 != 0)
+	op = 3;
       t = rand() % number_of_distinct_keys;
     }
+    if (op >= 3)
+      flush_batch(b, batch);
     
     switch (op) {
     case 0: // insert
       if (script_output)
 	fprintf(script_output, "Inserting %lu\n", t);
-      b.insert(t, std::to_string(t) + ":");
+      if (batch_size > 1)
+	batch.insert(t, std::to_string(t) + ":");
+      else
+	b.insert(t, std::to_string(t) + ":");
       reference[t] = std::to_string(t) + ":";
       break;
     case 1: // update
       if (script_output)
 	fprintf(script_output, "Updating %lu\n", t);
-      b.update(t, std::to_string(t) + ":");
+      if (batch_size > 1)
+	batch.update(t, std::to_string(t) + ":");
+      else
+	b.update(t, std::to_string(t) + ":");
       if (reference.count(t) > 0)
       	reference[t] += std::to_string(t) + ":";
       else
@@ -160,7 +233,10 @@ int test(betree<uint64_t, std::string> &b,
     case 2: // delete
       if (script_output)
 	fprintf(script_output, "Deleting %lu\n", t);
-      b.erase(t);
+      if (batch_size > 1)
+	batch.erase(t);
+      else
+	b.erase(t);
       reference.erase(t);
       break;
     case 3: // query
@@ -207,13 +283,121 @@ int test(betree<uint64_t, std::string> &b,
     default:
       abort();
     }
+    if (batch.size() >= batch_size)
+      flush_batch(b, batch);
   }
+  flush_batch(b, batch);
 
   std::cout << "Test PASSED" << std::endl;
   
   return 0;
 }
 
+// Compress and decompress one input and check that it comes back.
+void lz4_round_trip(const std::string &input)
+{
+  std::string compressed, output;
+  lz4_compress(input.data(), input.size(), compressed);
+  // the block ends with the input's last bytes as literals
+  if (input.size() >= LZ4_LAST_LITERALS)
+    assert(compressed.compare(compressed.size() - LZ4_LAST_LITERALS, LZ4_LAST_LITERALS,
+			      input, input.size() - LZ4_LAST_LITERALS, LZ4_LAST_LITERALS) == 0);
+  lz4_decompress(compressed.data(), compressed.size(), output, input.size());
+  assert(output == input);
+}
+
+// Append length bytes to s: fresh random ones (literals), or a copy of
+// the bytes period back (a match, which may overlap itself).
+void lz4_append_random(std::string &s, uint64_t length)
+{
+  for (uint64_t i = 0; i < length; i++)
+    s.push_back((char)(rand() & 0xff));
+}
+
+void lz4_append_repeat(std::string &s, uint64_t length, uint64_t period)
+{
+  if (s.size() < period)
+    lz4_append_random(s, period - s.size());
+  for (uint64_t i = 0; i < length; i++)
+    s.push_back(s[s.size() - period]);
+}
+
+// Round-trip the compressed tier's codec over the cases its length
+// encoding and end-of-block rules single out, then over nops random
+// mixes of literal runs and matches.
+int test_lz4(uint64_t nops)
+{
+  // short inputs, around where matching starts
+  for (uint64_t n = 0; n <= 4 * LZ4_MATCH_LIMIT; n++) {
+    std::string s;
+    lz4_append_random(s, n);
+    lz4_round_trip(s);
+    lz4_round_trip(std::string(n, 'a'));
+    s.clear();
+    lz4_append_repeat(s, n, 3);
+    lz4_round_trip(s);
+  }
+
+  // literal runs and match lengths around where their length nibble
+  // saturates (15) and where the first extra byte does (15 + 255)
+  uint64_t boundaries[] = { 15, 15 + 255, 15 + 2 * 255 };
+  for (uint64_t b : boundaries) {
+    for (uint64_t n = b - 3; n <= b + 3; n++) {
+      std::string s;
+      lz4_append_repeat(s, 64, 1);
+      lz4_append_random(s, n);
+      lz4_append_repeat(s, 64, 1);
+      lz4_append_random(s, n);
+      lz4_round_trip(s);
+
+      s.clear();
+      lz4_append_random(s, 16);
+      lz4_append_repeat(s, n + LZ4_MIN_MATCH, 16);
+      lz4_append_random(s, LZ4_MATCH_LIMIT);
+      lz4_round_trip(s);
+      // the same match, ending right at the last literals
+      s.resize(s.size() - LZ4_MATCH_LIMIT);
+      lz4_round_trip(s);
+    }
+  }
+
+  // highly repetitive inputs must shrink, random ones may not
+  std::string repetitive;
+  lz4_append_repeat(repetitive, 1 << 16, 7);
+  std::string compressed;
+  lz4_compress(repetitive.data(), repetitive.size(), compressed);
+  assert(compressed.size() < repetitive.size() / 100);
+  lz4_round_trip(repetitive);
+  std::string random;
+  lz4_append_random(random, 1 << 16);
+  lz4_round_trip(random);
+
+  // matches further back than LZ4_MAX_OFFSET must not be taken.  The
+  // filler all hashes alike, so the hash table still remembers the
+  // first bytes when they come again.
+  std::string far;
+  lz4_append_random(far, 1 << 10);
+  far.append(LZ4_MAX_OFFSET, 'a');
+  far += far.substr(0, 1 << 10);
+  lz4_round_trip(far);
+
+  for (uint64_t i = 0; i < nops; i++) {
+    std::string s;
+    int segments = rand() % 16;
+    for (int j = 0; j < segments; j++) {
+      uint64_t length = rand() % 3 == 0 ? rand() % 600 : rand() % 40;
+      if (rand() % 2)
+        lz4_append_random(s, length);
+      else
+        lz4_append_repeat(s, length, 1 + rand() % 64);
+    }
+    lz4_round_trip(s);
+  }
+
+  std::cout << "Test PASSED" << std::endl;
+  return 0;
+}
+
 void benchmark_upserts(betree<uint64_t, std::string> &b,
 		       uint64_t nops,
 		       uint64_t number_of_distinct_keys,
@@ -276,6 +460,23 @@ int main(int argc, char **argv)
   char *script_infile = NULL;
   char *script_outfile = NULL;
   unsigned int random_seed = time(NULL) * getpid();
+  bool cache_size_given = false;
+  uint64_t cache_bytes = 0;
+  char *backing_store_type = NULL;
+  int node_format = SERIALIZATION_FORMAT_TEXT;
+  int replacement_policy = REPLACEMENT_POLICY_LRU;
+  uint64_t compressed_cache_bytes = 0;
+  double internal_reserve = 0;
+  uint64_t flush_interval = 0;
+  uint64_t batch_size = 1;
+  double epsilon = DEFAULT_TEST_EPSILON;
+  uint64_t phase_length = 0;
+  double write_heavy_epsilon = DEFAULT_TEST_EPSILON;
+  double read_heavy_epsilon = 0.8;
+  uint64_t workload_window = DEFAULT_WORKLOAD_WINDOW;
+  uint64_t reshape_steps = 0;
+  bool lazy_rebalancing = false;
+  uint64_t subtree_depth = 0;
  
   int opt;
   char *term;
@@ -284,7 +485,7 @@ int main(int argc, char **argv)
   // Argument parsing //
   //////////////////////
   
-  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:M:B:F:R:Z:I:G:b:e:A:w:r:V:H:Y:D:")) != -1) {
     switch (opt) {
     case 'm':
       mode = optarg;
@@ -315,6 +516,144 @@ int main(int argc, char **argv)
         usage(argv[0]);
         exit(1);
       }
+      cache_size_given = true;
+      break;
+    case 'M':
+      cache_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -M must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'B':
+      backing_store_type = optarg;
+      if (strcmp(optarg, "file-per-object") != 0 &&
+          strcmp(optarg, "single-file") != 0 &&
+          strcmp(optarg, "async") != 0 &&
+          strcmp(optarg, "async-threads") != 0) {
+        std::cerr << "Invalid argument for -B. Use 'file-per-object', 'single-file', 'async' or 'async-threads'." << std::endl;
+        exit(1);
+      }
+      break;
+    case 'F':
+      if (strcmp(optarg, "text") == 0) {
+        node_format = SERIALIZATION_FORMAT_TEXT;
+      } else if (strcmp(optarg, "binary") == 0) {
+        node_format = SERIALIZATION_FORMAT_BINARY;
+      } else {
+        std::cerr << "Invalid argument for -F. Use 'text' or 'binary'." << std::endl;
+        exit(1);
+      }
+      break;
+    case 'R':
+      if (strcmp(optarg, "lru") == 0) {
+        replacement_policy = REPLACEMENT_POLICY_LRU;
+      } else if (strcmp(optarg, "clock") == 0) {
+        replacement_policy = REPLACEMENT_POLICY_CLOCK;
+      } else {
+        std::cerr << "Invalid argument for -R. Use 'lru' or 'clock'." << std::endl;
+        exit(1);
+      }
+      break;
+    case 'Z':
+      compressed_cache_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -Z must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'I':
+      internal_reserve = strtod(optarg, &term);
+      if (*term || internal_reserve < 0 || internal_reserve > 1) {
+        std::cerr << "Argument to -I must be a number in [0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'G':
+      flush_interval = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -G must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'b':
+      batch_size = strtoull(optarg, &term, 10);
+      if (*term || batch_size == 0) {
+        std::cerr << "Argument to -b must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'e':
+      epsilon = strtod(optarg, &term);
+      if (*term || epsilon <= 0 || epsilon > 1) {
+        std::cerr << "Argument to -e must be a number in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'A':
+      phase_length = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -A must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'w':
+      write_heavy_epsilon = strtod(optarg, &term);
+      if (*term || write_heavy_epsilon <= 0 || write_heavy_epsilon > 1) {
+        std::cerr << "Argument to -w must be a number in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'r':
+      read_heavy_epsilon = strtod(optarg, &term);
+      if (*term || read_heavy_epsilon <= 0 || read_heavy_epsilon > 1) {
+        std::cerr << "Argument to -r must be a number in (0, 1]" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'V':
+      workload_window = strtoull(optarg, &term, 10);
+      if (*term || workload_window == 0) {
+        std::cerr << "Argument to -V must be a positive integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'H':
+      reshape_steps = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -H must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'Y':
+      if (strcmp(optarg, "true") == 0) {
+        lazy_rebalancing = true;
+      } else if (strcmp(optarg, "false") == 0) {
+        lazy_rebalancing = false;
+      } else {
+        std::cerr << "Argument to -Y must be true or false" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'D':
+      subtree_depth = strtoull(optarg, &term, 10);
+      if (*term) {
+        std::cerr << "Argument to -D must be an integer" << std::endl;
+        usage(argv[0]);
+        exit(1);
+      }
       break;
     case 'o':
       script_outfile = optarg;
@@ -358,9 +697,10 @@ int main(int argc, char **argv)
 
   if (mode == NULL ||
       (strcmp(mode, "test") != 0
+       && strcmp(mode, "test-lz4") != 0
        && strcmp(mode, "benchmark-upserts") != 0
 			 && strcmp(mode, "benchmark-queries") != 0)) {
-    std::cerr << "Must specify a mode of \"test\" or \"benchmark\"" << std::endl;
+    std::cerr << "Must specify a mode of \"test\", \"test-lz4\" or \"benchmark\"" << std::endl;
     usage(argv[0]);
     exit(1);
   }
@@ -396,6 +736,10 @@ int main(int argc, char **argv)
 
   srand(random_seed);
 
+  // the codec test needs no tree
+  if (strcmp(mode, "test-lz4") == 0)
+    return test_lz4(nops);
+
   if (backing_store_dir == NULL) {
     std::cerr << "-d <backing_store_directory> is required" << std::endl;
     usage(argv[0]);
@@ -406,14 +750,44 @@ int main(int argc, char **argv)
   // Construct a betree and run the tests or benchmarks //
   ////////////////////////////////////////////////////////
   
-  one_file_per_object_backing_store ofpobs(backing_store_dir);
-  swap_space sspace(&ofpobs, cache_size);
+  backing_store *store = NULL;
+  if (backing_store_type != NULL && strcmp(backing_store_type, "single-file") == 0) {
+    store = new single_file_backing_store(backing_store_dir);
+  } else if (backing_store_type != NULL && strncmp(backing_store_type, "async", strlen("async")) == 0) {
+    store = new async_backing_store(backing_store_dir, strcmp(backing_store_type, "async") == 0);
+  } else {
+    store = new one_file_per_object_backing_store(backing_store_dir);
+  }
 
+  // a byte budget replaces the node count unless both are given
+  if (cache_bytes > 0 && !cache_size_given)
+    cache_size = UINT64_MAX;
+  swap_space sspace(store, cache_size, node_format, replacement_policy);
+  sspace.set_cache_bytes(cache_bytes);
+  sspace.set_compressed_cache_bytes(compressed_cache_bytes);
+  sspace.set_internal_reserve(internal_reserve);
+  if (flush_interval > 0)
+    sspace.start_flusher(flush_interval);
+
+  // With phases the tree starts write heavy and follows the
+  // predictor, otherwise it keeps -e (state 7).
+  workload_predictor predictor(WORKLOAD_POLICY_HYSTERESIS, WORKLOAD_WRITE_HEAVY, workload_window);
   Logs<Op<uint64_t, std::string>> logs(0, 0, nullptr, serialization_context(sspace));
-  betree<uint64_t, std::string> b(&sspace, logs, max_node_size, min_flush_size);
+  betree<uint64_t, std::string> b(&sspace, logs,
+				  phase_length > 0 ? write_heavy_epsilon : epsilon,
+				  phase_length > 0 ? WORKLOAD_WRITE_HEAVY : 7,
+				  max_node_size, max_node_size / 4, min_flush_size);
+
+  if (phase_length > 0) {
+    b.set_reshaping(reshape_steps);
+    b.set_lazy_rebalancing(lazy_rebalancing);
+    b.set_subtree_adaptation(subtree_depth, WORKLOAD_POLICY_HYSTERESIS, workload_window,
+			     write_heavy_epsilon, read_heavy_epsilon);
+    b.set_workload_predictor(&predictor, write_heavy_epsilon, read_heavy_epsilon, false);
+  }
 
   if (strcmp(mode, "test") == 0) 
-    test(b, nops, number_of_distinct_keys, script_input, script_output);
+    test(b, nops, number_of_distinct_keys, script_input, script_output, batch_size, phase_length);
   else if (strcmp(mode, "benchmark-upserts") == 0)
     benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
   else if (strcmp(mode, "benchmark-queries") == 0)
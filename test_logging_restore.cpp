@@ -22,6 +22,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <thread>
 #include <dirent.h>
 
 // INCLUDE YOUR LOGGING FILE HERE
@@ -76,6 +77,8 @@ int next_command(FILE *input, int *op, uint64_t *arg) {
 #define DEFAULT_TEST_CACHE_SIZE (4)
 #define DEFAULT_TEST_NDISTINCT_KEYS (1ULL << 10)
 #define DEFAULT_TEST_NOPS (1ULL << 12)
+#define DEFAULT_BENCHMARK_THREADS (8)
+#define DEFAULT_BENCHMARK_QUERY_PERCENT (90)
 
 void usage(char *name) {
     std::cout
@@ -87,12 +90,15 @@ void usage(char *name) {
         << "    -d <backing_store_directory>                    [ default: "
            "none, parameter is required ]"
         << std::endl
-        << "    -m  <mode>  (test or benchmark-<mode>)          [ default: "
+        << "    -m  <mode>  (test, bulk-load or benchmark-<mode>) [ default: "
            "none, parameter required ]"
         << std::endl
         << "        benchmark modes:" << std::endl
         << "          upserts    " << std::endl
         << "          queries    " << std::endl
+        << "          scans      " << std::endl
+        << "          threads    (1, 2, 4, ... -j threads)" << std::endl
+        << "          pins       (-k objects, 1, 2, 4, ... -j threads)" << std::endl
         << "  Betree tuning parameters:" << std::endl
         << "    -N <max_node_size>            (in elements)     [ default: "
         << DEFAULT_TEST_MAX_NODE_SIZE << " ]" << std::endl
@@ -100,6 +106,95 @@ void usage(char *name) {
         << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
         << "    -C <max_cache_size>           (in betree nodes) [ default: "
         << DEFAULT_TEST_CACHE_SIZE << " ]" << std::endl
+        << "    -M <max_cache_bytes>  (0 for no byte budget)    [ default: "
+           "0 ]"
+        << std::endl
+        << "                          -C is unlimited unless given with -M"
+        << std::endl
+        << "    -B <backing_store>                              [ default: "
+           "file-per-object ]"
+        << std::endl
+        << "        backing stores:" << std::endl
+        << "          file-per-object    " << std::endl
+        << "          single-file        " << std::endl
+        << "          async              (io_uring, or threads if unsupported)" << std::endl
+        << "          async-threads      " << std::endl
+        << "    -F <node_format>    (text or binary)            [ default: "
+           "text ]"
+        << std::endl
+        << "    -R <replacement_policy>   (lru or clock)        [ default: "
+           "lru ]"
+        << std::endl
+        << "    -b <batch_size>      (writes per upsert_batch)  [ default: "
+           "1 ]"
+        << std::endl
+        << "    -Z <compressed_cache_bytes>  (0 for no          [ default: "
+           "0 ]"
+        << std::endl
+        << "                          compressed tier)"
+        << std::endl
+        << "    -I <internal_reserve>  (fraction of the cache   [ default: "
+           "0 ]"
+        << std::endl
+        << "                          kept for internal nodes)"
+        << std::endl
+        << "    -G <flush_interval>  (in microseconds, 0 for no [ default: "
+           "0 ]"
+        << std::endl
+        << "                          background flusher)"
+        << std::endl
+        << "    -W <log_sync_policy>                            [ default: "
+           "records ]"
+        << std::endl
+        << "        log sync policies:" << std::endl
+        << "          op         (commit every upsert)" << std::endl
+        << "          records    (commit every -p records)" << std::endl
+        << "          interval   (commit every -T microseconds)" << std::endl
+        << "          none       (write every -p records, never sync)" << std::endl
+        << "    -T <sync_interval>    (in microseconds)         [ default: "
+           "1000 ]"
+        << std::endl
+        << "    -L <fill_factor>      (bulk-load node fill)     [ default: "
+        << DEFAULT_BULK_LOAD_FILL_FACTOR << " ]" << std::endl
+        << "    -P <workload_policy>  (how the test adapts      [ default: "
+           "hysteresis ]"
+        << std::endl
+        << "                          epsilon, unless -a 7)"
+        << std::endl
+        << "        workload policies:" << std::endl
+        << "          window     (each window decides)" << std::endl
+        << "          ewma       (a moving average decides)" << std::endl
+        << "          hysteresis (3 windows in a row decide)" << std::endl
+        << "          cost       (a cost model of the measured I/O" << std::endl
+        << "                      picks epsilon between -w and -r" << std::endl
+        << "                      every window)" << std::endl
+        << "    -V <workload_window>  (in operations)           [ default: "
+        << DEFAULT_WORKLOAD_WINDOW << " ]" << std::endl
+        << "    -H <reshape_steps>    (per operation, to        [ default: "
+           "0 ]"
+        << std::endl
+        << "                          reshape the tree a little"
+        << std::endl
+        << "                          at a time when epsilon grows;"
+        << std::endl
+        << "                          0 shortens it all at once)"
+        << std::endl
+        << "    -D <subtree_depth>    (let the subtrees this    [ default: "
+           "0 ]"
+        << std::endl
+        << "                          deep adapt epsilon on their"
+        << std::endl
+        << "                          own, with -P, -V, -w and -r;"
+        << std::endl
+        << "                          0 for one epsilon)"
+        << std::endl
+        << "    -Y <lazy_rebalancing>  (true to bring nodes to  [ default: "
+           "false ]"
+        << std::endl
+        << "                          a new epsilon when they are"
+        << std::endl
+        << "                          next flushed)"
+        << std::endl
         << "  Options for both tests and benchmarks" << std::endl
         << "    -k <number_of_distinct_keys>                    [ default: "
         << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
@@ -108,6 +203,11 @@ void usage(char *name) {
         << "    -s <random_seed>                                [ default: "
            "random ]"
         << std::endl
+        << "  Options for benchmark-threads and benchmark-pins" << std::endl
+        << "    -j <max_threads>                                [ default: "
+        << DEFAULT_BENCHMARK_THREADS << " ]" << std::endl
+        << "    -q <query_percent>    (the rest are updates)    [ default: "
+        << DEFAULT_BENCHMARK_QUERY_PERCENT << " ]" << std::endl
         << "  Test scripting options" << std::endl
         << "    -o <output_script>                              [ default: no "
            "output ]"
@@ -115,101 +215,44 @@ void usage(char *name) {
         << "    -i <script_file>                                [ default: "
            "none ]"
         << std::endl
+        << "        bulk-load loads the result of the first -t writes of the"
+        << std::endl
+        << "        script with betree::bulk_load and ends with a checkpoint"
+        << std::endl
         << "  ====REQUIRED PARAMETERS FOR PROJECT 2====" << std::endl
         << "    -p <persistence_granularity>  (an integer)" << std::endl
         << "    -c <checkpoint_granularity>   (an integer)" << std::endl;
 }
 
+// apply and empty the pending write batch, if any
+void flush_batch(betree<uint64_t, std::string> &b,
+                 write_batch<uint64_t, std::string> &batch) {
+    if (!batch.empty()) {
+        b.upsert_batch(batch);
+        batch.clear();
+    }
+}
+
+// With batch_size > 1, writes are collected into batches of up to
+// batch_size operations.  A pending batch is applied before every
+// query so that queries still see all the preceding writes.
 int test(betree<uint64_t, std::string> &b, 
-         double write_heavy_epsilon, 
-         double read_heavy_epsilon, 
-         bool shorten_betree, 
-         double& shorten_betree_time, 
          uint64_t nops,
          uint64_t number_of_distinct_keys, FILE *script_input,
-         FILE *script_output) {
+         FILE *script_output, uint64_t batch_size) {
 
-    int write_counter = 0;
-    int read_counter = 0;
-    int granularity = 500;
-    int workload_state = 0;
-    int state = b.get_state();
+    write_batch<uint64_t, std::string> batch;
     
     for (unsigned int i = 0; i < nops; i++) {
-        // if state = 7 it means betree is in fixed mode, 
-        // the value of epsilon do not adjust to the change of workload pattern
-        if (state != 7 && i != 0 && i % granularity == 0) {
-            
-            double write_ratio = write_counter * 1.0 / (write_counter + read_counter);
-            // workload is write heavy
-            if (write_ratio > 0.7 && state > 0) {
-                state--;
-            }
-
-            // workload is read heavy
-            if (write_ratio < 0.3 && state < 3) {
-                state++;
-            }
-
-            // if current workload is write heavy and 
-            // previous betree state is not write heavy
-            if (state == 0 && b.get_state() == 3 ) {
-                std::cout << "betree state (before change state): " << b.get_state() << std::endl;
-                std::cout << "betree epsilon (before change state): " << b.get_epsilon() << std::endl;
-                std::cout << "betree pivot upper bound (before change state): " << b.get_pivot_upper_bound() << std::endl;
-
-                b.set_state(state);
-                b.set_epsilon(write_heavy_epsilon);
-
-                std::cout << "operation number : " << i << ", write_ratio: " << write_ratio << std::endl;
-                std::cout << "betree state: " << b.get_state() << std::endl;
-                std::cout << "betree epsilon: " << b.get_epsilon() << std::endl;
-                std::cout << "betree pivot upper bound: " << b.get_pivot_upper_bound() << std::endl;
-                std::cout << "betree message upper bound: " << b.get_message_upper_bound() << std::endl;
-            
-            }
-
-            // if current workload is read heavy and 
-            // previous betree state is not read heavy
-            if (state == 3 && b.get_state() == 0 ) {
-                std::cout << "betree state (before change state): " << b.get_state() << std::endl;
-                std::cout << "betree epsilon (before change state): " << b.get_epsilon() << std::endl;
-                std::cout << "betree pivot upper bound (before change state): " << b.get_pivot_upper_bound() << std::endl;
-                double average_nodes_height = b.calculateAverageHeight();
-                std::cout << "average betree nodes height(before shortening betree): " << average_nodes_height << std::endl;
-
-                b.set_state(state);
-                b.set_epsilon(read_heavy_epsilon);
-                if (shorten_betree) {
-                    uint64_t timer = 0;
-                    timer_start(timer);
-                    b.shorten_betree();
-                    timer_stop(timer);
-                    shorten_betree_time = timer * 1.0 / 1000000;
-                }
-                
-                // b.shorten_root_node();
-                average_nodes_height = b.calculateAverageHeight();
-                std::cout << "average betree nodes height(before shortening betree): " << average_nodes_height << std::endl;
-
-                std::cout << "operation number : " << i << ", write_ratio: " << write_ratio << std::endl;
-                std::cout << "betree state :" << b.get_state() << std::endl;
-                std::cout << "betree epsilon: " << b.get_epsilon() << std::endl;
-                std::cout << "betree pivot upper bound: " << b.get_pivot_upper_bound() << std::endl;
-                std::cout << "betree message upper bound: " << b.get_message_upper_bound() << std::endl;
-            }
-            
-            write_counter = 0;
-            read_counter = 0;
-        }
-
         printf("%u/%lu\n", i, nops);
         int op;
         uint64_t t;
         if (script_input) {
             int r = next_command(script_input, &op, &t);
-            if (r == EOF)
+            if (r == EOF) {
+                flush_batch(b, batch);
                 exit(0);
+            }
             else if (r < 0)
                 exit(4);
         } else {
@@ -225,20 +268,27 @@ int test(betree<uint64_t, std::string> &b,
                     //printf("Printing insert op!\n");
                     fprintf(script_output, "Inserting %lu\n", t);
                 } 
-                b.insert(t, std::to_string(t) + ":");
-                write_counter++;
+                if (batch_size > 1)
+                    batch.insert(t, std::to_string(t) + ":");
+                else
+                    b.insert(t, std::to_string(t) + ":");
                 break;
             case 1:  // update
                 if (script_output) fprintf(script_output, "Updating %lu\n", t);
-                b.update(t, std::to_string(t) + ":");
-                write_counter++;
+                if (batch_size > 1)
+                    batch.update(t, std::to_string(t) + ":");
+                else
+                    b.update(t, std::to_string(t) + ":");
                 break;
             case 2:  // delete
                 if (script_output) fprintf(script_output, "Deleting %lu\n", t);
-                b.erase(t);
-                write_counter++;
+                if (batch_size > 1)
+                    batch.erase(t);
+                else
+                    b.erase(t);
                 break;
             case 3:  // query
+                flush_batch(b, batch);
                 try {
                     std::string bval = b.query(t);
                     if (script_output)
@@ -248,12 +298,14 @@ int test(betree<uint64_t, std::string> &b,
                     if (script_output)
                         fprintf(script_output, "Query %lu -> DNE\n", t);
                 }
-                read_counter++;
                 break;
             default:
                 abort();
         }
+        if (batch.size() >= batch_size)
+            flush_batch(b, batch);
     }
+    flush_batch(b, batch);
 
 
 
@@ -264,6 +316,36 @@ int test(betree<uint64_t, std::string> &b,
     return 0;
 }
 
+// Apply the first nops operations of script_input to a std::map and
+// bulk load the resulting key/value pairs.  Queries in the script are
+// skipped.
+void bulk_load(betree<uint64_t, std::string> &b, double fill_factor,
+               uint64_t nops, FILE *script_input) {
+    std::map<uint64_t, std::string> pairs;
+    for (uint64_t i = 0; i < nops; i++) {
+        int op;
+        uint64_t t;
+        if (next_command(script_input, &op, &t) == EOF)
+            break;
+        switch (op) {
+            case 0:  // insert
+                pairs[t] = std::to_string(t) + ":";
+                break;
+            case 1:  // update
+                pairs[t] += std::to_string(t) + ":";
+                break;
+            case 2:  // delete
+                pairs.erase(t);
+                break;
+            case 3:  // query
+                break;
+            default:
+                abort();
+        }
+    }
+    b.bulk_load(pairs.begin(), pairs.end(), fill_factor);
+}
+
 void benchmark_upserts(betree<uint64_t, std::string> &b, uint64_t nops,
                        uint64_t number_of_distinct_keys, uint64_t random_seed) {
     uint64_t overall_timer = 0;
@@ -302,52 +384,157 @@ void benchmark_queries(betree<uint64_t, std::string> &b, uint64_t nops,
     printf("# overall: %ld %ld\n", nops, overall_timer);
 }
 
+#define DEFAULT_BENCHMARK_SCANS (16)
 
-// Check if a file exists
-bool fileExists(const std::string& filePath) {
-    struct stat buffer;
-    return (stat(filePath.c_str(), &buffer) == 0);
-}
+// Time the scans test.cpp checks: one full scan, then lower-bound
+// scans from random keys to the end of the tree.
+void benchmark_scans(betree<uint64_t, std::string> &b, swap_space &sspace,
+                     uint64_t nops, uint64_t number_of_distinct_keys,
+                     uint64_t random_seed) {
+    // Pre-load the tree with data
+    srand(random_seed);
+    for (uint64_t i = 0; i < nops; i++) {
+        uint64_t t = rand() % number_of_distinct_keys;
+        b.update(t, std::to_string(t) + ":");
+    }
 
-// Function to copy a file
-bool copyFile(const std::string& sourcePath, const std::string& destinationPath) {
-    std::ifstream sourceFile(sourcePath, std::ios::binary);
-    std::ofstream destinationFile(destinationPath, std::ios::binary);
+    uint64_t elements = 0;
+    uint64_t loads = sspace.get_load_count();
+    uint64_t prefetched = sspace.get_prefetched_reads();
+    uint64_t timer = 0;
+    timer_start(timer);
+    for (auto it = b.begin(); it != b.end(); ++it)
+        elements++;
+    timer_stop(timer);
+    printf("# full scan: %ld elements, %ld us, %ld loads, %ld prefetched\n", elements, timer,
+           sspace.get_load_count() - loads, sspace.get_prefetched_reads() - prefetched);
+
+    elements = 0;
+    loads = sspace.get_load_count();
+    prefetched = sspace.get_prefetched_reads();
+    timer = 0;
+    timer_start(timer);
+    for (uint64_t i = 0; i < DEFAULT_BENCHMARK_SCANS; i++) {
+        uint64_t t = rand() % number_of_distinct_keys;
+        for (auto it = b.lower_bound(t); it != b.end(); ++it)
+            elements++;
+    }
+    timer_stop(timer);
+    printf("# lower-bound scans: %d scans, %ld elements, %ld us, %ld loads, %ld prefetched\n",
+           DEFAULT_BENCHMARK_SCANS, elements, timer,
+           sspace.get_load_count() - loads, sspace.get_prefetched_reads() - prefetched);
+}
 
-    if (!sourceFile || !destinationFile) {
-        return false; // Error in opening source or destination file
+// Run nops random operations, query_percent of them queries and the
+// rest updates, with 1, 2, 4, ... max_threads threads sharing the
+// tree, and report the throughput of each run.  Each thread does its
+// share of the operations with its own random stream.
+void benchmark_threads(betree<uint64_t, std::string> &b, uint64_t nops,
+                       uint64_t number_of_distinct_keys, uint64_t random_seed,
+                       uint64_t max_threads, uint64_t query_percent) {
+    // Pre-load the tree with data
+    srand(random_seed);
+    for (uint64_t i = 0; i < nops; i++) {
+        uint64_t t = rand() % number_of_distinct_keys;
+        b.update(t, std::to_string(t) + ":");
     }
 
-    destinationFile << sourceFile.rdbuf();
-    return true;
+    for (uint64_t nthreads = 1; ; nthreads = std::min(2 * nthreads, max_threads)) {
+        std::vector<std::thread> threads;
+        uint64_t timer = 0;
+        timer_start(timer);
+        for (uint64_t i = 0; i < nthreads; i++) {
+            uint64_t count = nops / nthreads + (i < nops % nthreads ? 1 : 0);
+            unsigned int seed = random_seed + nthreads * max_threads + i;
+            threads.push_back(std::thread([&b, count, seed, number_of_distinct_keys, query_percent]() {
+                unsigned int state = seed;
+                for (uint64_t j = 0; j < count; j++) {
+                    uint64_t t = rand_r(&state) % number_of_distinct_keys;
+                    if ((uint64_t)(rand_r(&state) % 100) < query_percent) {
+                        try {
+                            b.query(t);
+                        } catch (std::out_of_range & e) {}
+                    } else {
+                        b.update(t, std::to_string(t) + ":");
+                    }
+                }
+            }));
+        }
+        for (auto it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+        timer_stop(timer);
+        printf("# threads: %ld, ops: %ld, time(in us): %ld, throughput(ops/s): %.0f\n",
+               nthreads, nops, timer, timer ? nops * 1000000.0 / timer : 0);
+        if (nthreads == max_threads)
+            break;
+    }
 }
 
-// Function to copy all files from a source directory to a destination directory
-bool copyFilesInDirectory(const std::string& sourceDir, const std::string& destDir) {
-    DIR* dir = opendir(sourceDir.c_str());
+// A swappable object for benchmark-pins, just a number.
+class pin_target : public serializable {
+public:
+    pin_target(void) : value(0) {}
 
-    if (dir == nullptr) {
-        return false; // Unable to open the source directory
+    void _serialize(std::iostream &fs, serialization_context &context) {
+        serialize(fs, context, value);
     }
 
-    struct dirent* entry;
+    void _deserialize(std::iostream &fs, serialization_context &context) {
+        deserialize(fs, context, value);
+    }
 
-    while ((entry = readdir(dir)) != nullptr) {
-        if (entry->d_type == DT_REG) { // Check if it's a regular file
-            std::string sourcePath = sourceDir + "/" + entry->d_name;
-            std::string destPath = destDir + "/" + entry->d_name;
+    uint64_t _footprint(void) const {
+        return sizeof(*this);
+    }
 
-            if (!copyFile(sourcePath, destPath)) {
-                closedir(dir);
-                return false; // Error while copying the file
-            }
+    uint64_t value;
+};
+
+// Allocate nobjects objects in sspace, then read random ones through
+// their swap_space pointers, which pins, accesses and unpins each,
+// with 1, 2, 4, ... max_threads threads doing nops reads between
+// them.  With a cache (-C) of at least nobjects objects this measures
+// the object table alone, without any I/O.
+void benchmark_pins(swap_space &sspace, uint64_t nops, uint64_t nobjects,
+                    uint64_t random_seed, uint64_t max_threads) {
+    std::vector<swap_space::pointer<pin_target> > objects;
+    for (uint64_t i = 0; i < nobjects; i++)
+        objects.push_back(sspace.allocate(new pin_target));
+    const std::vector<swap_space::pointer<pin_target> > &objs = objects;
+
+    for (uint64_t nthreads = 1; ; nthreads = std::min(2 * nthreads, max_threads)) {
+        std::vector<std::thread> threads;
+        uint64_t timer = 0;
+        timer_start(timer);
+        for (uint64_t i = 0; i < nthreads; i++) {
+            uint64_t count = nops / nthreads + (i < nops % nthreads ? 1 : 0);
+            unsigned int seed = random_seed + nthreads * max_threads + i;
+            threads.push_back(std::thread([&objs, count, seed]() {
+                unsigned int state = seed;
+                uint64_t sum = 0;
+                for (uint64_t j = 0; j < count; j++)
+                    sum += objs[rand_r(&state) % objs.size()]->value;
+                assert(sum == 0); // every value is 0, checking keeps the reads
+            }));
         }
+        for (auto it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+        timer_stop(timer);
+        printf("# threads: %ld, pins: %ld, time(in us): %ld, throughput(pins/s): %.0f\n",
+               nthreads, nops, timer, timer ? nops * 1000000.0 / timer : 0);
+        if (nthreads == max_threads)
+            break;
     }
+}
 
-    closedir(dir);
-    return true;
+
+// Check if a file exists
+bool fileExists(const std::string& filePath) {
+    struct stat buffer;
+    return (stat(filePath.c_str(), &buffer) == 0);
 }
 
+
 int main(int argc, char **argv) {
     char *mode = NULL;
     uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE; // the max node size of betree is setted here
@@ -356,6 +543,8 @@ int main(int argc, char **argv) {
     uint64_t min_flush_size = max_node_size / 2;
     uint64_t min_node_size = max_node_size / max_node_to_min_flush_ratio;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
+    bool cache_size_given = false;
+    uint64_t cache_bytes = 0;
     char *backing_store_dir = NULL;
     uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
     uint64_t nops = DEFAULT_TEST_NOPS;
@@ -368,6 +557,24 @@ int main(int argc, char **argv) {
     double write_heavy_epsilon = 0.5;
     double read_heavy_epsilon = 0.6;
     bool shorten_betree = false;
+    char *backing_store_type = NULL;
+    int node_format = SERIALIZATION_FORMAT_TEXT;
+    int replacement_policy = REPLACEMENT_POLICY_LRU;
+    uint64_t batch_size = 1;
+    uint64_t flush_interval = 0;
+    uint64_t compressed_cache_bytes = 0;
+    double internal_reserve = 0;
+    int workload_policy = WORKLOAD_POLICY_HYSTERESIS;
+    uint64_t workload_window = DEFAULT_WORKLOAD_WINDOW;
+    bool use_cost_model = false;
+    uint64_t reshape_steps = 0;
+    bool lazy_rebalancing = false;
+    uint64_t subtree_depth = 0;
+    int log_sync_policy = LOG_SYNC_PER_RECORDS;
+    uint64_t log_sync_interval = 1000;
+    double bulk_load_fill_factor = DEFAULT_BULK_LOAD_FILL_FACTOR;
+    uint64_t max_threads = DEFAULT_BENCHMARK_THREADS;
+    uint64_t query_percent = DEFAULT_BENCHMARK_QUERY_PERCENT;
 
     // REQUIRED PARAMETERS FOR PERSISTENCE AND CHECKPOINTING GRANULARITY
     uint64_t persistence_granularity = UINT64_MAX;
@@ -380,7 +587,7 @@ int main(int argc, char **argv) {
     // Argument parsing //
     //////////////////////
 
-    while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:p:c:l:e:a:z:w:r:S:")) != -1) {
+    while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:p:c:l:e:a:z:w:r:S:B:F:R:M:b:W:T:L:j:q:G:Z:I:P:V:H:Y:D:")) != -1) {
         switch (opt) {
             case 'm':
                 mode = optarg;
@@ -414,6 +621,129 @@ int main(int argc, char **argv) {
                     usage(argv[0]);
                     exit(1);
                 }
+                cache_size_given = true;
+                break;
+            case 'b':
+                batch_size = strtoull(optarg, &term, 10);
+                if (*term || batch_size == 0) {
+                    std::cerr << "Argument to -b must be a positive integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'Z':
+                compressed_cache_bytes = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -Z must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                if (strcmp(optarg, "window") == 0) {
+                    workload_policy = WORKLOAD_POLICY_WINDOW;
+                } else if (strcmp(optarg, "ewma") == 0) {
+                    workload_policy = WORKLOAD_POLICY_EWMA;
+                } else if (strcmp(optarg, "hysteresis") == 0) {
+                    workload_policy = WORKLOAD_POLICY_HYSTERESIS;
+                } else if (strcmp(optarg, "cost") == 0) {
+                    use_cost_model = true;
+                } else {
+                    std::cerr << "Invalid argument for -P. Use 'window', 'ewma', 'hysteresis' or 'cost'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'V':
+                workload_window = strtoull(optarg, &term, 10);
+                if (*term || workload_window == 0) {
+                    std::cerr << "Argument to -V must be a positive integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'H':
+                reshape_steps = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -H must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                subtree_depth = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -D must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'Y':
+                if (strcmp(optarg, "true") == 0) {
+                    lazy_rebalancing = true;
+                } else if (strcmp(optarg, "false") == 0) {
+                    lazy_rebalancing = false;
+                } else {
+                    std::cerr << "Invalid argument for -Y. Use 'true' or 'false'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'I':
+                internal_reserve = strtod(optarg, &term);
+                if (*term || internal_reserve < 0 || internal_reserve > 1) {
+                    std::cerr << "Argument to -I must be a number in [0, 1]"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'G':
+                flush_interval = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -G must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                if (strcmp(optarg, "op") == 0) {
+                    log_sync_policy = LOG_SYNC_PER_OP;
+                } else if (strcmp(optarg, "records") == 0) {
+                    log_sync_policy = LOG_SYNC_PER_RECORDS;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    log_sync_policy = LOG_SYNC_PER_INTERVAL;
+                } else if (strcmp(optarg, "none") == 0) {
+                    log_sync_policy = LOG_SYNC_NONE;
+                } else {
+                    std::cerr << "Invalid argument for -W. Use 'op', 'records', 'interval' or 'none'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'T':
+                log_sync_interval = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -T must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                cache_bytes = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -M must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
                 break;
             case 'o':
                 script_outfile = optarg;
@@ -524,6 +854,66 @@ int main(int argc, char **argv) {
                     exit(1);
                 }
                 break;
+            case 'B':
+                backing_store_type = optarg;
+                if (strcmp(optarg, "file-per-object") != 0 &&
+                    strcmp(optarg, "single-file") != 0 &&
+                    strcmp(optarg, "async") != 0 &&
+                    strcmp(optarg, "async-threads") != 0) {
+                    std::cerr << "Invalid argument for -B. Use 'file-per-object', 'single-file', 'async' or 'async-threads'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'F':
+                if (strcmp(optarg, "text") == 0) {
+                    node_format = SERIALIZATION_FORMAT_TEXT;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    node_format = SERIALIZATION_FORMAT_BINARY;
+                } else {
+                    std::cerr << "Invalid argument for -F. Use 'text' or 'binary'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'L':
+                bulk_load_fill_factor = strtod(optarg, &term);
+                if (*term || bulk_load_fill_factor <= 0 || bulk_load_fill_factor > 1) {
+                    std::cerr << "Argument to -L must be a number in (0, 1]"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                max_threads = strtoull(optarg, &term, 10);
+                if (*term || max_threads == 0) {
+                    std::cerr << "Argument to -j must be a positive integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                query_percent = strtoull(optarg, &term, 10);
+                if (*term || query_percent > 100) {
+                    std::cerr << "Argument to -q must be an integer in [0, 100]"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                if (strcmp(optarg, "lru") == 0) {
+                    replacement_policy = REPLACEMENT_POLICY_LRU;
+                } else if (strcmp(optarg, "clock") == 0) {
+                    replacement_policy = REPLACEMENT_POLICY_CLOCK;
+                } else {
+                    std::cerr << "Invalid argument for -R. Use 'lru' or 'clock'."
+                              << std::endl;
+                    exit(1);
+                }
+                break;
             
             
             default:
@@ -535,7 +925,9 @@ int main(int argc, char **argv) {
     }
 
     // CHECK REQUIRED PARAMETERS
-    if (persistence_granularity == UINT64_MAX) {
+    // -p sets the group size, -W op and -W interval do not need it
+    if (persistence_granularity == UINT64_MAX &&
+        (log_sync_policy == LOG_SYNC_PER_RECORDS || log_sync_policy == LOG_SYNC_NONE)) {
         std::cerr << "ERROR: Persistence granularity was not assigned through "
                      "-p! This is a requirement!";
         usage(argv[0]);
@@ -552,9 +944,13 @@ int main(int argc, char **argv) {
     FILE *script_output = NULL;
 
     if (mode == NULL ||
-        (strcmp(mode, "test") != 0 && strcmp(mode, "benchmark-upserts") != 0 &&
-         strcmp(mode, "benchmark-queries") != 0)) {
-        std::cerr << "Must specify a mode of \"test\" or \"benchmark\""
+        (strcmp(mode, "test") != 0 && strcmp(mode, "bulk-load") != 0 &&
+         strcmp(mode, "benchmark-upserts") != 0 &&
+         strcmp(mode, "benchmark-queries") != 0 &&
+         strcmp(mode, "benchmark-scans") != 0 &&
+         strcmp(mode, "benchmark-threads") != 0 &&
+         strcmp(mode, "benchmark-pins") != 0)) {
+        std::cerr << "Must specify a mode of \"test\", \"bulk-load\" or \"benchmark\""
                   << std::endl;
         usage(argv[0]);
         exit(1);
@@ -575,6 +971,13 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (strcmp(mode, "bulk-load") == 0 && script_infile == NULL) {
+        std::cerr << "bulk-load needs an input script, given with -i"
+                  << std::endl;
+        usage(argv[0]);
+        exit(1);
+    }
+
     if (script_infile) {
         script_input = fopen(script_infile, "r");
         if (script_input == NULL) {
@@ -603,16 +1006,34 @@ int main(int argc, char **argv) {
     // Construct a betree and run the tests or benchmarks //
     ////////////////////////////////////////////////////////
 
-    one_file_per_object_backing_store ofpobs(backing_store_dir); //backing_store_dir is tmpdir in this project 
+    backing_store *store = NULL;
+    if (backing_store_type != NULL && strcmp(backing_store_type, "single-file") == 0) {
+        store = new single_file_backing_store(backing_store_dir);
+    } else if (backing_store_type != NULL && strncmp(backing_store_type, "async", strlen("async")) == 0) {
+        async_backing_store *async_store = new async_backing_store(backing_store_dir, strcmp(backing_store_type, "async") == 0);
+        std::cout << "async backing store engine: " << (async_store->is_using_io_uring() ? "io_uring" : "thread pool") << std::endl;
+        store = async_store;
+    } else {
+        store = new one_file_per_object_backing_store(backing_store_dir); //backing_store_dir is tmpdir in this project 
+    }
 
     //ofpobs.reset_ids();
 
-    swap_space sspace(&ofpobs, cache_size);
-    Logs<Op<uint64_t, std::string>> logs(persistence_granularity, checkpoint_granularity, log_file, serialization_context(sspace));
+    // a byte budget replaces the node count unless both are given
+    if (cache_bytes > 0 && !cache_size_given)
+        cache_size = UINT64_MAX;
+    swap_space sspace(store, cache_size, node_format, replacement_policy);
+    sspace.set_cache_bytes(cache_bytes);
+    sspace.set_compressed_cache_bytes(compressed_cache_bytes);
+    sspace.set_internal_reserve(internal_reserve);
+    Logs<Op<uint64_t, std::string>> logs(persistence_granularity, checkpoint_granularity, log_file, serialization_context(sspace),
+                                         log_sync_policy, log_sync_interval);
     //
     betree<uint64_t, std::string> b(&sspace, logs, epsilon, betree_state, max_node_size, min_node_size, min_flush_size);
     
-    b.recovery(LOGGING_FILE_STATUS, SWAPSPACE_OBJECTS_FILE);
+    b.recovery(CHECKPOINT_MANIFEST_FILE);
+    if (flush_interval > 0)
+        sspace.start_flusher(flush_interval);
 
     
     /**
@@ -629,20 +1050,167 @@ int main(int argc, char **argv) {
      *
      */
 
-    if (strcmp(mode, "test") == 0){
-        double shorten_betree_time = 0;
+    if (strcmp(mode, "test") == 0 || strcmp(mode, "bulk-load") == 0){
+        // Only the test adapts epsilon to the workload, unless the
+        // tree is in fixed mode (state 7).  The benchmarks keep the
+        // epsilon they start with.
+        workload_predictor predictor(workload_policy,
+                                     betree_state == WORKLOAD_READ_HEAVY ? WORKLOAD_READ_HEAVY : WORKLOAD_WRITE_HEAVY,
+                                     workload_window);
+        epsilon_cost_model cost_model(std::min(write_heavy_epsilon, read_heavy_epsilon),
+                                      std::max(write_heavy_epsilon, read_heavy_epsilon),
+                                      workload_window);
+        if (strcmp(mode, "test") == 0 && betree_state != 7) {
+            b.set_reshaping(reshape_steps);
+            b.set_lazy_rebalancing(lazy_rebalancing);
+            b.set_subtree_adaptation(subtree_depth, use_cost_model ? WORKLOAD_POLICY_HYSTERESIS : workload_policy,
+                                     workload_window, write_heavy_epsilon, read_heavy_epsilon);
+            if (use_cost_model)
+                b.set_cost_model(&cost_model);
+            else
+                b.set_workload_predictor(&predictor, write_heavy_epsilon, read_heavy_epsilon, shorten_betree);
+        }
 
         uint64_t timer = 0;
         timer_start(timer);
-        test(b, write_heavy_epsilon, read_heavy_epsilon, shorten_betree, shorten_betree_time, nops, number_of_distinct_keys, script_input, script_output);
+        if (strcmp(mode, "test") == 0)
+            test(b, nops, number_of_distinct_keys, script_input, script_output, batch_size);
+        else
+            bulk_load(b, bulk_load_fill_factor, nops, script_input);
         timer_stop(timer);
         double timer_in_second = timer * 1.0 / 1000000;
 
         std::cout << "time consumption: " << timer_in_second << " second " << std::endl;
-        std::cout << "test input: " << script_infile << std::endl;
+        std::cout << "test input: " << (script_infile ? script_infile : "none") << std::endl;
         std::cout << "cache size: " << cache_size << std::endl;
+        std::cout << "cache bytes: " << cache_bytes
+                  << ", resident bytes: " << sspace.get_current_in_memory_bytes()
+                  << ", peak resident bytes: " << sspace.get_peak_in_memory_bytes()
+                  << std::endl;
+        std::cout << "backing store: " << (backing_store_type ? backing_store_type : "file-per-object") << std::endl;
+        std::cout << "node format: " << (node_format == SERIALIZATION_FORMAT_BINARY ? "binary" : "text") << std::endl;
+        std::cout << "batch size: " << batch_size << std::endl;
+        if (strcmp(mode, "bulk-load") == 0)
+            std::cout << "bulk load fill factor: " << bulk_load_fill_factor << std::endl;
+        const char *log_sync_names[] = { "none", "op", "records", "interval" };
+        std::cout << "log sync policy: " << log_sync_names[log_sync_policy] << std::endl;
+        std::cout << "log groups: " << logs.get_group_count()
+                  << ", records per group: " << (logs.get_group_count() ? logs.get_committed_records() * 1.0 / logs.get_group_count() : 0)
+                  << ", commit latency(in us): " << (logs.get_committed_records() ? logs.get_commit_latency_sum() * 1.0 / logs.get_committed_records() : 0)
+                  << ", max commit latency(in us): " << logs.get_commit_latency_max()
+                  << ", sync time(in us): " << logs.get_sync_time()
+                  << std::endl;
+        std::cout << "replacement policy: " << (replacement_policy == REPLACEMENT_POLICY_CLOCK ? "clock" : "lru") << std::endl;
+        std::cout << "write backs: " << sspace.get_write_back_count()
+                  << ", bytes per node: " << (sspace.get_write_back_count() ? sspace.get_write_back_bytes() * 1.0 / sspace.get_write_back_count() : 0)
+                  << ", write back latency(in us): " << (sspace.get_write_back_count() ? sspace.get_write_back_time() * 1.0 / sspace.get_write_back_count() : 0)
+                  << std::endl;
+        std::cout << "loads: " << sspace.get_load_count()
+                  << ", load latency(in us): " << (sspace.get_load_count() ? sspace.get_load_time() * 1.0 / sspace.get_load_count() : 0)
+                  << std::endl;
+        uint64_t live_bytes = sspace.get_live_bytes();
+        uint64_t disk_bytes = sspace.get_disk_bytes();
+        std::cout << "live bytes: " << live_bytes
+                  << ", disk bytes: " << disk_bytes
+                  << ", space amplification: " << (live_bytes ? disk_bytes * 1.0 / live_bytes : 0)
+                  << ", freed versions: " << sspace.get_freed_version_count()
+                  << ", deferred frees: " << sspace.get_deferred_free_count()
+                  << std::endl;
+        uint64_t accesses = sspace.get_memory_hits() + sspace.get_compressed_hits() + sspace.get_store_reads();
+        std::cout << "compressed tier bytes: " << compressed_cache_bytes
+                  << ", compressed bytes: " << sspace.get_current_compressed_bytes()
+                  << ", compression ratio: " << (sspace.get_compressed_output_bytes() ? sspace.get_compressed_input_bytes() * 1.0 / sspace.get_compressed_output_bytes() : 0)
+                  << std::endl;
+        std::cout << "accesses: " << accesses
+                  << ", memory hits: " << sspace.get_memory_hits()
+                  << ", compressed hits: " << sspace.get_compressed_hits()
+                  << ", store reads: " << sspace.get_store_reads()
+                  << ", memory hit rate: " << (accesses ? sspace.get_memory_hits() * 1.0 / accesses : 0)
+                  << ", compressed hit rate: " << (accesses > sspace.get_memory_hits() ? sspace.get_compressed_hits() * 1.0 / (accesses - sspace.get_memory_hits()) : 0)
+                  << std::endl;
+        std::cout << "internal reserve: " << internal_reserve
+                  << ", internal nodes in memory: " << sspace.get_current_internal_objects()
+                  << ", internal bytes in memory: " << sspace.get_current_internal_bytes()
+                  << ", internal node misses: " << sspace.get_internal_misses()
+                  << std::endl;
+        std::cout << "prefetches: " << sspace.get_prefetch_count()
+                  << ", prefetched store reads: " << sspace.get_prefetched_reads()
+                  << std::endl;
+        std::cout << "evictions: " << sspace.get_eviction_count()
+                  << ", dirty evictions: " << sspace.get_dirty_eviction_count()
+                  << ", foreground stall(in us): " << sspace.get_foreground_stall_time()
+                  << std::endl;
+        std::cout << "flusher interval(in us): " << flush_interval
+                  << ", flushes: " << sspace.get_flush_count()
+                  << ", passes: " << sspace.get_flush_passes()
+                  << ", queue depth: " << (sspace.get_flush_passes() ? sspace.get_flush_queue_depth_sum() * 1.0 / sspace.get_flush_passes() : 0)
+                  << ", max queue depth: " << sspace.get_flush_queue_depth_max()
+                  << std::endl;
+        std::cout << "buffer filters: probes saved: " << b.get_filter_probes_saved()
+                  << ", false positives: " << b.get_filter_false_positives()
+                  << std::endl;
+        std::cout << "checkpoints: " << b.get_checkpoint_count()
+                  << ", checkpoint latency(in us): " << (b.get_checkpoint_count() ? b.get_checkpoint_time() * 1.0 / b.get_checkpoint_count() : 0)
+                  << std::endl;
         std::cout << "if shorten Betree when workload changes to read-heavy mode: " << shorten_betree << std::endl;
-        std::cout << "time cost of shortening betree(in second): " << shorten_betree_time << std::endl;
+        std::cout << "time cost of shortening betree(in second): " << b.get_shorten_time() * 1.0 / 1000000 << std::endl;
+        if (use_cost_model) {
+            std::cout << "workload policy: cost"
+                      << ", window: " << workload_window
+                      << ", evaluations: " << cost_model.get_evaluation_count()
+                      << ", epsilon changes: " << cost_model.get_change_count()
+                      << std::endl;
+            std::cout << "cost model: mean observed io per op: " << cost_model.get_mean_observed_cost()
+                      << ", mean prediction error: " << cost_model.get_mean_prediction_error()
+                      << std::endl;
+        } else {
+            const char *workload_policy_names[] = { "window", "ewma", "hysteresis" };
+            std::cout << "workload policy: " << workload_policy_names[workload_policy]
+                      << ", window: " << workload_window
+                      << ", windows: " << predictor.get_window_count()
+                      << ", transitions: " << predictor.get_transition_count()
+                      << ", shortenings: " << b.get_shorten_count()
+                      << std::endl;
+            std::cout << "write heavy mode: " << predictor.get_operations_in_mode(WORKLOAD_WRITE_HEAVY) << " operations, "
+                      << predictor.get_time_in_mode(WORKLOAD_WRITE_HEAVY) << " us"
+                      << ", read heavy mode: " << predictor.get_operations_in_mode(WORKLOAD_READ_HEAVY) << " operations, "
+                      << predictor.get_time_in_mode(WORKLOAD_READ_HEAVY) << " us"
+                      << std::endl;
+        }
+        std::cout << "reshaping: steps per operation: " << reshape_steps
+                  << ", passes: " << b.get_reshape_passes()
+                  << ", steps: " << b.get_reshape_steps()
+                  << ", children absorbed: " << b.get_reshape_absorbed()
+                  << ", time(in us): " << b.get_reshape_time()
+                  << ", longest operation(in us): " << b.get_reshape_longest()
+                  << ", levels left: " << b.get_reshape_levels_left()
+                  << std::endl;
+        std::cout << "lazy rebalancing: " << lazy_rebalancing
+                  << ", nodes rebalanced: " << b.get_rebalanced_nodes()
+                  << ", children merged: " << b.get_rebalance_merges()
+                  << ", overfull nodes split: " << b.get_rebalance_splits()
+                  << std::endl;
+        if (subtree_depth > 0) {
+            auto subtrees = b.get_subtree_stats();
+            std::cout << "subtrees at depth " << subtree_depth << ": " << subtrees.size()
+                      << ", epsilon changes: " << b.get_subtree_epsilon_changes() << std::endl;
+            for (auto &st : subtrees)
+                std::cout << "subtree " << st.start
+                          << ": reads: " << st.reads
+                          << ", writes: " << st.writes
+                          << ", write ratio: " << (st.reads + st.writes ? st.writes * 1.0 / (st.reads + st.writes) : 0)
+                          << ", epsilon: " << st.epsilon
+                          << ", pivot upper bound: " << st.pivot_bound
+                          << ", message upper bound: " << st.message_bound
+                          << ", height: " << st.height
+                          << ", transitions: " << st.transitions
+                          << std::endl;
+        }
+        b.set_workload_predictor(NULL, write_heavy_epsilon, read_heavy_epsilon, shorten_betree);
+        b.set_cost_model(NULL);
+        b.set_reshaping(0);
+        b.set_lazy_rebalancing(false);
+        b.set_subtree_adaptation(0, WORKLOAD_POLICY_HYSTERESIS, DEFAULT_WORKLOAD_WINDOW, 0, 0);
 
         std::cout << "betree parameter: " << std::endl;
         std::cout << "betree split counter: " << b.get_split_counter() << std::endl;
@@ -668,6 +1236,22 @@ int main(int argc, char **argv) {
         // benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
     }
 
+    else if (strcmp(mode, "benchmark-scans") == 0) {
+        benchmark_scans(b, sspace, nops, number_of_distinct_keys, random_seed);
+    }
+
+    else if (strcmp(mode, "benchmark-threads") == 0) {
+        benchmark_threads(b, nops, number_of_distinct_keys, random_seed,
+                          max_threads, query_percent);
+        std::cout << "log groups: " << logs.get_group_count()
+                  << ", records per group: " << (logs.get_group_count() ? logs.get_committed_records() * 1.0 / logs.get_group_count() : 0)
+                  << std::endl;
+    }
+
+    else if (strcmp(mode, "benchmark-pins") == 0) {
+        benchmark_pins(sspace, nops, number_of_distinct_keys, random_seed, max_threads);
+    }
+
     
 
     if (script_input) fclose(script_input);
@@ -675,15 +1259,5 @@ int main(int argc, char **argv) {
     if (script_output) fclose(script_output);
 
 
-    // copy all the files from sourceDir to destinationDir
-    std::string sourceDir = "tmpdir_backup";  
-    std::string destinationDir = "tmpdir"; 
-
-    if (copyFilesInDirectory(sourceDir, destinationDir)) {
-        std::cout << "Files copied successfully." << std::endl;
-    } else {
-        std::cerr << "Error copying files." << std::endl;
-    }
-
     return 0;
 }
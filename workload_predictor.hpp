@@ -0,0 +1,213 @@
+// Predicts whether a betree's workload is write heavy or read heavy,
+// so the tree can pick its epsilon (see betree::set_workload_predictor).
+//
+// The predictor counts the writes and queries it is told about and
+// decides once per window of operations, from the fraction of them
+// that were writes.  A ratio above the write-heavy threshold votes for
+// write-heavy mode and one below the read-heavy threshold for
+// read-heavy mode; ratios in between leave the mode alone.  The
+// policies differ in how votes become mode changes:
+// - window: the last window alone decides.
+// - ewma: the windows' ratios are smoothed with an exponentially
+//   weighted moving average, which then decides.
+// - hysteresis: a counter moves one step toward each window's vote,
+//   between 0 (write heavy) and steps (read heavy), and the mode only
+//   changes when the counter reaches the far end.  This is the policy
+//   test_logging_restore has always used, with 3 steps.
+//
+// observe() may be called from many threads at once.  It only adds to
+// atomic counters, except at the end of a window, which takes a lock.
+
+#ifndef WORKLOAD_PREDICTOR_HPP
+#define WORKLOAD_PREDICTOR_HPP
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#define WORKLOAD_POLICY_WINDOW (0)
+#define WORKLOAD_POLICY_EWMA (1)
+#define WORKLOAD_POLICY_HYSTERESIS (2)
+
+// the modes, numbered as betree states
+#define WORKLOAD_WRITE_HEAVY (0)
+#define WORKLOAD_READ_HEAVY (3)
+
+#define DEFAULT_WORKLOAD_WINDOW (500)
+#define DEFAULT_WORKLOAD_WRITE_HEAVY_RATIO (0.7)
+#define DEFAULT_WORKLOAD_READ_HEAVY_RATIO (0.3)
+#define DEFAULT_WORKLOAD_EWMA_WEIGHT (0.5)
+#define DEFAULT_WORKLOAD_HYSTERESIS_STEPS (3)
+
+class workload_predictor {
+public:
+  workload_predictor(int policy = WORKLOAD_POLICY_HYSTERESIS,
+                     int initial_mode = WORKLOAD_WRITE_HEAVY,
+                     uint64_t window = DEFAULT_WORKLOAD_WINDOW) :
+    policy(policy),
+    window(window),
+    mode(initial_mode),
+    step(initial_mode == WORKLOAD_READ_HEAVY ? DEFAULT_WORKLOAD_HYSTERESIS_STEPS : 0),
+    mode_start(std::chrono::steady_clock::now())
+  {
+    assert(policy == WORKLOAD_POLICY_WINDOW || policy == WORKLOAD_POLICY_EWMA ||
+           policy == WORKLOAD_POLICY_HYSTERESIS);
+    assert(initial_mode == WORKLOAD_WRITE_HEAVY || initial_mode == WORKLOAD_READ_HEAVY);
+    assert(window > 0);
+  }
+
+  // A window's write ratio above write_heavy votes for write-heavy
+  // mode, one below read_heavy for read-heavy mode.
+  void set_thresholds(double write_heavy, double read_heavy) {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(read_heavy <= write_heavy);
+    write_heavy_ratio = write_heavy;
+    read_heavy_ratio = read_heavy;
+  }
+
+  // the weight of the newest window in the ewma policy
+  void set_ewma_weight(double weight) {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(weight > 0 && weight <= 1);
+    ewma_weight = weight;
+  }
+
+  // the windows in a row the hysteresis policy needs to change mode
+  void set_hysteresis_steps(int n) {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(n > 0);
+    hysteresis_steps = n;
+    step = mode == WORKLOAD_READ_HEAVY ? n : 0;
+  }
+
+  // Record writes and reads.  Returns true if they ended a window that
+  // changed the mode.
+  bool observe(uint64_t writes, uint64_t reads) {
+    uint64_t n = writes + reads;
+    if (n == 0)
+      return false;
+    write_count += writes;
+    uint64_t before = operation_count.fetch_add(n);
+    if (before / window == (before + n) / window)
+      return false;
+    return end_window();
+  }
+
+  int get_mode(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return mode;
+  }
+
+  // the ratio the last window decided on: its own, or the average
+  double get_write_ratio(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return last_ratio;
+  }
+
+  uint64_t get_operation_count(void) { return operation_count; }
+  uint64_t get_window_count(void) { return window_count; }
+  uint64_t get_transition_count(void) { return transition_count; }
+
+  // time and operations spent in mode so far, the current stint
+  // included
+  uint64_t get_time_in_mode(int m) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t t = mode_time[index(m)];
+    if (m == mode)
+      t += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mode_start).count();
+    return t;
+  }
+
+  uint64_t get_operations_in_mode(int m) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t n = mode_operations[index(m)];
+    if (m == mode)
+      n += operation_count - mode_first_operation;
+    return n;
+  }
+
+private:
+  static int index(int m) {
+    assert(m == WORKLOAD_WRITE_HEAVY || m == WORKLOAD_READ_HEAVY);
+    return m == WORKLOAD_READ_HEAVY;
+  }
+
+  // Decide on the window that just ended.  Operations another thread
+  // records meanwhile may land in either window.
+  bool end_window(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t ops = operation_count;
+    uint64_t writes = write_count.exchange(0);
+    double ratio = writes * 1.0 / (ops - window_start);
+    window_start = ops;
+    window_count++;
+
+    int vote = mode;
+    switch (policy) {
+    case WORKLOAD_POLICY_WINDOW:
+      last_ratio = ratio;
+      vote = to_mode(ratio);
+      break;
+    case WORKLOAD_POLICY_EWMA:
+      last_ratio = window_count == 1 ? ratio : ewma_weight * ratio + (1 - ewma_weight) * last_ratio;
+      vote = to_mode(last_ratio);
+      break;
+    case WORKLOAD_POLICY_HYSTERESIS:
+      last_ratio = ratio;
+      if (ratio > write_heavy_ratio && step > 0)
+        step--;
+      if (ratio < read_heavy_ratio && step < hysteresis_steps)
+        step++;
+      if (step == 0)
+        vote = WORKLOAD_WRITE_HEAVY;
+      else if (step == hysteresis_steps)
+        vote = WORKLOAD_READ_HEAVY;
+      break;
+    }
+    if (vote == mode)
+      return false;
+
+    auto now = std::chrono::steady_clock::now();
+    mode_time[index(mode)] += std::chrono::duration_cast<std::chrono::microseconds>(now - mode_start).count();
+    mode_operations[index(mode)] += ops - mode_first_operation;
+    mode_start = now;
+    mode_first_operation = ops;
+    mode = vote;
+    transition_count++;
+    return true;
+  }
+
+  int to_mode(double ratio) {
+    if (ratio > write_heavy_ratio)
+      return WORKLOAD_WRITE_HEAVY;
+    if (ratio < read_heavy_ratio)
+      return WORKLOAD_READ_HEAVY;
+    return mode;
+  }
+
+  const int policy;
+  const uint64_t window;
+  std::atomic<uint64_t> operation_count{0};
+  std::atomic<uint64_t> write_count{0};
+
+  // the rest is guarded by lock
+  std::mutex lock;
+  int mode;
+  double write_heavy_ratio = DEFAULT_WORKLOAD_WRITE_HEAVY_RATIO;
+  double read_heavy_ratio = DEFAULT_WORKLOAD_READ_HEAVY_RATIO;
+  double ewma_weight = DEFAULT_WORKLOAD_EWMA_WEIGHT;
+  int hysteresis_steps = DEFAULT_WORKLOAD_HYSTERESIS_STEPS;
+  int step;
+  double last_ratio = 0;
+  uint64_t window_start = 0;
+  std::atomic<uint64_t> window_count{0};
+  std::atomic<uint64_t> transition_count{0};
+  std::chrono::steady_clock::time_point mode_start;
+  uint64_t mode_first_operation = 0;
+  uint64_t mode_time[2] = { 0, 0 };
+  uint64_t mode_operations[2] = { 0, 0 };
+};
+
+#endif // WORKLOAD_PREDICTOR_HPP